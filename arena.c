@@ -60,13 +60,7 @@ void arena_destroy(arena_t* arena)
 {
     if (arena) {
         arena_trim(arena);
-        list_head* p = arena->blocks.next;
-        while (p != NULL) {
-            list_head* next = p->next;
-            free(list_entry(p, block_t, link));
-            p = next;
-        }
-
+        arena_reset(arena);
         free(arena);
     }
 }
@@ -126,6 +120,20 @@ void arena_trim(arena_t* arena)
     }
 }
 
+void arena_reset(arena_t* arena)
+{
+    if (arena) {
+        list_head* p = arena->blocks.next;
+        while (p != NULL) {
+            list_head* next = p->next;
+            free(list_entry(p, block_t, link));
+            p = next;
+        }
+
+        list_init(&arena->blocks);
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 #if defined(TEST)
@@ -164,6 +172,10 @@ static void arena_test(void)
     arena_trim(a);
     CU_ASSERT_TRUE(list_empty(&a->freelist));
 
+    arena_reset(a);
+    CU_ASSERT_TRUE(list_empty(&a->blocks));
+    CU_ASSERT(arena_alloc(a, 10) != NULL);
+
     arena_destroy(a);
 }
 TEST_ADD(arena_test);
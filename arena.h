@@ -35,6 +35,11 @@ void arena_free(arena_t* arena, void* ptr);
  */
 void arena_trim(arena_t* arena);
 
+/**
+ * \brief   Free all allocated blocks at once, arena can be used again
+ */
+void arena_reset(arena_t* arena);
+
 /**
  * \brief   Free existing arena and all allocated blocks
  */
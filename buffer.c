@@ -1,61 +1,568 @@
 #include "buffer.h"
+#include "srcmgr.h"
+#include "charscan.h"
+#include "arena.h"
+#include "list.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+
+/*
+ * Source cache.
+ * Every file is mapped only once and identified by (device, inode, mtime, size), so hard links, symlinks
+ * and differently spelled paths to the same file share a single mapping.
+ * All spellings we have seen are remembered as well, so reopening a known path does not need a single syscall.
+ * Cache is shared between threads and protected by a single lock, file system calls are made outside of it.
+ */
+
+/*
+ * Translation phases 1 and 2.
+ * Trigraphs are replaced if enabled and backslash-newline pairs are removed before anything is lexed. Most files
+ * have neither, so text is checked with a vector scan first and used as is when it is clean. Otherwise it is copied,
+ * clean runs between the places that need work are moved in bulk, and a splice table is built to map lexed
+ * offsets back to the original text for diagnostics.
+ */
+
+typedef struct
+{
+    char* data;                 // NULL if text did not need any changes
+    size_t size;
+    source_splice_t* splices;
+    size_t splice_count;
+} spliced_text_t;
 
-struct input_buffer
+static char trigraph_char(char c)
+{
+    switch (c) {
+    case '=':  return '#';
+    case '(':  return '[';
+    case '/':  return '\\';
+    case ')':  return ']';
+    case '\'': return '^';
+    case '<':  return '{';
+    case '!':  return '|';
+    case '>':  return '}';
+    case '-':  return '~';
+    default:   return 0;
+    }
+}
+
+// Length of the newline at 'p' or 0
+static size_t newline_length(const char* p, const char* end)
 {
+    if (p >= end || (*p != '\n' && *p != '\r')) {
+        return 0;
+    }
+
+    return (p[0] == '\r' && p + 1 < end && p[1] == '\n') ? 2 : 1;
+}
+
+// Next backslash-newline, or question mark pair if trigraphs are replaced
+static inline const char* splice_find(const char* p, const char* end, bool trigraphs)
+{
+    if (trigraphs) {
+        return charscan_find_splice(p, end);
+    }
+
+    // Backslashes of escape sequences are far more common than splices
+    for (p = charscan_find_char(p, end, '\\'); p + 1 < end; p = charscan_find_char(p + 1, end, '\\')) {
+        if (p[1] == '\n' || p[1] == '\r') {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+static int splice_text(const char* data, size_t size, bool trigraphs, spliced_text_t* out)
+{
+    memset(out, 0, sizeof(*out));
+
+    const char* end = data + size;
+    const char* p = splice_find(data, end, trigraphs);
+    if (p == end) {
+        return 0;
+    }
+
+    if (size > UINT32_MAX) {
+        return EFBIG;
+    }
+
+    // Text only gets shorter
+    char* copy = malloc(size);
+    if (!copy) {
+        return ENOMEM;
+    }
+
+    source_splice_t* splices = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint32_t delta = 0;
+
+    char* q = copy;
+    const char* from = data;
+    while (p < end) {
+        memcpy(q, from, p - from);
+        q += p - from;
+
+        size_t skip = 0;
+        if (*p == '\\') {
+            skip = 1 + newline_length(p + 1, end);
+        } else {
+            char c = (p + 2 < end ? trigraph_char(p[2]) : 0);
+            if (!c) {
+                // Second question mark can still start a trigraph
+                *q++ = '?';
+                from = p + 1;
+                p = splice_find(from, end, trigraphs);
+                continue;
+            }
+
+            // ??/ is a backslash and can splice lines too
+            skip = (c == '\\' ? newline_length(p + 3, end) : 0);
+            if (skip) {
+                skip += 3;
+            } else {
+                *q++ = c;
+                skip = 2;
+                ++p;
+            }
+        }
+
+        from = p + skip;
+        delta += skip;
+
+        uint32_t offset = q - copy;
+        if (count && splices[count - 1].offset == offset) {
+            splices[count - 1].delta = delta;
+        } else {
+            if (count == capacity) {
+                capacity = (capacity ? capacity * 2 : 16);
+                source_splice_t* grown = realloc(splices, capacity * sizeof(*splices));
+                if (!grown) {
+                    free(splices);
+                    free(copy);
+                    return ENOMEM;
+                }
+
+                splices = grown;
+            }
+
+            splices[count++] = (source_splice_t){ offset, delta };
+        }
+
+        p = splice_find(from, end, trigraphs);
+    }
+
+    // Question marks that were not trigraphs after all
+    if (!count) {
+        free(copy);
+        return 0;
+    }
+
+    memcpy(q, from, end - from);
+    q += end - from;
+
+    out->data = copy;
+    out->size = q - copy;
+    out->splices = splices;
+    out->splice_count = count;
+    return 0;
+}
+
+static void spliced_text_free(spliced_text_t* text)
+{
+    free(text->data);
+    free(text->splices);
+    memset(text, 0, sizeof(*text));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+} source_id_t;
+
+typedef struct
+{
+    slist_head link;
+    char path[0];
+} source_alias_t;
+
+typedef struct source_file
+{
+    list_head link;         // Link in the list of all cached files
+    source_id_t id;
+    slist_head aliases;     // All known paths that resolve to this file
     char* data;
     size_t size;
+    spliced_text_t text;    // Text after phases 1 and 2 if it differs from file contents
+    bool trigraphs;         // Text was spliced with trigraphs replaced
+    unsigned refcount;      // Open views
+} source_file_t;
+
+struct input_buffer
+{
+    char* data;             // Text to be lexed
+    size_t size;
     size_t pos;
-    bool external_data;
+    const char* raw;        // Original text, same as data unless it had to be spliced
+    size_t raw_size;
+    const spliced_text_t* text;
+    spliced_text_t owned;   // Spliced text of a memory buffer
+    source_file_t* file;    // Backing cached file or NULL for external memory buffers
+    char* path;             // Path the file was opened with, NULL for memory buffers
+    uint32_t base;          // Global offset in source manager, 0 until registered
 };
 
-input_buffer_t* buffer_open(const char* path)
+//////////////////////////////////////////////////////////////////////////////
+
+#define HASH_KEY_TYPE const char*
+#define HASH_VALUE_TYPE source_file_t*
+#define HASH_FUNC source_path_hash
+#define HASH_KEY_CMP_FUNC source_path_cmp
+#define HASH_PREFIX source_path_table
+
+// http://www.cse.yorku.ca/~oz/hash.html
+static uint32_t source_path_hash(const char* str)
 {
-    if (!path) {
+    uint32_t hash = 0;
+    int c;
+
+    while ((c = *str++)) {
+        hash = c + (hash << 6) + (hash << 16) - hash;
+    }
+
+    return hash;
+}
+
+static bool source_path_cmp(const char* lhv, const char* rhv) {
+    return 0 == strcmp(lhv, rhv);
+}
+
+#include "small_object_set.inl"
+
+#undef  HASH_KEY_TYPE
+#define HASH_KEY_TYPE source_id_t
+
+#undef  HASH_FUNC
+#define HASH_FUNC source_id_hash
+
+#undef  HASH_KEY_CMP_FUNC
+#define HASH_KEY_CMP_FUNC source_id_cmp
+
+#undef  HASH_PREFIX
+#define HASH_PREFIX source_id_table
+
+static uint32_t source_id_hash(source_id_t id) {
+    uint64_t key = ((uint64_t)id.dev * 0x9e3779b97f4a7c15ull) ^ (uint64_t)id.ino;
+    key ^= key >> 29;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 32;
+    return (uint32_t)key;
+}
+
+static bool source_id_cmp(source_id_t lhv, source_id_t rhv) {
+    return (lhv.dev == rhv.dev) &&
+           (lhv.ino == rhv.ino) &&
+           (lhv.size == rhv.size) &&
+           (lhv.mtime.tv_sec == rhv.mtime.tv_sec) &&
+           (lhv.mtime.tv_nsec == rhv.mtime.tv_nsec);
+}
+
+#include "small_object_set.inl"
+
+static arena_t* g_source_arena = NULL;
+static source_path_table_t* g_source_paths = NULL;
+static source_id_table_t* g_source_ids = NULL;
+static list_head g_source_files = LIST_INIT;
+static pthread_mutex_t g_source_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Mapping used for empty files, mmap does not like zero length
+static char g_empty_file[1] = {0};
+
+static int source_cache_init(void)
+{
+    if (g_source_arena) {
+        return 0;
+    }
+
+    g_source_arena = arena_create();
+    g_source_paths = source_path_table_create();
+    g_source_ids = source_id_table_create();
+    if (!g_source_arena || !g_source_paths || !g_source_ids) {
+        source_id_table_destroy(g_source_ids);
+        source_path_table_destroy(g_source_paths);
+        arena_destroy(g_source_arena);
+        g_source_ids = NULL;
+        g_source_paths = NULL;
+        g_source_arena = NULL;
+        return ENOMEM;
+    }
+
+    list_init(&g_source_files);
+    return 0;
+}
+
+static int source_add_alias(source_file_t* file, const char* path)
+{
+    size_t len = strlen(path);
+    source_alias_t* alias = arena_alloc(g_source_arena, sizeof(*alias) + len + 1);
+    if (!alias) {
+        return ENOMEM;
+    }
+
+    memcpy(alias->path, path, len + 1);
+    if (0 != source_path_table_insert(g_source_paths, alias->path, file)) {
+        arena_free(g_source_arena, alias);
+        return ENOMEM;
+    }
+
+    slist_insert(&file->aliases, &alias->link);
+    return 0;
+}
+
+static void source_release(source_file_t* file)
+{
+    assert(file->refcount == 0);
+
+    slist_for_each(file->aliases, p) {
+        source_path_table_remove(g_source_paths, slist_entry(p, source_alias_t, link)->path);
+    }
+
+    while (!slist_empty(&file->aliases)) {
+        slist_head* p = file->aliases.next;
+        slist_remove(&file->aliases, p);
+        arena_free(g_source_arena, slist_entry(p, source_alias_t, link));
+    }
+
+    source_id_table_remove(g_source_ids, file->id);
+
+    if (file->data && (file->data != g_empty_file)) {
+        munmap(file->data, file->size);
+    }
+
+    spliced_text_free(&file->text);
+    list_remove(&file->link);
+    arena_free(g_source_arena, file);
+}
+
+// Find cached file by its id and remember a new spelling of its path.
+// Returns referenced file. Called with cache lock held.
+static source_file_t* source_find_id(source_id_t id, const char* path)
+{
+    source_file_t* file = source_id_table_search(g_source_ids, id);
+    if (!file) {
         return NULL;
     }
 
+    // Failing to remember an alias only costs us the fast path next time
+    if (source_path_table_search(g_source_paths, path) != file) {
+        (void) source_add_alias(file, path);
+    }
+
+    ++file->refcount;
+    return file;
+}
+
+// Store a new mapping in cache.
+// Returns referenced file. Called with cache lock held.
+// Takes ownership of spliced text on success.
+static source_file_t* source_insert(source_id_t id, char* data, size_t size, spliced_text_t* text, bool trigraphs,
+                                    const char* path)
+{
+    source_file_t* file = arena_alloc(g_source_arena, sizeof(*file));
+    if (!file) {
+        return NULL;
+    }
+
+    file->id = id;
+    file->data = data;
+    file->size = size;
+    memset(&file->text, 0, sizeof(file->text));
+    file->refcount = 0;
+    slist_init(&file->aliases);
+
+    if (0 != source_id_table_insert(g_source_ids, id, file)) {
+        arena_free(g_source_arena, file);
+        return NULL;
+    }
+
+    list_insert(&g_source_files, &file->link);
+
+    if (0 != source_add_alias(file, path)) {
+        file->data = NULL; // Caller still owns the mapping
+        source_release(file);
+        return NULL;
+    }
+
+    file->text = *text;
+    file->trigraphs = trigraphs;
+    memset(text, 0, sizeof(*text));
+    ++file->refcount;
+    return file;
+}
+
+// Slow path for paths we have not seen before.
+// Returns referenced file.
+static source_file_t* source_map(const char* path, bool trigraphs)
+{
     struct stat st;
     if (stat(path, &st) != 0) {
         return NULL;
     }
 
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
+    source_id_t id = {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .mtime = st.st_mtim,
+        .size = st.st_size,
+    };
+
+    // Same file under a different name
+    pthread_mutex_lock(&g_source_lock);
+    source_file_t* file = source_find_id(id, path);
+    pthread_mutex_unlock(&g_source_lock);
+
+    if (file) {
+        return file;
+    }
+
+    // Map without holding the lock so that concurrent loads overlap
+    char* data = g_empty_file;
+    if (st.st_size > 0) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return NULL;
+        }
+
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED) {
+            return NULL;
+        }
+    }
+
+    // Splicing is done once per file and shared by all views in the same mode
+    spliced_text_t text;
+    if (0 != splice_text(data, st.st_size, trigraphs, &text)) {
+        if (data != g_empty_file) {
+            munmap(data, st.st_size);
+        }
+
         return NULL;
     }
 
-    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
+    // Someone could have mapped the same file while we were not looking
+    pthread_mutex_lock(&g_source_lock);
+    file = source_find_id(id, path);
+    if (!file) {
+        file = source_insert(id, data, st.st_size, &text, trigraphs, path);
+        if (file) {
+            data = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_source_lock);
+
+    spliced_text_free(&text);
+    if (data && (data != g_empty_file)) {
+        munmap(data, st.st_size);
+    }
+
+    return file;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+input_buffer_t* buffer_open(const char* path)
+{
+    return buffer_open_flags(path, 0);
+}
+
+input_buffer_t* buffer_open_flags(const char* path, unsigned flags)
+{
+    bool trigraphs = (flags & kBufferTrigraphs);
+    if (!path) {
+        return NULL;
+    }
 
-    if (data == NULL) {
+    pthread_mutex_lock(&g_source_lock);
+    source_file_t* file = NULL;
+    int error = source_cache_init();
+    if (!error) {
+        file = source_path_table_search(g_source_paths, path);
+        if (file) {
+            ++file->refcount;
+        }
+    }
+    pthread_mutex_unlock(&g_source_lock);
+
+    if (error) {
         return NULL;
     }
 
+    if (!file) {
+        file = source_map(path, trigraphs);
+        if (!file) {
+            return NULL;
+        }
+    }
+
     input_buffer_t* ib = (input_buffer_t*) calloc(1, sizeof(*ib));
     if (!ib) {
-        munmap(data, st.st_size);
+        pthread_mutex_lock(&g_source_lock);
+        --file->refcount;
+        pthread_mutex_unlock(&g_source_lock);
         return NULL;
     }
 
-    ib->data = data;
-    ib->size = st.st_size;
+    ib->raw = file->data;
+    ib->raw_size = file->size;
+    ib->text = &file->text;
     ib->pos = 0;
-    ib->external_data = false;
+    ib->file = file;
+    ib->path = strdup(path);
+
+    // File was first opened with trigraphs set the other way, this view gets text of its own
+    int splice_error = 0;
+    if (file->trigraphs != trigraphs) {
+        splice_error = splice_text(file->data, file->size, trigraphs, &ib->owned);
+        ib->text = &ib->owned;
+    }
+
+    ib->data = (ib->text->data ? ib->text->data : file->data);
+    ib->size = (ib->text->data ? ib->text->size : file->size);
+
+    if (!ib->path || splice_error) {
+        buffer_close(ib);
+        return NULL;
+    }
 
     return ib;
 }
 
 input_buffer_t* buffer_mem(void* data, size_t size)
+{
+    return buffer_mem_flags(data, size, 0);
+}
+
+input_buffer_t* buffer_mem_flags(void* data, size_t size, unsigned flags)
 {
     if (!data) {
         return NULL;
@@ -66,23 +573,86 @@ input_buffer_t* buffer_mem(void* data, size_t size)
         return NULL;
     }
 
-    ib->data = data;
-    ib->size = size;
+    if (0 != splice_text(data, size, (flags & kBufferTrigraphs), &ib->owned)) {
+        free(ib);
+        return NULL;
+    }
+
+    ib->raw = data;
+    ib->raw_size = size;
+    ib->text = &ib->owned;
+    ib->data = (ib->owned.data ? ib->owned.data : data);
+    ib->size = (ib->owned.data ? ib->owned.size : size);
     ib->pos = 0;
-    ib->external_data = true;
+    ib->file = NULL;
 
     return ib;
 }
 
 void buffer_close(input_buffer_t* ib)
 {
-    if (ib && !ib->external_data) {
-        munmap(ib->data, ib->size);
+    if (ib && ib->file) {
+        pthread_mutex_lock(&g_source_lock);
+        assert(ib->file->refcount > 0);
+        --ib->file->refcount;
+        pthread_mutex_unlock(&g_source_lock);
+    }
+
+    if (ib) {
+        if (ib->base) {
+            srcmgr_remove(ib->base);
+        }
+
+        spliced_text_free(&ib->owned);
+        free(ib->path);
     }
 
     free(ib);
 }
 
+static void source_cache_trim(void)
+{
+    list_head* p = g_source_files.next;
+    while (p != NULL) {
+        list_head* next = p->next;
+        source_file_t* file = list_entry(p, source_file_t, link);
+        if (file->refcount == 0) {
+            source_release(file);
+        }
+        p = next;
+    }
+}
+
+void buffer_cache_trim(void)
+{
+    pthread_mutex_lock(&g_source_lock);
+    if (g_source_arena) {
+        source_cache_trim();
+    }
+    pthread_mutex_unlock(&g_source_lock);
+}
+
+void buffer_cache_destroy(void)
+{
+    pthread_mutex_lock(&g_source_lock);
+    if (g_source_arena) {
+        list_for_each(g_source_files, p) {
+            assert(list_entry(p, source_file_t, link)->refcount == 0);
+        }
+
+        source_cache_trim();
+
+        source_id_table_destroy(g_source_ids);
+        source_path_table_destroy(g_source_paths);
+        arena_destroy(g_source_arena);
+
+        g_source_ids = NULL;
+        g_source_paths = NULL;
+        g_source_arena = NULL;
+    }
+    pthread_mutex_unlock(&g_source_lock);
+}
+
 #if 0
 const char* buffer_getline(input_buffer_t* ib)
 {
@@ -139,6 +709,42 @@ size_t buffer_get_offset(input_buffer_t* ib)
     return ib->pos;
 }
 
+const char* buffer_get_data(input_buffer_t* ib)
+{
+    if (!ib) {
+        return NULL;
+    }
+
+    return ib->data;
+}
+
+size_t buffer_get_size(input_buffer_t* ib)
+{
+    if (!ib) {
+        return 0;
+    }
+
+    return ib->size;
+}
+
+int buffer_get_base(input_buffer_t* ib, uint32_t* base)
+{
+    if (!ib || !base) {
+        return EINVAL;
+    }
+
+    if (!ib->base) {
+        int error = srcmgr_add_spliced(ib->path ? ib->path : "<memory>", ib->data, ib->size, ib->raw, ib->raw_size,
+                                       ib->text->splices, ib->text->splice_count, &ib->base);
+        if (error) {
+            return error;
+        }
+    }
+
+    *base = ib->base;
+    return 0;
+}
+
 void buffer_set_offset(input_buffer_t* ib, size_t pos)
 {
     if (ib) {
@@ -168,6 +774,172 @@ static void input_buffer_test(void)
 }
 TEST_ADD(input_buffer_test);
 
+static void source_cache_test(void)
+{
+    char path[] = "/tmp/shlang-cc-test-XXXXXX";
+    int fd = mkstemp(path);
+    CU_ASSERT(fd >= 0);
+    CU_ASSERT_EQUAL(4, write(fd, "test", 4));
+    close(fd);
+
+    char link[sizeof(path) + 5];
+    snprintf(link, sizeof(link), "%s.link", path);
+    CU_ASSERT_EQUAL(0, symlink(path, link));
+
+    input_buffer_t* ib1 = buffer_open(path);
+    CU_ASSERT(ib1 != NULL);
+    CU_ASSERT_EQUAL(ib1->file->refcount, 1);
+
+    // Second view shares the mapping but not the position
+    CU_ASSERT_EQUAL('t', buffer_getchar(ib1));
+    input_buffer_t* ib2 = buffer_open(path);
+    CU_ASSERT(ib2 != NULL);
+    CU_ASSERT_EQUAL(ib2->file, ib1->file);
+    CU_ASSERT_EQUAL(ib2->data, ib1->data);
+    CU_ASSERT_EQUAL(ib1->file->refcount, 2);
+    CU_ASSERT_EQUAL(0, buffer_get_offset(ib2));
+
+    // Different spelling of the same file is resolved by inode
+    input_buffer_t* ib3 = buffer_open(link);
+    CU_ASSERT(ib3 != NULL);
+    CU_ASSERT_EQUAL(ib3->file, ib1->file);
+    CU_ASSERT(source_path_table_search(g_source_paths, link) == ib1->file);
+
+    // Mapping outlives its views until trimmed
+    source_file_t* file = ib1->file;
+    buffer_close(ib1);
+    buffer_close(ib2);
+    buffer_close(ib3);
+    CU_ASSERT_EQUAL(file->refcount, 0);
+    CU_ASSERT(source_path_table_search(g_source_paths, path) == file);
+
+    // Cached path is served without touching the file system
+    unlink(link);
+    unlink(path);
+    ib1 = buffer_open(path);
+    CU_ASSERT(ib1 != NULL);
+    CU_ASSERT_EQUAL('t', buffer_getchar(ib1));
+    buffer_close(ib1);
+
+    buffer_cache_trim();
+    CU_ASSERT(source_path_table_search(g_source_paths, path) == NULL);
+    CU_ASSERT(buffer_open(path) == NULL);
+
+    buffer_cache_destroy();
+}
+TEST_ADD(source_cache_test);
+
+// Phases 1 and 2 done the obvious way, one after another
+static size_t splice_reference(const char* in, size_t size, bool trigraphs, char* out)
+{
+    char* tmp = malloc(size + 1);
+    size_t n = 0;
+    for (size_t i = 0; i < size; ++i) {
+        char c = (trigraphs && i + 2 < size && in[i] == '?' && in[i + 1] == '?' ? trigraph_char(in[i + 2]) : 0);
+        if (c) {
+            tmp[n++] = c;
+            i += 2;
+        } else {
+            tmp[n++] = in[i];
+        }
+    }
+
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t nl = (tmp[i] == '\\' ? newline_length(tmp + i + 1, tmp + n) : 0);
+        if (nl) {
+            i += nl;
+        } else {
+            out[m++] = tmp[i];
+        }
+    }
+
+    free(tmp);
+    return m;
+}
+
+static void splice_test(void)
+{
+    const char alphabet[] = "?\\\n\r=/(!-ax ";
+    char raw[300];
+    char expected[300];
+
+    srand(5);
+    for (int n = 0; n < 10000; ++n) {
+        bool trigraphs = (n % 2);
+
+        // Dense runs of special characters and long clean runs so that vector code gets to skip whole blocks
+        int density = 2 + n % 32;
+        size_t len = rand() % sizeof(raw);
+        for (size_t i = 0; i < len; ++i) {
+            raw[i] = (rand() % density) ? 'a' + rand() % 26 : alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+
+        size_t expected_len = splice_reference(raw, len, trigraphs, expected);
+
+        spliced_text_t text;
+        CU_ASSERT_FALSE(splice_text(raw, len, trigraphs, &text));
+
+        const char* data = (text.data ? text.data : raw);
+        size_t size = (text.data ? text.size : len);
+        CU_ASSERT_EQUAL(size, expected_len);
+        CU_ASSERT(size == expected_len && 0 == memcmp(data, expected, size));
+        CU_ASSERT_EQUAL(text.data == NULL, expected_len == len && 0 == memcmp(raw, expected, len));
+
+        // Every byte maps back to itself or to the trigraph it came from
+        size_t k = 0;
+        for (size_t i = 0; i < size; ++i) {
+            while (k < text.splice_count && text.splices[k].offset <= i) {
+                ++k;
+            }
+
+            size_t r = i + (k ? text.splices[k - 1].delta : 0);
+            bool match = (r < len) && (raw[r] == data[i] || (trigraphs &&
+                r + 2 < len && raw[r] == '?' && raw[r + 1] == '?' && trigraph_char(raw[r + 2]) == data[i]));
+            CU_ASSERT_TRUE(match);
+        }
+
+        spliced_text_free(&text);
+    }
+
+    // Views see spliced text, trigraphs are left alone unless enabled
+    char str[] = "#define X 1 + \\\n 2 ?\?/\r\n3 ?\?( ??";
+    input_buffer_t* ib = buffer_mem(str, strlen(str));
+    CU_ASSERT_EQUAL(buffer_get_size(ib), strlen("#define X 1 +  2 ?\?/\r\n3 ?\?( ??"));
+    CU_ASSERT(0 == memcmp(buffer_get_data(ib), "#define X 1 +  2 ?\?/\r\n3 ?\?( ??", buffer_get_size(ib)));
+    buffer_close(ib);
+
+    ib = buffer_mem_flags(str, strlen(str), kBufferTrigraphs);
+    CU_ASSERT_EQUAL(buffer_get_size(ib), strlen("#define X 1 +  2 3 [ ??"));
+    CU_ASSERT(0 == memcmp(buffer_get_data(ib), "#define X 1 +  2 3 [ ??", buffer_get_size(ib)));
+    buffer_close(ib);
+
+    ib = buffer_mem_flags(str, 13, kBufferTrigraphs);
+    CU_ASSERT_EQUAL(buffer_get_data(ib), str);
+    buffer_close(ib);
+
+    // Cached file keeps the text of the mode it was first opened in, views in the other mode splice their own
+    char path[] = "/tmp/shlang-cc-test-XXXXXX";
+    int fd = mkstemp(path);
+    CU_ASSERT_FATAL(fd >= 0);
+    CU_ASSERT_EQUAL(write(fd, "x?\?!y", 5), 5);
+    close(fd);
+
+    input_buffer_t* plain = buffer_open(path);
+    input_buffer_t* replaced = buffer_open_flags(path, kBufferTrigraphs);
+    CU_ASSERT_FATAL(plain != NULL && replaced != NULL);
+    CU_ASSERT_EQUAL(plain->file, replaced->file);
+    CU_ASSERT_EQUAL(buffer_get_size(plain), 5);
+    CU_ASSERT_EQUAL(buffer_get_size(replaced), 3);
+    CU_ASSERT(0 == memcmp(buffer_get_data(replaced), "x|y", 3));
+
+    buffer_close(plain);
+    buffer_close(replaced);
+    unlink(path);
+    buffer_cache_trim();
+}
+TEST_ADD(splice_test);
+
 #endif
 
 /////////////////////////////////////////////////////////////////////////////////
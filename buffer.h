@@ -6,21 +6,88 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct input_buffer input_buffer_t;
 
+/**
+ * \brief   Options of a buffer view, they are fixed when it is opened
+ */
+typedef enum
+{
+    kBufferTrigraphs = 1 << 0,  /* Replace trigraphs. Off by default, as in GNU modes: "??!" in a string literal stays as it is written. */
+} buffer_flags_t;
+
+/**
+ * \brief   Open a source file
+ *
+ * Files are mapped once and shared through a process-wide source cache keyed by (device, inode, mtime, size).
+ * Each call returns a new view with its own read position.
+ * Reopening a path that is already cached does not touch the file system.
+ */
 input_buffer_t* buffer_open(const char* path);
 
+/**
+ * \brief   Open a source file with buffer_flags_t options
+ *
+ * Cached file keeps the text of the mode it was first opened in, views in the other mode splice text of their own.
+ */
+input_buffer_t* buffer_open_flags(const char* path, unsigned flags);
+
 input_buffer_t* buffer_mem(void* data, size_t size);
 
+/**
+ * \brief   View of text in memory with buffer_flags_t options
+ */
+input_buffer_t* buffer_mem_flags(void* data, size_t size, unsigned flags);
+
 const char* buffer_getline(input_buffer_t* b);
 
 char buffer_getchar(input_buffer_t* b);
 
 size_t buffer_get_offset(input_buffer_t* ib);
 
+/**
+ * \brief   Buffer contents after translation phases 1 and 2
+ *
+ * Backslash-newline pairs are removed, trigraphs are replaced if the view was opened with kBufferTrigraphs.
+ * Text that needs neither is not copied.
+ */
+const char* buffer_get_data(input_buffer_t* ib);
+
+size_t buffer_get_size(input_buffer_t* ib);
+
+/**
+ * \brief   Global source offset of the buffer start
+ *
+ * Buffer is registered with the source manager on first call, so buffers that are never
+ * lexed into token streams do not take up location space. Each view gets its own range,
+ * it is given back when the view is closed.
+ *
+ * \return  0 on success, system error code on failure
+ */
+int buffer_get_base(input_buffer_t* ib, uint32_t* base);
+
 void buffer_set_offset(input_buffer_t* ib, size_t pos);
 
 bool buffer_iseof(input_buffer_t* ib);
 
-void buffer_close(input_buffer_t* b);
\ No newline at end of file
+/**
+ * \brief   Close buffer view
+ *
+ * Locations of tokens lexed from the view are no longer valid.
+ * File mappings stay in the source cache after their last view is closed, see @buffer_cache_trim
+ */
+void buffer_close(input_buffer_t* b);
+
+/**
+ * \brief   Unmap cached files that have no open views
+ */
+void buffer_cache_trim(void);
+
+/**
+ * \brief   Release source cache and all file mappings
+ *
+ * All views should be closed at this point
+ */
+void buffer_cache_destroy(void);
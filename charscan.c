@@ -0,0 +1,416 @@
+/*
+ * Every primitive has a scalar implementation and, on x86, SSE2 and AVX2 variants.
+ * SSE2 is part of x86_64 baseline so it is used by default, AVX2 is selected at runtime.
+ * Vector loops never read past 'end', tails are handled by scalar code.
+ */
+
+#include "charscan.h"
+#include "support.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#   define CHARSCAN_X86 1
+#   include <immintrin.h>
+#endif
+
+static inline bool is_space(char c)
+{
+    return (c == ' ') || (c >= '\t' && c <= '\r');
+}
+
+static const char* skip_space_scalar(const char* p, const char* end)
+{
+    while (p < end && is_space(*p)) {
+        ++p;
+    }
+
+    return p;
+}
+
+static const char* find_char_scalar(const char* p, const char* end, char c)
+{
+    while (p < end && *p != c) {
+        ++p;
+    }
+
+    return p;
+}
+
+static const char* find_literal_end_scalar(const char* p, const char* end, char quote)
+{
+    while (p < end && *p != quote && *p != '\\' && *p != '\n') {
+        ++p;
+    }
+
+    return p;
+}
+
+static const char* find_line_special_scalar(const char* p, const char* end)
+{
+    while (p < end && *p != '\n' && *p != '/' && *p != '"' && *p != '\'') {
+        ++p;
+    }
+
+    return p;
+}
+
+static const char* find_splice_scalar(const char* p, const char* end)
+{
+    for (; p + 1 < end; ++p) {
+        if ((p[0] == '\\' && (p[1] == '\n' || p[1] == '\r')) || (p[0] == '?' && p[1] == '?')) {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+#if defined(CHARSCAN_X86)
+
+static const char* skip_space_sse2(const char* p, const char* end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i ctl_lo = _mm_set1_epi8('\t' - 1);
+    const __m128i ctl_hi = _mm_set1_epi8('\r' + 1);
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+
+        // Bytes >= 0x80 are negative and fail the range check
+        __m128i ctl = _mm_and_si128(_mm_cmpgt_epi8(v, ctl_lo), _mm_cmplt_epi8(v, ctl_hi));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, space), ctl));
+        if (mask != 0xFFFF) {
+            return p + __builtin_ctz(~mask);
+        }
+
+        p += 16;
+    }
+
+    return skip_space_scalar(p, end);
+}
+
+static const char* find_char_sse2(const char* p, const char* end, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return find_char_scalar(p, end, c);
+}
+
+static const char* find_literal_end_sse2(const char* p, const char* end, char quote)
+{
+    const __m128i q = _mm_set1_epi8(quote);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_or_si128(_mm_cmpeq_epi8(v, backslash), _mm_cmpeq_epi8(v, newline)));
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return find_literal_end_scalar(p, end, quote);
+}
+
+static const char* find_line_special_sse2(const char* p, const char* end)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i squote = _mm_set1_epi8('\'');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, slash)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, dquote), _mm_cmpeq_epi8(v, squote)));
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return find_line_special_scalar(p, end);
+}
+
+// Pairs are found by comparing the block with the same block shifted by one byte
+static const char* find_splice_sse2(const char* p, const char* end)
+{
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i question = _mm_set1_epi8('?');
+
+    while (end - p >= 17) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i next = _mm_loadu_si128((const __m128i*)(p + 1));
+        __m128i eol = _mm_or_si128(_mm_cmpeq_epi8(next, newline), _mm_cmpeq_epi8(next, cr));
+        __m128i splice = _mm_and_si128(_mm_cmpeq_epi8(v, backslash), eol);
+        __m128i trigraph = _mm_and_si128(_mm_cmpeq_epi8(v, question), _mm_cmpeq_epi8(next, question));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(splice, trigraph));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return find_splice_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* skip_space_avx2(const char* p, const char* end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i ctl_lo = _mm256_set1_epi8('\t' - 1);
+    const __m256i ctl_hi = _mm256_set1_epi8('\r' + 1);
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i ctl = _mm256_and_si256(_mm256_cmpgt_epi8(v, ctl_lo), _mm256_cmpgt_epi8(ctl_hi, v));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), ctl));
+        if (mask != UINT32_MAX) {
+            return p + __builtin_ctz(~mask);
+        }
+
+        p += 32;
+    }
+
+    return skip_space_sse2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* find_char_avx2(const char* p, const char* end, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return find_char_sse2(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char* find_literal_end_avx2(const char* p, const char* end, char quote)
+{
+    const __m256i q = _mm256_set1_epi8(quote);
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, q), _mm256_or_si256(_mm256_cmpeq_epi8(v, backslash), _mm256_cmpeq_epi8(v, newline)));
+        uint32_t mask = _mm256_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return find_literal_end_sse2(p, end, quote);
+}
+
+__attribute__((target("avx2")))
+static const char* find_line_special_avx2(const char* p, const char* end)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i dquote = _mm256_set1_epi8('"');
+    const __m256i squote = _mm256_set1_epi8('\'');
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, newline), _mm256_cmpeq_epi8(v, slash)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, dquote), _mm256_cmpeq_epi8(v, squote)));
+        uint32_t mask = _mm256_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return find_line_special_sse2(p, end);
+}
+
+// Two vectors per iteration, so clean text is skipped in 64 byte blocks
+__attribute__((target("avx2")))
+static const char* find_splice_avx2(const char* p, const char* end)
+{
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i question = _mm256_set1_epi8('?');
+
+    while (end - p >= 65) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+        __m256i n0 = _mm256_loadu_si256((const __m256i*)(p + 1));
+        __m256i n1 = _mm256_loadu_si256((const __m256i*)(p + 33));
+
+        __m256i eol0 = _mm256_or_si256(_mm256_cmpeq_epi8(n0, newline), _mm256_cmpeq_epi8(n0, cr));
+        __m256i eol1 = _mm256_or_si256(_mm256_cmpeq_epi8(n1, newline), _mm256_cmpeq_epi8(n1, cr));
+        __m256i hit0 = _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(v0, backslash), eol0),
+            _mm256_and_si256(_mm256_cmpeq_epi8(v0, question), _mm256_cmpeq_epi8(n0, question)));
+        __m256i hit1 = _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(v1, backslash), eol1),
+            _mm256_and_si256(_mm256_cmpeq_epi8(v1, question), _mm256_cmpeq_epi8(n1, question)));
+
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(hit0) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(hit1) << 32);
+        if (mask) {
+            return p + __builtin_ctzll(mask);
+        }
+
+        p += 64;
+    }
+
+    return find_splice_sse2(p, end);
+}
+
+#endif // CHARSCAN_X86
+
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    const char* (*skip_space)(const char* p, const char* end);
+    const char* (*find_char)(const char* p, const char* end, char c);
+    const char* (*find_literal_end)(const char* p, const char* end, char quote);
+    const char* (*find_line_special)(const char* p, const char* end);
+    const char* (*find_splice)(const char* p, const char* end);
+} charscan_impl_t;
+
+// On x86 scalar code is only used for tails and for tests
+#if !defined(CHARSCAN_X86) || defined(TEST)
+static const charscan_impl_t g_scalar_impl = { skip_space_scalar, find_char_scalar, find_literal_end_scalar, find_line_special_scalar, find_splice_scalar };
+#endif
+
+#if defined(CHARSCAN_X86)
+static const charscan_impl_t g_sse2_impl = { skip_space_sse2, find_char_sse2, find_literal_end_sse2, find_line_special_sse2, find_splice_sse2 };
+static const charscan_impl_t g_avx2_impl = { skip_space_avx2, find_char_avx2, find_literal_end_avx2, find_line_special_avx2, find_splice_avx2 };
+static const charscan_impl_t* g_impl = &g_sse2_impl;
+#else
+static const charscan_impl_t* g_impl = &g_scalar_impl;
+#endif
+
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+
+static void charscan_select(void)
+{
+#if defined(CHARSCAN_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_impl = &g_avx2_impl;
+    }
+#endif
+}
+
+// Every context creation calls this, g_impl is written once and never again while other threads scan
+void charscan_init(void)
+{
+    pthread_once(&g_init_once, charscan_select);
+}
+
+const char* charscan_skip_space(const char* p, const char* end)
+{
+    return g_impl->skip_space(p, end);
+}
+
+const char* charscan_find_char(const char* p, const char* end, char c)
+{
+    return g_impl->find_char(p, end, c);
+}
+
+const char* charscan_find_literal_end(const char* p, const char* end, char quote)
+{
+    return g_impl->find_literal_end(p, end, quote);
+}
+
+const char* charscan_find_line_special(const char* p, const char* end)
+{
+    return g_impl->find_line_special(p, end);
+}
+
+const char* charscan_find_splice(const char* p, const char* end)
+{
+    return g_impl->find_splice(p, end);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(TEST)
+
+#include "test.h"
+
+#include <stdlib.h>
+
+static void test_charscan_impl(const charscan_impl_t* impl)
+{
+    const char alphabet[] = " \t\n\v\f\r/*xa\x80\xff\\\"?'";
+    char buf[256];
+
+    srand(1);
+    for (int n = 0; n < 2000; ++n) {
+        size_t len = rand() % sizeof(buf);
+        size_t start = rand() % (len + 1);
+
+        // Long runs of whitespace with occasional other characters
+        for (size_t i = 0; i < len; ++i) {
+            buf[i] = (rand() % 8) ? alphabet[rand() % 6] : alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+
+        const char* end = buf + len;
+        CU_ASSERT_EQUAL(impl->skip_space(buf + start, end), skip_space_scalar(buf + start, end));
+        CU_ASSERT_EQUAL(impl->find_char(buf + start, end, '/'), find_char_scalar(buf + start, end, '/'));
+        CU_ASSERT_EQUAL(impl->find_char(buf + start, end, '\xff'), find_char_scalar(buf + start, end, '\xff'));
+        CU_ASSERT_EQUAL(impl->find_literal_end(buf + start, end, '"'), find_literal_end_scalar(buf + start, end, '"'));
+        CU_ASSERT_EQUAL(impl->find_line_special(buf + start, end), find_line_special_scalar(buf + start, end));
+        CU_ASSERT_EQUAL(impl->find_splice(buf + start, end), find_splice_scalar(buf + start, end));
+    }
+}
+
+static void charscan_test(void)
+{
+    test_charscan_impl(&g_scalar_impl);
+
+#if defined(CHARSCAN_X86)
+    test_charscan_impl(&g_sse2_impl);
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        test_charscan_impl(&g_avx2_impl);
+    }
+#endif
+}
+TEST_ADD(charscan_test);
+
+#endif // TEST
+
+//////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,49 @@
+/*
+ * charscan.h
+ * Vectorized character scanning primitives
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * \brief   Select best implementation for the CPU we are running on
+ *
+ * Baseline implementations are used until this is called.
+ * Selection is made by the first call only, so this can be called from any thread at any time.
+ */
+void charscan_init(void);
+
+/**
+ * \brief   Skip ASCII whitespace: ' ', '\t', '\n', '\v', '\f', '\r'
+ * \return  Pointer to the first non-whitespace character or 'end'
+ */
+const char* charscan_skip_space(const char* p, const char* end);
+
+/**
+ * \brief   Find first occurrence of a character
+ * \return  Pointer to the found character or 'end'
+ */
+const char* charscan_find_char(const char* p, const char* end, char c);
+
+/**
+ * \brief   Find first character that ends a plain run inside a string or character literal:
+ *          closing quote, backslash or newline
+ * \return  Pointer to the found character or 'end'
+ */
+const char* charscan_find_literal_end(const char* p, const char* end, char quote);
+
+/**
+ * \brief   Find first character that matters when looking for the end of a line:
+ *          newline, slash that may start a comment or quote that may start a literal
+ * \return  Pointer to the found character or 'end'
+ */
+const char* charscan_find_line_special(const char* p, const char* end);
+
+/**
+ * \brief   Find first place that translation phases 1 and 2 have to change:
+ *          backslash followed by a newline or two question marks that may start a trigraph
+ * \return  Pointer to the backslash or the first question mark, or 'end'
+ */
+const char* charscan_find_splice(const char* p, const char* end);
@@ -0,0 +1,153 @@
+/*
+ * Compiler context.
+ * Context is what used to be process wide: the string table with its arena and the keyword and operator
+ * strings of the scanner. Read-only tables (lexer DFA, character classes) and the vectorized scanning
+ * routines picked for the CPU are still shared, since nobody writes them after the first context is made.
+ * So is the source manager, which is locked.
+ */
+
+#include "context.h"
+#include "support.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+cc_context_t* cc_context_create(void)
+{
+    cc_context_t* ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+
+    if (0 != strings_init(ctx)) {
+        free(ctx);
+        return NULL;
+    }
+
+    if (0 != init_scanner(ctx)) {
+        cc_context_destroy(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void cc_context_destroy(cc_context_t* ctx)
+{
+    if (ctx) {
+        strings_destroy(ctx);
+        free(ctx);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(TEST)
+
+#include "srcmgr.h"
+
+#include <pthread.h>
+#include <string.h>
+
+typedef struct context_test_job
+{
+    const char* text;
+    int error;
+} context_test_job_t;
+
+// Lex the same text over and over in a context of its own. Every round also holds a large source
+// for a while, so that all rounds together need several times more locations than there are.
+static void* context_test_worker(void* arg)
+{
+    context_test_job_t* job = arg;
+    cc_context_t* ctx = cc_context_create();
+    if (!ctx) {
+        job->error = ENOMEM;
+        return NULL;
+    }
+
+    size_t len = strlen(job->text);
+    for (int i = 0; i < 100 && !job->error; ++i) {
+        input_buffer_t* in = buffer_mem((void*)job->text, len);
+        if (!in) {
+            job->error = ENOMEM;
+            break;
+        }
+
+        // Text is never read, only its range is reserved
+        uint32_t big = 0;
+        job->error = srcmgr_add("big", job->text, UINT32_MAX / 8, &big);
+        if (job->error) {
+            buffer_close(in);
+            break;
+        }
+
+        token_stream_t ts;
+        token_stream_init(&ts);
+
+        job->error = lex_batch(ctx, in, &ts, len + 1);
+        if (!job->error) {
+            token_t token;
+            token_stream_get(ctx, &ts, 0, &token);
+            bool match = (token.type == kTokenKeyword && _S(token.value) == _S(ctx->keywords[kKeywordInt]));
+
+            token_stream_get(ctx, &ts, 1, &token);
+            match = match && (_S(token.value) == _S(string(ctx, "x")));
+            job->error = (match ? 0 : EINVAL);
+        }
+
+        token_stream_destroy(&ts);
+        srcmgr_remove(big);
+        buffer_close(in);
+    }
+
+    cc_context_destroy(ctx);
+    return NULL;
+}
+
+static void cc_context_test(void)
+{
+    cc_context_t* a = cc_context_create();
+    cc_context_t* b = cc_context_create();
+    CU_ASSERT_FATAL(a != NULL && b != NULL);
+
+    // Same text is a different string in every context, with an info record of its own
+    string_t xa = string(a, "x");
+    string_t xb = string(b, "x");
+    CU_ASSERT(_S(xa) != _S(xb));
+    CU_ASSERT(0 == strcmp(_S(xa), _S(xb)));
+
+    string_info(xa)->macro = &xa;
+    CU_ASSERT_EQUAL(string_info(xb)->macro, NULL);
+
+    CU_ASSERT_EQUAL(string_keyword(string(a, "return")), kKeywordReturn);
+    CU_ASSERT_EQUAL(string_keyword(string(b, "return")), kKeywordReturn);
+
+    // Destroying a context leaves the others alone
+    cc_context_destroy(a);
+    CU_ASSERT_EQUAL(_S(string(b, "x")), _S(xb));
+    CU_ASSERT_EQUAL(string_info(xb)->macro, NULL);
+    cc_context_destroy(b);
+
+    // Contexts on different threads share nothing but the location space
+    context_test_job_t jobs[4];
+    pthread_t threads[countof(jobs)];
+    bool started[countof(jobs)];
+    for (size_t i = 0; i < countof(jobs); ++i) {
+        jobs[i] = (context_test_job_t) { "int x = y + 1; return x;", 0 };
+        started[i] = (0 == pthread_create(&threads[i], NULL, context_test_worker, &jobs[i]));
+        CU_ASSERT_TRUE(started[i]);
+    }
+
+    for (size_t i = 0; i < countof(jobs); ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+            CU_ASSERT_EQUAL(jobs[i].error, 0);
+        }
+    }
+}
+TEST_ADD(cc_context_test);
+
+#endif // TEST
@@ -0,0 +1,44 @@
+/*
+ * context.h
+ * Compiler context
+ */
+
+#pragma once
+
+#include "arena.h"
+#include "strings.h"
+#include "scanner.h"
+
+#include <pthread.h>
+
+/**
+ * \brief   State of a compilation that is not tied to a single source
+ *
+ * A context owns its stored strings with their info records, and the keyword and operator strings
+ * the scanner hands out. Contexts share no mutable state of their own, so a thread per context can
+ * compile in parallel. Strings of different contexts are never equal and must not be mixed.
+ * Source manager and file cache stay process wide: source locations are global and files are read once.
+ * All contexts take their locations from one 32-bit space, so sources open at the same time in all of them
+ * together are limited to 4GB. Closing a buffer gives its range back, see @srcmgr_remove.
+ */
+struct cc_context
+{
+    arena_t* string_arena;
+    struct string_table* string_table;
+    pthread_mutex_t string_lock;            /* Scanner threads of one context intern strings concurrently */
+    string_t keywords[kKeywordTotal];       /* Stored keyword strings */
+    string_t operators[kOperatorTotal];     /* Stored operator strings */
+    bool trigraphs;                         /* Replace trigraphs in files opened by the preprocessor, off by default */
+};
+
+/**
+ * \brief   Create a context with string storage and scanner tables ready
+ *
+ * \return  NULL if out of memory
+ */
+cc_context_t* cc_context_create(void);
+
+/**
+ * \brief   Destroy a context and all strings stored in it
+ */
+void cc_context_destroy(cc_context_t* ctx);
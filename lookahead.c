@@ -0,0 +1,259 @@
+/*
+ * Token lookahead ring.
+ * Head and tail are positions that only grow, slots are reused once the parser has consumed their tokens
+ * and no mark keeps them. Refills read from the source until the ring is full, so a source that produces
+ * tokens one at a time is still asked for them in long runs.
+ */
+
+#include "lookahead.h"
+#include "support.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+
+int token_ring_init(token_ring_t* ring, size_t capacity, token_source_fn fn, void* ctx)
+{
+    if (!ring || !capacity || !fn || capacity > SIZE_MAX / 2 / sizeof(token_t)) {
+        return EINVAL;
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    token_t* tokens = malloc(size * sizeof(*tokens));
+    if (!tokens) {
+        return ENOMEM;
+    }
+
+    *ring = (token_ring_t) {
+        .tokens = tokens,
+        .mask = size - 1,
+        .fn = fn,
+        .ctx = ctx,
+    };
+
+    return 0;
+}
+
+void token_ring_destroy(token_ring_t* ring)
+{
+    if (ring) {
+        free(ring->tokens);
+        ring->tokens = NULL;
+    }
+}
+
+int token_ring_buffer_source(void* ctx, token_t* out)
+{
+    token_buffer_source_t* src = ctx;
+    return parse_next_token(src->ctx, src->in, out);
+}
+
+// Read tokens up to position 'need' at least, filling all free slots
+static int token_ring_fill(token_ring_t* ring, size_t need)
+{
+    size_t oldest = (ring->marks ? ring->pinned : ring->head);
+    size_t limit = oldest + ring->mask + 1;
+    if (need > limit) {
+        return ENOBUFS;
+    }
+
+    while (ring->tail < limit && !ring->status) {
+        int error = ring->fn(ring->ctx, &ring->tokens[ring->tail & ring->mask]);
+        if (error) {
+            ring->status = error;
+            break;
+        }
+
+        ++ring->tail;
+    }
+
+    return ring->tail >= need ? 0 : ring->status;
+}
+
+int token_ring_peek(token_ring_t* ring, size_t k, const token_t** out)
+{
+    if (!ring || !out) {
+        return EINVAL;
+    }
+
+    if (k >= ring->tail - ring->head) {
+        int error = token_ring_fill(ring, ring->head + k + 1);
+        if (error) {
+            return error;
+        }
+    }
+
+    *out = &ring->tokens[(ring->head + k) & ring->mask];
+    return 0;
+}
+
+int token_ring_consume(token_ring_t* ring, token_t* out)
+{
+    const token_t* token;
+    int error = token_ring_peek(ring, 0, &token);
+    if (error) {
+        return error;
+    }
+
+    if (out) {
+        *out = *token;
+    }
+
+    ++ring->head;
+    return 0;
+}
+
+size_t token_ring_mark(token_ring_t* ring)
+{
+    if (!ring->marks++) {
+        ring->pinned = ring->head;
+    }
+
+    return ring->head;
+}
+
+void token_ring_rewind(token_ring_t* ring, size_t mark)
+{
+    ring->head = mark;
+    token_ring_release(ring);
+}
+
+void token_ring_release(token_ring_t* ring)
+{
+    if (ring->marks) {
+        --ring->marks;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(TEST)
+
+#include "context.h"
+
+#include <stdio.h>
+#include <string.h>
+
+typedef struct ring_test_source
+{
+    token_buffer_source_t buf;
+    size_t calls;
+} ring_test_source_t;
+
+static int ring_test_next(void* ctx, token_t* out)
+{
+    ring_test_source_t* src = ctx;
+    ++src->calls;
+    return token_ring_buffer_source(&src->buf, out);
+}
+
+static bool ring_test_is(const token_t* t, const char* name)
+{
+    return t->type == kTokenIdentifier && 0 == strcmp(_S(t->value), name);
+}
+
+static void token_ring_test(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    const char* str = "a b c d e f g";
+    ring_test_source_t src = { { ctx, buffer_mem((void*)str, strlen(str)) }, 0 };
+    token_ring_t ring;
+    CU_ASSERT_EQUAL(token_ring_init(&ring, 3, ring_test_next, &src), 0);
+    CU_ASSERT_EQUAL(ring.mask, 3);
+
+    // First peek fills the whole ring, lookahead past it does not fit
+    const token_t* t = NULL;
+    CU_ASSERT_EQUAL(token_ring_peek(&ring, 0, &t), 0);
+    CU_ASSERT_TRUE(ring_test_is(t, "a"));
+    CU_ASSERT_EQUAL(src.calls, 4);
+    CU_ASSERT_EQUAL(token_ring_peek(&ring, 3, &t), 0);
+    CU_ASSERT_TRUE(ring_test_is(t, "d"));
+    CU_ASSERT_EQUAL(token_ring_peek(&ring, 4, &t), ENOBUFS);
+    CU_ASSERT_EQUAL(src.calls, 4);
+
+    // Rewinding serves tokens from the ring again
+    token_t token;
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, NULL), 0);
+    size_t mark = token_ring_mark(&ring);
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, &token), 0);
+    CU_ASSERT_TRUE(ring_test_is(&token, "b"));
+    size_t inner = token_ring_mark(&ring);
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, NULL), 0);
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, &token), 0);
+    CU_ASSERT_TRUE(ring_test_is(&token, "d"));
+
+    // Outer mark keeps 'b' in the ring, so 'f' would have to overwrite it
+    CU_ASSERT_EQUAL(token_ring_peek(&ring, 0, &t), 0);
+    CU_ASSERT_TRUE(ring_test_is(t, "e"));
+    CU_ASSERT_EQUAL(token_ring_peek(&ring, 1, &t), ENOBUFS);
+
+    token_ring_rewind(&ring, inner);
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, &token), 0);
+    CU_ASSERT_TRUE(ring_test_is(&token, "c"));
+    token_ring_rewind(&ring, mark);
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, &token), 0);
+    CU_ASSERT_TRUE(ring_test_is(&token, "b"));
+    CU_ASSERT_EQUAL(src.calls, 5);
+
+    // Without marks the rest fits, the source ends once and keeps saying so
+    const char* rest[] = { "c", "d", "e", "f", "g" };
+    for (size_t i = 0; i < countof(rest); ++i) {
+        CU_ASSERT_EQUAL(token_ring_consume(&ring, &token), 0);
+        CU_ASSERT_TRUE(ring_test_is(&token, rest[i]));
+    }
+
+    CU_ASSERT_EQUAL(token_ring_peek(&ring, 0, &t), -1);
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, &token), -1);
+    CU_ASSERT_EQUAL(src.calls, 8);
+
+    token_ring_destroy(&ring);
+    buffer_close(src.buf.in);
+
+    // Tokens before a lex error are still there, the error is returned where the bad token would be
+    str = "x 'y";
+    src = (ring_test_source_t) { { ctx, buffer_mem((void*)str, strlen(str)) }, 0 };
+    CU_ASSERT_EQUAL(token_ring_init(&ring, 64, ring_test_next, &src), 0);
+    CU_ASSERT_EQUAL(token_ring_peek(&ring, 1, &t), EILSEQ);
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, &token), 0);
+    CU_ASSERT_TRUE(ring_test_is(&token, "x"));
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, &token), EILSEQ);
+    CU_ASSERT_EQUAL(src.calls, 2);
+    token_ring_destroy(&ring);
+    buffer_close(src.buf.in);
+
+    // Long input streams through a small ring with every token read once
+    char text[4096];
+    size_t len = 0;
+    for (int i = 0; i < 500; ++i) {
+        len += snprintf(text + len, sizeof(text) - len, "t%d ", i);
+    }
+
+    src = (ring_test_source_t) { { ctx, buffer_mem(text, len) }, 0 };
+    CU_ASSERT_EQUAL(token_ring_init(&ring, 16, ring_test_next, &src), 0);
+    bool match = true;
+    for (int i = 0; i < 500; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "t%d", i);
+        size_t k = (size_t)i % 16;
+        match = match && (token_ring_peek(&ring, k, &t) == 0 || (i + k >= 500 && ring.status == -1));
+        match = match && token_ring_consume(&ring, &token) == 0 && ring_test_is(&token, name);
+    }
+
+    CU_ASSERT_TRUE(match);
+    CU_ASSERT_EQUAL(token_ring_consume(&ring, NULL), -1);
+    CU_ASSERT_EQUAL(src.calls, 501);
+    token_ring_destroy(&ring);
+    buffer_close(src.buf.in);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(token_ring_test);
+
+#endif // TEST
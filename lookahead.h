@@ -0,0 +1,102 @@
+/*
+ * lookahead.h
+ * Token lookahead for the parser
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include "scanner.h"
+
+#include <stddef.h>
+
+/**
+ * \brief   Function producing tokens for a lookahead ring
+ *
+ * \return  0 on success, -1 when there are no more tokens, error code on failure
+ */
+typedef int (*token_source_fn)(void* ctx, token_t* out);
+
+/**
+ * \brief   Ring of tokens read ahead of the parser
+ *
+ * Tokens are read from the source only once, lookahead and rewinds are served from the ring.
+ * When the ring runs dry it is refilled with as many tokens as fit into it.
+ * Positions count tokens since the start of the source, a slot is found by masking the position.
+ */
+typedef struct token_ring
+{
+    token_t* tokens;
+    size_t mask;            /* Capacity - 1, capacity is a power of two */
+    size_t head;            /* Position of the next token to consume */
+    size_t tail;            /* Position past the last token read from the source */
+    size_t pinned;          /* Position of the outermost mark, tokens from it on are kept */
+    size_t marks;           /* Marks that were not rewound to or released yet */
+    int status;             /* What the source returned when it stopped producing tokens, 0 while it still does */
+    token_source_fn fn;
+    void* ctx;
+} token_ring_t;
+
+/**
+ * \brief   Init a ring reading tokens from 'fn'
+ *
+ * \param   capacity    Most tokens held at once, rounded up to a power of two
+ * \return  0 on success, system error code on failure
+ */
+int token_ring_init(token_ring_t* ring, size_t capacity, token_source_fn fn, void* ctx);
+
+/**
+ * \brief   Free ring memory
+ */
+void token_ring_destroy(token_ring_t* ring);
+
+/**
+ * \brief   Input buffer read by @token_ring_buffer_source
+ */
+typedef struct token_buffer_source
+{
+    cc_context_t* ctx;      /* Context to store token strings in */
+    input_buffer_t* in;
+} token_buffer_source_t;
+
+/**
+ * \brief   Token source reading an input buffer with @parse_next_token, 'ctx' is a token_buffer_source_t
+ */
+int token_ring_buffer_source(void* ctx, token_t* out);
+
+/**
+ * \brief   Look at the token 'k' positions after the next one without consuming it
+ *
+ * \param   out     Receives a pointer into the ring, valid until the token is consumed
+ * \return  0 on success,
+ *          ENOBUFS if the token does not fit into the ring together with the ones kept for marks,
+ *          what the source returned if it ended or failed before that token
+ */
+int token_ring_peek(token_ring_t* ring, size_t k, const token_t** out);
+
+/**
+ * \brief   Take the next token
+ *
+ * \param   out     Receives the token, may be NULL
+ * \return  0 on success, error codes as @token_ring_peek otherwise
+ */
+int token_ring_consume(token_ring_t* ring, token_t* out);
+
+/**
+ * \brief   Remember the current position so that parsing can go back to it
+ *
+ * Marks nest, tokens from the outermost one on are kept in the ring until it is rewound to or released.
+ *
+ * \return  Position to pass to @token_ring_rewind
+ */
+size_t token_ring_mark(token_ring_t* ring);
+
+/**
+ * \brief   Go back to the innermost mark and forget it
+ */
+void token_ring_rewind(token_ring_t* ring, size_t mark);
+
+/**
+ * \brief   Forget the innermost mark and stay at the current position
+ */
+void token_ring_release(token_ring_t* ring);
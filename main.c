@@ -1,10 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "arena.h"
 #include "test.h"
-#include "strings.h"
-#include "scanner.h"
+#include "context.h"
 
 #if defined(TEST)
 
@@ -43,17 +43,16 @@ static int RunUnitTests() { return 0; }
 
 int main(void) 
 {
-    int err = 0;
-
     if (CUE_SUCCESS != RunUnitTests()) {
         return EXIT_FAILURE;
     }
 
-    err = init_scanner();
-    if (err) {
-        fprintf(stderr, "Could not initialize scanner: %d\n", err);
-        return err;
+    cc_context_t* ctx = cc_context_create();
+    if (!ctx) {
+        fprintf(stderr, "Could not create compiler context\n");
+        return ENOMEM;
     }
 
+    cc_context_destroy(ctx);
     return 0;
 }
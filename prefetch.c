@@ -0,0 +1,234 @@
+/*
+ * Prefetch batches are served by a handful of detached reader threads that pull paths from a shared index.
+ * Batch memory is reference counted by its futures and workers, whoever is last frees it.
+ */
+
+#include "prefetch.h"
+#include "support.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#define PREFETCH_MAX_THREADS 4
+
+typedef struct prefetch_batch prefetch_batch_t;
+
+struct buffer_future
+{
+    prefetch_batch_t* batch;
+    const char* path;
+    input_buffer_t* buffer;
+    bool done;
+};
+
+struct prefetch_batch
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next;                // Next path to load
+    size_t count;
+    unsigned refcount;          // Waiting futures + running workers
+    buffer_future_t futures[0];
+};
+
+static void batch_release(prefetch_batch_t* batch)
+{
+    pthread_mutex_lock(&batch->lock);
+    bool last = (--batch->refcount == 0);
+    pthread_mutex_unlock(&batch->lock);
+
+    if (last) {
+        pthread_cond_destroy(&batch->cond);
+        pthread_mutex_destroy(&batch->lock);
+        free(batch);
+    }
+}
+
+// Touch every page so that the lexer does not take page faults on the critical path
+static void prefault(input_buffer_t* ib)
+{
+    size_t size = buffer_get_size(ib);
+    if (size == 0) {
+        return;
+    }
+
+    const volatile char* data = buffer_get_data(ib);
+    long page = sysconf(_SC_PAGESIZE);
+
+    (void) posix_madvise((void*)((uintptr_t)data & ~(uintptr_t)(page - 1)), size, POSIX_MADV_WILLNEED);
+    for (size_t i = 0; i < size; i += page) {
+        (void) data[i];
+    }
+}
+
+static void* prefetch_worker(void* arg)
+{
+    prefetch_batch_t* batch = (prefetch_batch_t*) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        size_t i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+
+        if (i >= batch->count) {
+            break;
+        }
+
+        buffer_future_t* f = &batch->futures[i];
+        input_buffer_t* ib = buffer_open(f->path);
+        if (ib) {
+            prefault(ib);
+        }
+
+        pthread_mutex_lock(&batch->lock);
+        f->buffer = ib;
+        f->done = true;
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    batch_release(batch);
+    return NULL;
+}
+
+int buffer_prefetch(const char* const* paths, size_t count, buffer_future_t** futures)
+{
+    if (!paths || !futures) {
+        return EINVAL;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    size_t strsize = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (!paths[i]) {
+            return EINVAL;
+        }
+        strsize += strlen(paths[i]) + 1;
+    }
+
+    prefetch_batch_t* batch = calloc(1, sizeof(*batch) + count * sizeof(buffer_future_t) + strsize);
+    if (!batch) {
+        return ENOMEM;
+    }
+
+    char* str = (char*)&batch->futures[count];
+    for (size_t i = 0; i < count; ++i) {
+        size_t len = strlen(paths[i]) + 1;
+        memcpy(str, paths[i], len);
+
+        batch->futures[i].batch = batch;
+        batch->futures[i].path = str;
+        futures[i] = &batch->futures[i];
+
+        str += len;
+    }
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+    batch->count = count;
+    batch->refcount = count;
+
+    size_t nthreads = (count < PREFETCH_MAX_THREADS ? count : PREFETCH_MAX_THREADS);
+    size_t started = 0;
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_mutex_lock(&batch->lock);
+        ++batch->refcount;
+        pthread_mutex_unlock(&batch->lock);
+
+        pthread_t thread;
+        if (0 != pthread_create(&thread, NULL, prefetch_worker, batch)) {
+            pthread_mutex_lock(&batch->lock);
+            --batch->refcount;
+            pthread_mutex_unlock(&batch->lock);
+            break;
+        }
+
+        pthread_detach(thread);
+        ++started;
+    }
+
+    // Could not start a single worker, do all the work ourselves
+    if (started == 0) {
+        pthread_mutex_lock(&batch->lock);
+        ++batch->refcount;
+        pthread_mutex_unlock(&batch->lock);
+        prefetch_worker(batch);
+    }
+
+    return 0;
+}
+
+input_buffer_t* buffer_future_wait(buffer_future_t* future)
+{
+    if (!future) {
+        return NULL;
+    }
+
+    prefetch_batch_t* batch = future->batch;
+
+    pthread_mutex_lock(&batch->lock);
+    while (!future->done) {
+        pthread_cond_wait(&batch->cond, &batch->lock);
+    }
+    input_buffer_t* ib = future->buffer;
+    pthread_mutex_unlock(&batch->lock);
+
+    batch_release(batch);
+    return ib;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+#if defined(TEST)
+#include "test.h"
+
+#include <stdio.h>
+
+static void prefetch_test(void)
+{
+    char paths[3][32];
+    const char* all[countof(paths) + 1];
+
+    for (size_t i = 0; i < countof(paths); ++i) {
+        snprintf(paths[i], sizeof(paths[i]), "/tmp/shlang-cc-test-XXXXXX");
+        int fd = mkstemp(paths[i]);
+        CU_ASSERT(fd >= 0);
+
+        char c = '0' + i;
+        CU_ASSERT_EQUAL(1, write(fd, &c, 1));
+        close(fd);
+
+        all[i] = paths[i];
+    }
+
+    all[countof(paths)] = "/nonexistent/shlang-cc";
+
+    buffer_future_t* futures[countof(all)];
+    CU_ASSERT_EQUAL(0, buffer_prefetch(all, countof(all), futures));
+
+    for (size_t i = 0; i < countof(paths); ++i) {
+        input_buffer_t* ib = buffer_future_wait(futures[i]);
+        CU_ASSERT(ib != NULL);
+        CU_ASSERT_EQUAL('0' + i, buffer_getchar(ib));
+        buffer_close(ib);
+        unlink(paths[i]);
+    }
+
+    CU_ASSERT(buffer_future_wait(futures[countof(paths)]) == NULL);
+
+    buffer_cache_trim();
+}
+TEST_ADD(prefetch_test);
+
+#endif // TEST
+
+/////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,37 @@
+/*
+ * prefetch.h
+ * Background loading of input files
+ */
+
+#pragma once
+
+#include "buffer.h"
+
+/**
+ * \brief   Pending input buffer
+ */
+typedef struct buffer_future buffer_future_t;
+
+/**
+ * \brief   Start loading a list of files in background
+ *
+ * Files are opened and faulted in by a small pool of reader threads, so file I/O overlaps with
+ * whatever the caller is doing with files that are already loaded.
+ * Loaded buffers are shared through the source cache, see @buffer_open.
+ *
+ * \param   paths       Paths to load, copied by the call
+ * \param   count       Number of paths
+ * \param   futures     Array of 'count' pointers to receive pending buffers.
+ *                      Every future should be waited for exactly once.
+ *
+ * \return  0 on success, system error code on failure
+ */
+int buffer_prefetch(const char* const* paths, size_t count, buffer_future_t** futures);
+
+/**
+ * \brief   Wait for a pending buffer to load and release the future
+ *
+ * \return  Opened buffer or NULL if the file could not be loaded.
+ *          Caller owns returned buffer and should close it with @buffer_close
+ */
+input_buffer_t* buffer_future_wait(buffer_future_t* future);
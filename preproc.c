@@ -0,0 +1,3021 @@
+/*
+ * Preprocessor.
+ * Sources are lexed one token at a time, directive lines are told apart by token placement flags.
+ * Directive lines are read into a token array and executed, #if and #elif conditions are evaluated as their tokens
+ * are lexed and macro expanded. Groups that are skipped are not lexed at all:
+ * they are scanned line by line, only looking at directive names to find where the group ends.
+ *
+ * Multiple include optimization: a file whose tokens are all inside of a single #ifndef X / #endif
+ * (or #if !defined X) conditional is remembered together with X, and further includes of it are skipped
+ * while X is defined, before the file is even opened. Same goes for files marked with #pragma once.
+ * Files are identified by device and inode, path lookups are cached, so that repeated includes
+ * do not touch the file system.
+ *
+ * Macro expansion works on tokens and follows the hide set algorithm: every token carries the set of
+ * macros that produced it, and a macro name is not expanded if it is in its own hide set.
+ * Replacement lists are lexed once when a macro is defined. An expansion pushes a frame that reads
+ * the replacement list in place, parameters are replaced with arguments as the frame reaches them.
+ * Arguments are spans of the tokens they were read from, they are only copied when they come
+ * straight from the source or span several frames. Hide sets are interned, so equal sets are equal pointers.
+ */
+
+#include "preproc.h"
+#include "arena.h"
+#include "charscan.h"
+#include "context.h"
+#include "srcmgr.h"
+#include "support.h"
+#include "test.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#define PP_MAX_INCLUDE_DEPTH    200
+
+typedef enum
+{
+    kDirectiveDefine = 0,
+    kDirectiveUndef,
+    kDirectiveInclude,
+    kDirectiveIf,
+    kDirectiveIfdef,
+    kDirectiveIfndef,
+    kDirectiveElif,
+    kDirectiveElse,
+    kDirectiveEndif,
+    kDirectiveLine,
+    kDirectiveError,
+    kDirectiveWarning,
+    kDirectivePragma,
+
+    kDirectiveTotal, // Always last
+} directive_kind_t;
+
+static const char* g_directive_names[kDirectiveTotal] = {
+    [kDirectiveDefine] = "define",
+    [kDirectiveUndef] = "undef",
+    [kDirectiveInclude] = "include",
+    [kDirectiveIf] = "if",
+    [kDirectiveIfdef] = "ifdef",
+    [kDirectiveIfndef] = "ifndef",
+    [kDirectiveElif] = "elif",
+    [kDirectiveElse] = "else",
+    [kDirectiveEndif] = "endif",
+    [kDirectiveLine] = "line",
+    [kDirectiveError] = "error",
+    [kDirectiveWarning] = "warning",
+    [kDirectivePragma] = "pragma",
+};
+
+// Known source file, all paths leading to the same file share it
+typedef struct pp_file
+{
+    dev_t dev;
+    ino_t ino;
+    string_t guard;         // Macro guarding the whole file, NULL if there is none
+    bool once;              // Marked with #pragma once
+    bool included;
+    struct pp_file* next;
+} pp_file_t;
+
+// Include guard detection
+typedef enum
+{
+    kGuardStart = 0,        // Nothing seen yet
+    kGuardInside,           // Inside of the conditional that opened the file
+    kGuardEnded,            // After its #endif
+    kGuardNone,             // Something is outside of the conditional
+} guard_state_t;
+
+// Source being read
+typedef struct pp_source
+{
+    input_buffer_t* in;
+    uint32_t base;          // Global offset of the buffer start
+    pp_file_t* file;        // NULL for buffers
+    string_t path;          // NULL for buffers
+    string_t dir;           // Directory for quoted includes, empty for the current one
+    size_t cond_base;       // Conditionals that were open when source was entered
+    token_t ahead;          // First token of the line following a directive
+    bool has_ahead;
+    guard_state_t guard;
+    string_t guard_macro;
+    size_t guard_depth;     // Conditionals open inside of the guard
+    struct pp_source* parent;
+} pp_source_t;
+
+// Open conditional
+typedef struct pp_cond
+{
+    uint32_t loc;
+    bool taken;             // One of the groups was already taken
+    bool seen_else;
+} pp_cond_t;
+
+// Set of macros that can not be expanded from a token.
+// Sets are lists sorted by name address, highest first. They are interned, equal sets are the same list.
+typedef struct pp_hideset
+{
+    string_t name;
+    const struct pp_hideset* rest;
+} pp_hideset_t;
+
+typedef struct pp_token
+{
+    token_t token;
+    const pp_hideset_t* hs;
+} pp_token_t;
+
+// Tokens of a replacement list or an argument
+typedef struct pp_span
+{
+    const pp_token_t* tokens;
+    size_t count;
+    const pp_hideset_t* hs; // Added to hide sets of all the tokens
+} pp_span_t;
+
+typedef struct pp_macro
+{
+    string_t name;
+    uint32_t loc;
+    bool function_like;
+    bool variadic;          // Last parameter is __VA_ARGS__
+    bool has_ops;           // Replacement list has # or ## operators
+    size_t param_count;
+    string_t* params;
+    size_t token_count;
+    pp_token_t* tokens;     // Replacement list
+    uint16_t* refs;         // Parameter index + 1 for every replacement token, 0 for other tokens
+    struct pp_macro* next;  // All macros defined by this preprocessor
+} pp_macro_t;
+
+typedef struct pp_arg
+{
+    pp_span_t raw;
+    pp_span_t expanded;     // Valid once is_expanded is set
+    bool is_expanded;
+} pp_arg_t;
+
+// Expansion in progress, tokens are read from the innermost frame
+typedef struct pp_frame
+{
+    pp_span_t span;
+    size_t pos;
+    const pp_macro_t* macro;    // Its parameters in the span are replaced with 'args', NULL for other spans
+    pp_arg_t* args;
+    bool barrier;               // Argument expanded on its own, reading stops at its end
+} pp_frame_t;
+
+struct preproc
+{
+    cc_context_t* ctx;      // Strings of all tokens and names
+    arena_t* arena;         // Files and macros
+    pp_source_t* top;       // Include stack
+    size_t depth;
+    pp_source_t* retired;   // Ended sources, buffers stay open since tokens point into them
+    pp_cond_t* conds;
+    size_t cond_count;
+    size_t cond_capacity;
+    token_t* line;          // Directive being executed
+    size_t line_count;
+    size_t line_capacity;
+    string_t* dirs;
+    size_t dir_count;
+    dict_t* paths;          // Path to pp_file_t, &g_missing_file for paths that do not exist
+    pp_file_t* files;
+    dict_t* definitions;    // Macro name to pp_macro_t, current one is also kept in string info
+    pp_macro_t* macros;
+    arena_t* expansion;     // Arguments and substituted lists, freed when all frames end
+    pp_frame_t* frames;
+    size_t frame_count;
+    size_t frame_capacity;
+    int pending_flags;      // Placement of a macro name that goes to the first token of its expansion, -1 if none
+    pp_source_t* line_src;  // Source of the #if or #elif line being evaluated, expansions read only up to its end
+    const pp_hideset_t** hidesets;
+    size_t hideset_count;
+    size_t hideset_capacity;
+    input_buffer_t** scratch;   // Text of tokens made by # and ##
+    size_t scratch_count;
+    size_t scratch_capacity;
+    string_t names[kDirectiveTotal];
+    string_t defined;
+    string_t once;
+    string_t va_args;
+    string_t empty;
+    uint32_t loc;
+    preproc_stats_t stats;
+    preproc_include_fn on_include;
+    void* on_include_ctx;
+};
+
+static pp_file_t g_missing_file;
+
+preproc_t* preproc_create(cc_context_t* ctx)
+{
+    if (!ctx) {
+        return NULL;
+    }
+
+    preproc_t* pp = calloc(1, sizeof(*pp));
+    if (!pp) {
+        return NULL;
+    }
+
+    pp->ctx = ctx;
+    pp->arena = arena_create();
+    pp->expansion = arena_create();
+    pp->paths = dict_create();
+    pp->definitions = dict_create();
+    pp->pending_flags = -1;
+    if (!pp->arena || !pp->expansion || !pp->paths || !pp->definitions) {
+        goto fail;
+    }
+
+    for (size_t i = 0; i < kDirectiveTotal; ++i) {
+        pp->names[i] = string(pp->ctx, g_directive_names[i]);
+        if (!_S(pp->names[i])) {
+            goto fail;
+        }
+    }
+
+    pp->defined = string(pp->ctx, "defined");
+    pp->once = string(pp->ctx, "once");
+    pp->va_args = string(pp->ctx, "__VA_ARGS__");
+    pp->empty = string(pp->ctx, "");
+    if (!_S(pp->defined) || !_S(pp->once) || !_S(pp->va_args) || !_S(pp->empty)) {
+        goto fail;
+    }
+
+    return pp;
+
+fail:
+    preproc_destroy(pp);
+    return NULL;
+}
+
+void preproc_destroy(preproc_t* pp)
+{
+    if (!pp) {
+        return;
+    }
+
+    pp_source_t* lists[] = { pp->top, pp->retired };
+    for (size_t i = 0; i < countof(lists); ++i) {
+        while (lists[i]) {
+            pp_source_t* src = lists[i];
+            lists[i] = src->parent;
+            buffer_close(src->in);
+            free(src);
+        }
+    }
+
+    for (pp_macro_t* m = pp->macros; m; m = m->next) {
+        if (string_info(m->name)->macro == m) {
+            string_info(m->name)->macro = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < pp->scratch_count; ++i) {
+        buffer_close(pp->scratch[i]);
+    }
+
+    dict_destroy(pp->paths);
+    dict_destroy(pp->definitions);
+    arena_destroy(pp->arena);
+    arena_destroy(pp->expansion);
+    free(pp->frames);
+    free(pp->hidesets);
+    free(pp->scratch);
+    free(pp->conds);
+    free(pp->line);
+    free(pp->dirs);
+    free(pp);
+}
+
+int preproc_add_include_dir(preproc_t* pp, const char* dir)
+{
+    if (!pp || !dir) {
+        return EINVAL;
+    }
+
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+        --len;
+    }
+
+    string_t str = string_intern(pp->ctx, dir, len, strings_hash(dir, len));
+    if (!_S(str)) {
+        return ENOMEM;
+    }
+
+    string_t* dirs = realloc(pp->dirs, (pp->dir_count + 1) * sizeof(*dirs));
+    if (!dirs) {
+        return ENOMEM;
+    }
+
+    dirs[pp->dir_count++] = str;
+    pp->dirs = dirs;
+    return 0;
+}
+
+uint32_t preproc_location(const preproc_t* pp)
+{
+    return pp ? pp->loc : 0;
+}
+
+void preproc_get_stats(const preproc_t* pp, preproc_stats_t* out)
+{
+    if (pp && out) {
+        *out = pp->stats;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Sources and file lookup
+ */
+
+// Find a file by path, results are cached including the negative ones.
+// Sets *out to NULL if there is no such file.
+static int pp_lookup(preproc_t* pp, const char* path, size_t len, pp_file_t** out, string_t* out_path)
+{
+    string_t key = string_intern(pp->ctx, path, len, strings_hash(path, len));
+    if (!_S(key)) {
+        return ENOMEM;
+    }
+
+    *out_path = key;
+
+    pp_file_t* file = dict_search(pp->paths, key);
+    if (file) {
+        *out = (file == &g_missing_file ? NULL : file);
+        return 0;
+    }
+
+    struct stat st;
+    if (0 == stat(_S(key), &st) && S_ISREG(st.st_mode)) {
+        for (file = pp->files; file && (file->dev != st.st_dev || file->ino != st.st_ino); file = file->next) {
+        }
+
+        if (!file) {
+            file = arena_alloc(pp->arena, sizeof(*file));
+            if (!file) {
+                return ENOMEM;
+            }
+
+            memset(file, 0, sizeof(*file));
+            file->dev = st.st_dev;
+            file->ino = st.st_ino;
+            file->next = pp->files;
+            pp->files = file;
+        }
+    }
+
+    int error = dict_insert(pp->paths, key, file ? file : &g_missing_file);
+    if (error) {
+        return error;
+    }
+
+    *out = file;
+    return 0;
+}
+
+// Look for 'name' in 'dir', empty directory is the current one
+static int pp_lookup_in(preproc_t* pp, string_t dir, const char* name, size_t len, pp_file_t** out, string_t* out_path)
+{
+    char path[PATH_MAX];
+    size_t dirlen = string_info(dir)->length;
+    size_t total = dirlen + (dirlen ? 1 : 0) + len;
+    if (total >= sizeof(path)) {
+        return ENAMETOOLONG;
+    }
+
+    memcpy(path, _S(dir), dirlen);
+    path[dirlen] = '/';
+    memcpy(path + total - len, name, len);
+    return pp_lookup(pp, path, total, out, out_path);
+}
+
+// Make buffer the current source, buffer is closed on failure
+static int pp_push(preproc_t* pp, input_buffer_t* in, pp_file_t* file, string_t dir)
+{
+    if (pp->depth >= PP_MAX_INCLUDE_DEPTH) {
+        buffer_close(in);
+        return ELOOP;
+    }
+
+    pp_source_t* src = calloc(1, sizeof(*src));
+    if (!src) {
+        buffer_close(in);
+        return ENOMEM;
+    }
+
+    int error = buffer_get_base(in, &src->base);
+    if (error) {
+        buffer_close(in);
+        free(src);
+        return error;
+    }
+
+    src->in = in;
+    src->file = file;
+    src->dir = dir;
+    src->cond_base = pp->cond_count;
+    src->parent = pp->top;
+    pp->top = src;
+    ++pp->depth;
+
+    if (file) {
+        file->included = true;
+    }
+
+    return 0;
+}
+
+static int pp_push_file(preproc_t* pp, pp_file_t* file, string_t path)
+{
+    const char* slash = strrchr(_S(path), '/');
+    size_t dirlen = (slash ? (size_t)(slash - _S(path)) : 0);
+    string_t dir = (slash == _S(path) ? string(pp->ctx, "/")
+                                      : string_intern(pp->ctx, _S(path), dirlen, strings_hash(_S(path), dirlen)));
+    if (!_S(dir)) {
+        return ENOMEM;
+    }
+
+    errno = 0;
+    input_buffer_t* in = buffer_open_flags(_S(path), pp->ctx->trigraphs ? kBufferTrigraphs : 0);
+    if (!in) {
+        return errno ? errno : EIO;
+    }
+
+    ++pp->stats.files_opened;
+    int error = pp_push(pp, in, file, dir);
+    if (!error) {
+        pp->top->path = path;
+    }
+
+    return error;
+}
+
+int preproc_push_file(preproc_t* pp, const char* path)
+{
+    if (!pp || !path) {
+        return EINVAL;
+    }
+
+    pp_file_t* file = NULL;
+    string_t key;
+    int error = pp_lookup(pp, path, strlen(path), &file, &key);
+    if (error) {
+        return error;
+    }
+
+    return file ? pp_push_file(pp, file, key) : ENOENT;
+}
+
+int preproc_push_buffer(preproc_t* pp, input_buffer_t* in)
+{
+    if (!pp || !in) {
+        return EINVAL;
+    }
+
+    return pp_push(pp, in, NULL, pp->empty);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Lines
+ */
+
+static int pp_lex(preproc_t* pp, pp_source_t* src, token_t* out)
+{
+    if (src->has_ahead) {
+        *out = src->ahead;
+        src->has_ahead = false;
+        pp->loc = out->loc;
+        return 0;
+    }
+
+    int error = parse_next_pp_token(pp->ctx, src->in, out);
+    pp->loc = (error ? src->base + (uint32_t)buffer_get_offset(src->in) : out->loc);
+    return error;
+}
+
+static inline void pp_unget(pp_source_t* src, const token_t* token)
+{
+    src->ahead = *token;
+    src->has_ahead = true;
+}
+
+static inline bool pp_is_op(const token_t* t, operator_kind_t op)
+{
+    return t->type == kTokenOperator && t->op == op;
+}
+
+// Identifiers and keywords, which are just identifiers to the preprocessor
+static inline bool pp_is_name(const token_t* t)
+{
+    return t->type == kTokenIdentifier || t->type == kTokenKeyword;
+}
+
+static inline bool pp_defined(string_t name)
+{
+    return string_info(name)->macro != NULL;
+}
+
+// Token text as it was written. Names have it in their value, everything else is found in the source:
+// values of operators are the same for digraphs and values of constants lack suffixes.
+static const char* pp_spelling(const token_t* t, size_t* len)
+{
+    if (pp_is_name(t)) {
+        *len = string_info(t->value)->length;
+        return _S(t->value);
+    }
+
+    uint32_t base = 0;
+    const char* data = srcmgr_source(t->loc, &base);
+    *len = (data ? t->size : 0);
+    return (data ? data + (t->loc - base) : "");
+}
+
+static directive_kind_t pp_directive_kind(const preproc_t* pp, const token_t* name)
+{
+    if (pp_is_name(name)) {
+        for (size_t i = 0; i < kDirectiveTotal; ++i) {
+            if (_S(name->value) == _S(pp->names[i])) {
+                return i;
+            }
+        }
+    }
+
+    return kDirectiveTotal;
+}
+
+// End of a block comment, 'p' is past its opening. Returns 'end' for unterminated comments.
+static const char* pp_comment_end(const char* p, const char* end)
+{
+    for (const char* q = p; ; ++q) {
+        q = charscan_find_char(q, end, '/');
+        if (q == end) {
+            return end;
+        }
+
+        if (q > p && q[-1] == '*') {
+            return q + 1;
+        }
+    }
+}
+
+// Skip horizontal whitespace and block comments
+static const char* pp_skip_space(const char* p, const char* end)
+{
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || *p == '\v' || *p == '\f' || *p == '\r') {
+            ++p;
+        } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+            p = pp_comment_end(p + 2, end);
+        } else {
+            break;
+        }
+    }
+
+    return p;
+}
+
+// Position after the end of the line 'p' is on.
+// Text is not lexed, only comments that can hide newlines and literals that can hide comment starts are
+// recognized. Like in gcc, unterminated quotes end at the end of the line, so that skipped groups can hold
+// any text.
+static const char* pp_skip_line(const char* p, const char* end)
+{
+    for (;;) {
+        p = charscan_find_line_special(p, end);
+        if (p == end) {
+            return end;
+        }
+
+        char c = *p++;
+        if (c == '\n') {
+            return p;
+        } else if (c == '/' && p < end && *p == '*') {
+            p = pp_comment_end(p + 1, end);
+        } else if (c == '/' && p < end && *p == '/') {
+            p = charscan_find_char(p, end, '\n');
+        } else if (c == '"' || c == '\'') {
+            for (;;) {
+                p = charscan_find_literal_end(p, end, c);
+                if (p == end || *p == '\n') {
+                    break;
+                } else if (*p == c) {
+                    ++p;
+                    break;
+                }
+
+                p += (p + 1 < end && p[1] != '\n') ? 2 : 1;
+            }
+        }
+    }
+}
+
+// Find the '#' or '%:' that starts the next directive, 'p' is at a line start.
+// Sets '*content' if lines with anything but whitespace and comments were passed.
+static const char* pp_next_directive(const char* p, const char* end, bool* content)
+{
+    while (p < end) {
+        const char* q = pp_skip_space(p, end);
+        if (q < end && *q == '#') {
+            return q;
+        } else if (end - q >= 2 && q[0] == '%' && q[1] == ':') {
+            return q;
+        } else if (q < end && *q != '\n' && !(*q == '/' && q + 1 < end && q[1] == '/')) {
+            *content = true;
+        }
+
+        p = pp_skip_line(q, end);
+    }
+
+    return NULL;
+}
+
+// Put back the token read ahead, returns current position in buffer text
+static const char* pp_rewind(pp_source_t* src)
+{
+    if (src->has_ahead) {
+        buffer_set_offset(src->in, src->ahead.loc - src->base);
+        src->has_ahead = false;
+    }
+
+    return buffer_get_data(src->in) + buffer_get_offset(src->in);
+}
+
+// Drop the rest of a directive line without lexing it
+static void pp_skip_directive(pp_source_t* src)
+{
+    if (src->has_ahead) {
+        return;     // Line has already ended
+    }
+
+    const char* begin = buffer_get_data(src->in);
+    const char* end = begin + buffer_get_size(src->in);
+    const char* p = begin + buffer_get_offset(src->in);
+    buffer_set_offset(src->in, pp_skip_line(p, end) - begin);
+}
+
+// Next token of a directive line, -1 once the line has ended.
+// A token that can not be lexed on one of the following lines is left for when that line is read.
+static int pp_lex_line(preproc_t* pp, pp_source_t* src, token_t* out)
+{
+    size_t offset = buffer_get_offset(src->in);
+    int error = pp_lex(pp, src, out);
+    if (error > 0) {
+        const char* begin = buffer_get_data(src->in);
+        const char* eol = pp_skip_line(begin + offset, begin + buffer_get_size(src->in));
+        if (begin + buffer_get_offset(src->in) >= eol) {
+            buffer_set_offset(src->in, eol - begin);
+            return -1;
+        }
+    } else if (!error && (out->flags & kTokenFlagLineStart)) {
+        pp_unget(src, out);
+        return -1;
+    }
+
+    return error;
+}
+
+static int pp_line_push(preproc_t* pp, const token_t* token)
+{
+    if (pp->line_count == pp->line_capacity) {
+        size_t newcap = (pp->line_capacity ? pp->line_capacity * 2 : 16);
+        token_t* line = realloc(pp->line, newcap * sizeof(*line));
+        if (!line) {
+            return ENOMEM;
+        }
+
+        pp->line = line;
+        pp->line_capacity = newcap;
+    }
+
+    pp->line[pp->line_count++] = *token;
+    return 0;
+}
+
+// Read the rest of a directive line into pp->line
+static int pp_read_line(preproc_t* pp, pp_source_t* src)
+{
+    pp->line_count = 0;
+    for (;;) {
+        token_t token;
+        int error = pp_lex_line(pp, src, &token);
+        if (error == -1) {
+            return 0;
+        } else if (error) {
+            return error;
+        }
+
+        error = pp_line_push(pp, &token);
+        if (error) {
+            return error;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Conditionals
+ */
+
+// Condition of #if and #elif, evaluated by precedence climbing as tokens come out of the macro expander.
+// Signed values are intmax_t and unsigned ones uintmax_t, both are kept as two's complement bits.
+typedef struct pp_value
+{
+    uintmax_t bits;
+    bool is_unsigned;
+} pp_value_t;
+
+typedef struct pp_eval
+{
+    preproc_t* pp;
+    pp_token_t cur;         // Token to look at next
+    bool eol;               // Directive line has ended, 'cur' is not valid
+    token_t head[5];        // First tokens of the line, enough to recognize a guard
+    size_t count;           // Tokens read
+} pp_eval_t;
+
+// Binding power of binary operators, higher binds tighter
+typedef enum
+{
+    kPrecNone = 0,          // Not a binary operator
+    kPrecComma,
+    kPrecConditional,
+    kPrecLogicalOr,
+    kPrecLogicalAnd,
+    kPrecOr,
+    kPrecXor,
+    kPrecAnd,
+    kPrecEquality,
+    kPrecRelational,
+    kPrecShift,
+    kPrecAdditive,
+    kPrecMultiplicative,
+} pp_prec_t;
+
+static const uint8_t g_binary_prec[kOperatorTotal] = {
+    [kOperatorComma] = kPrecComma,
+    [kOperatorQuestion] = kPrecConditional,
+    [kOperatorLogicalOr] = kPrecLogicalOr,
+    [kOperatorLogicalAnd] = kPrecLogicalAnd,
+    [kOperatorPipe] = kPrecOr,
+    [kOperatorCaret] = kPrecXor,
+    [kOperatorAmp] = kPrecAnd,
+    [kOperatorEqual] = kPrecEquality,
+    [kOperatorNotEqual] = kPrecEquality,
+    [kOperatorLess] = kPrecRelational,
+    [kOperatorGreater] = kPrecRelational,
+    [kOperatorLessEqual] = kPrecRelational,
+    [kOperatorGreaterEqual] = kPrecRelational,
+    [kOperatorShiftLeft] = kPrecShift,
+    [kOperatorShiftRight] = kPrecShift,
+    [kOperatorPlus] = kPrecAdditive,
+    [kOperatorMinus] = kPrecAdditive,
+    [kOperatorStar] = kPrecMultiplicative,
+    [kOperatorSlash] = kPrecMultiplicative,
+    [kOperatorPercent] = kPrecMultiplicative,
+};
+
+#define PP_VALUE_BITS   ((intmax_t)(sizeof(uintmax_t) * CHAR_BIT))
+
+static int pp_read(preproc_t* pp, pp_token_t* out);
+static int pp_expand_next(preproc_t* pp, pp_token_t* out);
+
+// Move to the next token of the line, operands of defined are read without expansion
+static int pp_eval_advance(pp_eval_t* ev, bool expand)
+{
+    int error = (expand ? pp_expand_next(ev->pp, &ev->cur) : pp_read(ev->pp, &ev->cur));
+    if (error == -1) {
+        ev->eol = true;
+        return 0;
+    } else if (error) {
+        return error;
+    }
+
+    if (ev->count < countof(ev->head)) {
+        ev->head[ev->count] = ev->cur.token;
+    }
+
+    ++ev->count;
+    return 0;
+}
+
+static inline bool pp_eval_at(const pp_eval_t* ev, operator_kind_t op)
+{
+    return !ev->eol && pp_is_op(&ev->cur.token, op);
+}
+
+static inline pp_value_t pp_bool_value(bool b)
+{
+    return (pp_value_t) { b, false };
+}
+
+// Syntax error at the current token
+static int pp_eval_error(pp_eval_t* ev)
+{
+    if (!ev->eol) {
+        ev->pp->loc = ev->cur.token.loc;
+    }
+
+    return EINVAL;
+}
+
+// 'defined X' or 'defined ( X )', the current token is 'defined'
+static int pp_eval_defined(pp_eval_t* ev, pp_value_t* out)
+{
+    int error = pp_eval_advance(ev, false);
+    bool paren = (!error && pp_eval_at(ev, kOperatorLParen));
+    if (paren) {
+        error = pp_eval_advance(ev, false);
+    }
+
+    if (error) {
+        return error;
+    } else if (ev->eol || !pp_is_name(&ev->cur.token)) {
+        return pp_eval_error(ev);
+    }
+
+    *out = pp_bool_value(pp_defined(ev->cur.token.value));
+    if (paren) {
+        error = pp_eval_advance(ev, false);
+        if (error) {
+            return error;
+        } else if (!pp_eval_at(ev, kOperatorRParen)) {
+            return pp_eval_error(ev);
+        }
+    }
+
+    return pp_eval_advance(ev, true);
+}
+
+static int pp_eval_expr(pp_eval_t* ev, pp_prec_t min_prec, bool live, pp_value_t* out);
+
+// Unary operators and primary expressions
+static int pp_eval_unary(pp_eval_t* ev, bool live, pp_value_t* out)
+{
+    if (ev->eol) {
+        return pp_eval_error(ev);
+    }
+
+    const token_t* t = &ev->cur.token;
+    if (t->type == kTokenIntConstant) {
+        // Constants that do not fit into intmax_t are unsigned even without a suffix
+        *out = (pp_value_t) { t->intval, t->inttype >= kIntegerTypeUnsigned || t->intval > INTMAX_MAX };
+        return pp_eval_advance(ev, true);
+    }
+
+    if (t->type == kTokenCharConstant) {
+        // Only char32_t is unsigned int, other character types promote to int
+        *out = (pp_value_t) { t->intval, t->encoding == kEncodingChar32 };
+        return pp_eval_advance(ev, true);
+    }
+
+    if (pp_is_name(t)) {
+        // Identifiers that are left after expansion are 0
+        if (_S(t->value) == _S(ev->pp->defined)) {
+            return pp_eval_defined(ev, out);
+        }
+
+        *out = pp_bool_value(false);
+        return pp_eval_advance(ev, true);
+    }
+
+    if (t->type != kTokenOperator) {
+        return pp_eval_error(ev);
+    }
+
+    operator_kind_t op = t->op;
+    if (op == kOperatorLParen) {
+        int error = pp_eval_advance(ev, true);
+        if (!error) {
+            error = pp_eval_expr(ev, kPrecComma, live, out);
+        }
+
+        if (error) {
+            return error;
+        } else if (!pp_eval_at(ev, kOperatorRParen)) {
+            return pp_eval_error(ev);
+        }
+
+        return pp_eval_advance(ev, true);
+    }
+
+    if (op != kOperatorPlus && op != kOperatorMinus && op != kOperatorTilde && op != kOperatorNot) {
+        return pp_eval_error(ev);
+    }
+
+    int error = pp_eval_advance(ev, true);
+    if (!error) {
+        error = pp_eval_unary(ev, live, out);
+    }
+
+    if (op == kOperatorMinus) {
+        out->bits = -out->bits;
+    } else if (op == kOperatorTilde) {
+        out->bits = ~out->bits;
+    } else if (op == kOperatorNot) {
+        *out = pp_bool_value(!out->bits);
+    }
+
+    return error;
+}
+
+// Shift by a count that may be negative or too large, the way the target does it
+static uintmax_t pp_shift(pp_value_t v, pp_value_t count, bool left)
+{
+    intmax_t n;
+    if (count.is_unsigned) {
+        n = (count.bits > (uintmax_t)PP_VALUE_BITS ? PP_VALUE_BITS : (intmax_t)count.bits);
+    } else {
+        n = (intmax_t)count.bits;
+        if (n < 0) {
+            left = !left;
+            n = (n < -PP_VALUE_BITS ? PP_VALUE_BITS : -n);
+        }
+    }
+
+    bool negative = (!v.is_unsigned && (intmax_t)v.bits < 0);
+    if (n >= PP_VALUE_BITS) {
+        return (!left && negative) ? UINTMAX_MAX : 0;
+    }
+
+    if (left) {
+        return v.bits << n;
+    }
+
+    return negative ? (uintmax_t)((intmax_t)v.bits >> n) : v.bits >> n;
+}
+
+// Apply a binary operator other than &&, || and ?:, its operands were evaluated if 'live' is set
+static int pp_binary(operator_kind_t op, pp_value_t lhs, pp_value_t rhs, bool live, pp_value_t* out)
+{
+    // Usual arithmetic conversions: one unsigned operand makes both of them unsigned
+    bool is_unsigned = (lhs.is_unsigned || rhs.is_unsigned);
+    uintmax_t a = lhs.bits;
+    uintmax_t b = rhs.bits;
+    intmax_t sa = (intmax_t)a;
+    intmax_t sb = (intmax_t)b;
+
+    out->is_unsigned = is_unsigned;
+    switch (op) {
+    case kOperatorStar:         out->bits = a * b; break;
+    case kOperatorPlus:         out->bits = a + b; break;
+    case kOperatorMinus:        out->bits = a - b; break;
+    case kOperatorAmp:          out->bits = a & b; break;
+    case kOperatorCaret:        out->bits = a ^ b; break;
+    case kOperatorPipe:         out->bits = a | b; break;
+    case kOperatorComma:        *out = rhs; break;
+    case kOperatorEqual:        *out = pp_bool_value(a == b); break;
+    case kOperatorNotEqual:     *out = pp_bool_value(a != b); break;
+    case kOperatorLess:         *out = pp_bool_value(is_unsigned ? a < b : sa < sb); break;
+    case kOperatorGreater:      *out = pp_bool_value(is_unsigned ? a > b : sa > sb); break;
+    case kOperatorLessEqual:    *out = pp_bool_value(is_unsigned ? a <= b : sa <= sb); break;
+    case kOperatorGreaterEqual: *out = pp_bool_value(is_unsigned ? a >= b : sa >= sb); break;
+
+    case kOperatorShiftLeft:
+    case kOperatorShiftRight:
+        // Result has the type of the left operand
+        out->bits = pp_shift(lhs, rhs, op == kOperatorShiftLeft);
+        out->is_unsigned = lhs.is_unsigned;
+        break;
+
+    case kOperatorSlash:
+    case kOperatorPercent:
+        if (!b) {
+            // Division by zero is only an error where it is evaluated
+            out->bits = 0;
+            return live ? EINVAL : 0;
+        }
+
+        if (is_unsigned) {
+            out->bits = (op == kOperatorSlash ? a / b : a % b);
+        } else if (sa == INTMAX_MIN && sb == -1) {
+            out->bits = (op == kOperatorSlash ? a : 0);     // Overflow wraps around
+        } else {
+            out->bits = (uintmax_t)(op == kOperatorSlash ? sa / sb : sa % sb);
+        }
+        break;
+
+    default:
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+// Expression of binary operators binding at least as tight as 'min_prec'.
+// Subexpressions that are not 'live' are only parsed, so that 0 && 1 / 0 is fine.
+static int pp_eval_expr(pp_eval_t* ev, pp_prec_t min_prec, bool live, pp_value_t* out)
+{
+    int error = pp_eval_unary(ev, live, out);
+    while (!error && !ev->eol && ev->cur.token.type == kTokenOperator) {
+        operator_kind_t op = ev->cur.token.op;
+        pp_prec_t prec = g_binary_prec[op];
+        if (prec == kPrecNone || prec < min_prec) {
+            break;
+        }
+
+        uint32_t loc = ev->cur.token.loc;
+        error = pp_eval_advance(ev, true);
+        if (error) {
+            break;
+        }
+
+        bool truth = (out->bits != 0);
+        pp_value_t rhs = { 0 };
+
+        if (op == kOperatorQuestion) {
+            // Middle operand is a full expression, the last one groups to the right
+            pp_value_t lhs = { 0 };
+            error = pp_eval_expr(ev, kPrecComma, live && truth, &lhs);
+            if (!error && !pp_eval_at(ev, kOperatorColon)) {
+                error = pp_eval_error(ev);
+            }
+
+            if (!error) {
+                error = pp_eval_advance(ev, true);
+            }
+
+            if (!error) {
+                error = pp_eval_expr(ev, kPrecConditional, live && !truth, &rhs);
+            }
+
+            *out = truth ? lhs : rhs;
+            out->is_unsigned = (lhs.is_unsigned || rhs.is_unsigned);
+        } else if (op == kOperatorLogicalAnd || op == kOperatorLogicalOr) {
+            bool is_and = (op == kOperatorLogicalAnd);
+            error = pp_eval_expr(ev, prec + 1, live && (truth == is_and), &rhs);
+            *out = pp_bool_value(is_and ? truth && rhs.bits : truth || rhs.bits);
+        } else {
+            error = pp_eval_expr(ev, prec + 1, live, &rhs);
+            if (!error) {
+                error = pp_binary(op, *out, rhs, live, out);
+                ev->pp->loc = (error ? loc : ev->pp->loc);
+            }
+        }
+    }
+
+    return error;
+}
+
+// '#if !defined X' and '#if !defined(X)' open a guard just like '#ifndef X' does
+static string_t pp_guard_expr(const pp_eval_t* ev)
+{
+    const token_t* t = ev->head;
+    size_t n = ev->count;
+    if (n < 3 || !pp_is_op(&t[0], kOperatorNot) || _S(t[1].value) != _S(ev->pp->defined)) {
+        return _MAKESTR(NULL);
+    }
+
+    if (n == 3 && pp_is_name(&t[2])) {
+        return t[2].value;
+    }
+
+    if (n == 5 && pp_is_op(&t[2], kOperatorLParen) && pp_is_name(&t[3]) && pp_is_op(&t[4], kOperatorRParen)) {
+        return t[3].value;
+    }
+
+    return _MAKESTR(NULL);
+}
+
+// Stop expanding a directive line. After an error the expansion may be left half way.
+static void pp_end_line(preproc_t* pp)
+{
+    if (pp->frame_count) {
+        pp->frame_count = 0;
+        arena_reset(pp->expansion);
+    }
+
+    pp->pending_flags = -1;
+    pp->line_src = NULL;
+}
+
+// Evaluate the rest of the directive line, tokens are expanded as they are read and nothing is allocated
+// unless a macro is invoked. Sets '*guard' to X for '!defined X'.
+static int pp_eval(preproc_t* pp, pp_source_t* src, bool* out, string_t* guard)
+{
+    pp_eval_t ev = { .pp = pp };
+    pp_value_t value = { 0 };
+
+    pp->line_src = src;
+    int error = pp_eval_advance(&ev, true);
+    if (!error) {
+        error = pp_eval_expr(&ev, kPrecComma, true, &value);
+    }
+
+    if (!error && !ev.eol) {
+        error = pp_eval_error(&ev);
+    }
+
+    pp_end_line(pp);
+
+    *out = (value.bits != 0);
+    if (guard) {
+        *guard = pp_guard_expr(&ev);
+    }
+
+    return error;
+}
+
+// #else or #elif of the guard conditional means that the file has something outside of the guard
+static void pp_guard_branch(const preproc_t* pp, pp_source_t* src)
+{
+    if (src->guard == kGuardInside && pp->cond_count == src->guard_depth) {
+        src->guard = kGuardNone;
+    }
+}
+
+static int pp_endif(preproc_t* pp, pp_source_t* src)
+{
+    // Extra tokens after #endif are tolerated, old code has them
+    pp_skip_directive(src);
+    if (pp->cond_count <= src->cond_base) {
+        return EINVAL;
+    }
+
+    if (src->guard == kGuardInside && pp->cond_count == src->guard_depth) {
+        src->guard = kGuardEnded;
+    }
+
+    --pp->cond_count;
+    return 0;
+}
+
+// Skip lines of a group whose condition is false up to the #elif, #else or #endif that ends it.
+// Returns with the rest of that directive line unread.
+static int pp_skip_group(preproc_t* pp, pp_source_t* src, directive_kind_t* out_kind)
+{
+    const char* begin = buffer_get_data(src->in);
+    const char* end = begin + buffer_get_size(src->in);
+    const char* p = pp_rewind(src);
+    size_t depth = 0;
+    bool content = false;
+
+    while (p < end) {
+        const char* q = pp_next_directive(p, end, &content);
+        if (!q) {
+            break;
+        }
+
+        buffer_set_offset(src->in, q + (*q == '#' ? 1 : 2) - begin);
+        token_t name;
+        int error = pp_lex(pp, src, &name);
+        p = begin + buffer_get_offset(src->in);
+        if (error == -1) {
+            break;
+        } else if (error) {
+            // Anything goes in skipped groups
+            p = pp_skip_line(p, end);
+            continue;
+        } else if (name.flags & kTokenFlagLineStart) {
+            p = begin + (name.loc - src->base);
+            continue;
+        }
+
+        directive_kind_t kind = pp_directive_kind(pp, &name);
+        if (kind == kDirectiveIf || kind == kDirectiveIfdef || kind == kDirectiveIfndef) {
+            ++depth;
+        } else if (kind == kDirectiveElif || kind == kDirectiveElse || kind == kDirectiveEndif) {
+            if (depth == 0) {
+                *out_kind = kind;
+                return 0;
+            }
+
+            depth -= (kind == kDirectiveEndif);
+        }
+
+        p = pp_skip_line(p, end);
+    }
+
+    buffer_set_offset(src->in, end - begin);
+    pp->loc = pp->conds[pp->cond_count - 1].loc;
+    return EINVAL;
+}
+
+// Skip groups of the innermost conditional until one of them is taken or the conditional ends
+static int pp_skip(preproc_t* pp, pp_source_t* src)
+{
+    for (;;) {
+        directive_kind_t kind;
+        int error = pp_skip_group(pp, src, &kind);
+        if (error) {
+            return error;
+        }
+
+        if (kind == kDirectiveEndif) {
+            return pp_endif(pp, src);
+        }
+
+        pp_cond_t* cond = &pp->conds[pp->cond_count - 1];
+        if (cond->seen_else) {
+            return EINVAL;
+        }
+
+        pp_guard_branch(pp, src);
+        if (kind == kDirectiveElse) {
+            pp_skip_directive(src);
+            cond->seen_else = true;
+            if (!cond->taken) {
+                cond->taken = true;
+                return 0;
+            }
+        } else if (!cond->taken) {
+            bool value = false;
+            error = pp_eval(pp, src, &value, NULL);
+            if (error) {
+                return error;
+            }
+
+            if (value) {
+                cond->taken = true;
+                return 0;
+            }
+        } else {
+            pp_skip_directive(src);
+        }
+    }
+}
+
+// Open a conditional, a non-NULL 'guard' is the macro that may guard the whole file
+static int pp_cond(preproc_t* pp, pp_source_t* src, uint32_t loc, bool value, string_t guard)
+{
+    if (pp->cond_count == pp->cond_capacity) {
+        size_t newcap = (pp->cond_capacity ? pp->cond_capacity * 2 : 16);
+        pp_cond_t* conds = realloc(pp->conds, newcap * sizeof(*conds));
+        if (!conds) {
+            return ENOMEM;
+        }
+
+        pp->conds = conds;
+        pp->cond_capacity = newcap;
+    }
+
+    pp->conds[pp->cond_count++] = (pp_cond_t){ .loc = loc, .taken = value, .seen_else = false };
+
+    if (_S(guard)) {
+        src->guard = kGuardInside;
+        src->guard_macro = guard;
+        src->guard_depth = pp->cond_count;
+    }
+
+    return value ? 0 : pp_skip(pp, src);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Directives
+ */
+
+// Macro expand the rest of a directive line into pp->line
+static int pp_expand_line(preproc_t* pp, pp_source_t* src)
+{
+    pp->line_count = 0;
+    pp->line_src = src;
+
+    int error;
+    pp_token_t token;
+    while (!(error = pp_expand_next(pp, &token))) {
+        error = pp_line_push(pp, &token.token);
+        if (error) {
+            break;
+        }
+    }
+
+    pp_end_line(pp);
+    return (error == -1 ? 0 : error);
+}
+
+// Header name of a computed include, the expanded line has to be a string literal
+// or tokens between < and > which are spelled with single spaces between them (C11 6.10.2p4)
+static int pp_include_name(preproc_t* pp, pp_source_t* src, const char** out, size_t* out_len, char* out_close)
+{
+    int error = pp_expand_line(pp, src);
+    if (error) {
+        return error;
+    }
+
+    const token_t* t = pp->line;
+    size_t n = pp->line_count;
+    if (n) {
+        pp->loc = t[0].loc;
+    }
+
+    if (n == 1 && t[0].type == kTokenStrConstant) {
+        size_t len;
+        const char* s = pp_spelling(&t[0], &len);
+        if (len < 3 || s[0] != '"') {
+            return EINVAL;  // Empty or prefixed literals do not name headers
+        }
+
+        *out = s + 1;
+        *out_len = len - 2;
+        *out_close = '"';
+        return 0;
+    }
+
+    if (n < 3 || !pp_is_op(&t[0], kOperatorLess) || !pp_is_op(&t[n - 1], kOperatorGreater)) {
+        return EINVAL;
+    }
+
+    size_t size = 0;
+    for (size_t i = 1; i + 1 < n; ++i) {
+        size_t len;
+        pp_spelling(&t[i], &len);
+        size += 1 + len;
+    }
+
+    char* text = arena_alloc(pp->arena, size);
+    if (!text) {
+        return ENOMEM;
+    }
+
+    size_t len = 0;
+    for (size_t i = 1; i + 1 < n; ++i) {
+        if (i > 1 && (t[i].flags & (kTokenFlagLeadingSpace | kTokenFlagLineStart))) {
+            text[len++] = ' ';
+        }
+
+        size_t tlen;
+        const char* s = pp_spelling(&t[i], &tlen);
+        memcpy(text + len, s, tlen);
+        len += tlen;
+    }
+
+    *out = text;
+    *out_len = len;
+    *out_close = '>';
+    return 0;
+}
+
+static int pp_include(preproc_t* pp, pp_source_t* src)
+{
+    const char* begin = buffer_get_data(src->in);
+    const char* end = begin + buffer_get_size(src->in);
+    const char* p = pp_skip_space(pp_rewind(src), end);
+
+    int error = 0;
+    const char* name;
+    size_t len;
+    char close;
+
+    // Header names are taken as they are written, they are not tokens. Anything else is expanded first.
+    if (p == end || *p == '\n') {
+        return EINVAL;
+    } else if (*p == '<' || *p == '"') {
+        close = (*p == '<' ? '>' : '"');
+        name = p + 1;
+        const char* q = name;
+        while (q < end && *q != close && *q != '\n') {
+            ++q;
+        }
+
+        if (q == end || *q != close || q == name) {
+            return EINVAL;
+        }
+
+        pp->loc = src->base + (uint32_t)(name - begin);
+        buffer_set_offset(src->in, q + 1 - begin);
+        pp_skip_directive(src);
+        len = q - name;
+    } else {
+        error = pp_include_name(pp, src, &name, &len, &close);
+        if (error) {
+            return error;
+        }
+    }
+
+    pp_file_t* file = NULL;
+    string_t path;
+    if (name[0] == '/') {
+        error = pp_lookup(pp, name, len, &file, &path);
+    } else {
+        if (close == '"') {
+            error = pp_lookup_in(pp, src->dir, name, len, &file, &path);
+        }
+
+        for (size_t i = 0; !error && !file && i < pp->dir_count; ++i) {
+            error = pp_lookup_in(pp, pp->dirs[i], name, len, &file, &path);
+        }
+    }
+
+    if (error) {
+        return error;
+    } else if (!file) {
+        return ENOENT;
+    }
+
+    bool skip = (file->once && file->included) || (_S(file->guard) && pp_defined(file->guard));
+    if (pp->on_include) {
+        preproc_include_t inc = { .from = _S(src->path), .path = _S(path), .loc = pp->loc, .skipped = skip };
+        error = pp->on_include(pp->on_include_ctx, &inc);
+        if (error) {
+            return error;
+        }
+    }
+
+    if (skip) {
+        ++pp->stats.includes_skipped;
+        return 0;
+    }
+
+    return pp_push_file(pp, file, path);
+}
+
+// Parameter index + 1 of a token in a replacement list, 0 if it is not a parameter
+static uint16_t pp_param_ref(const pp_macro_t* m, const token_t* t)
+{
+    if (pp_is_name(t)) {
+        for (size_t i = 0; i < m->param_count; ++i) {
+            if (_S(m->params[i]) == _S(t->value)) {
+                return (uint16_t)(i + 1);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static bool pp_same_spelling(const token_t* a, const token_t* b)
+{
+    size_t alen, blen;
+    const char* as = pp_spelling(a, &alen);
+    const char* bs = pp_spelling(b, &blen);
+    return a->type == b->type && alen == blen && 0 == memcmp(as, bs, alen);
+}
+
+// Definitions are the same if they have the same parameters, tokens and whitespace separation
+static bool pp_same_definition(const pp_macro_t* a, const pp_macro_t* b)
+{
+    if (a->function_like != b->function_like || a->variadic != b->variadic ||
+        a->param_count != b->param_count || a->token_count != b->token_count) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a->param_count; ++i) {
+        if (_S(a->params[i]) != _S(b->params[i])) {
+            return false;
+        }
+    }
+
+    const uint16_t spacing = kTokenFlagLeadingSpace | kTokenFlagLineStart;
+    for (size_t i = 0; i < a->token_count; ++i) {
+        const token_t* at = &a->tokens[i].token;
+        const token_t* bt = &b->tokens[i].token;
+        if (!pp_same_spelling(at, bt) || (i && !(at->flags & spacing) != !(bt->flags & spacing))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int pp_define(preproc_t* pp, pp_source_t* src)
+{
+    int error = pp_read_line(pp, src);
+    if (error) {
+        return error;
+    }
+
+    const token_t* t = pp->line;
+    size_t n = pp->line_count;
+    if (n == 0 || !pp_is_name(&t[0]) || _S(t[0].value) == _S(pp->defined)) {
+        return EINVAL;
+    }
+
+    pp_macro_t* m = arena_alloc(pp->arena, sizeof(*m));
+    if (!m) {
+        return ENOMEM;
+    }
+
+    memset(m, 0, sizeof(*m));
+    m->name = t[0].value;
+    m->loc = t[0].loc;
+
+    // Parameter list only starts with a parenthesis right after the name
+    size_t i = 1;
+    if (n > 1 && pp_is_op(&t[1], kOperatorLParen) && !(t[1].flags & kTokenFlagLeadingSpace)) {
+        m->function_like = true;
+        m->params = arena_alloc(pp->arena, n * sizeof(*m->params));
+        if (!m->params) {
+            return ENOMEM;
+        }
+
+        i = 2;
+        while (i < n && !pp_is_op(&t[i], kOperatorRParen)) {
+            if (m->param_count && !pp_is_op(&t[i++], kOperatorComma)) {
+                return EINVAL;
+            }
+
+            if (i < n && pp_is_op(&t[i], kOperatorEllipsis)) {
+                m->variadic = true;
+                m->params[m->param_count++] = pp->va_args;
+                ++i;
+                break;
+            }
+
+            if (i >= n || !pp_is_name(&t[i]) || _S(t[i].value) == _S(pp->va_args)) {
+                return EINVAL;
+            }
+
+            if (pp_param_ref(m, &t[i]) || m->param_count == UINT16_MAX) {
+                return EINVAL;
+            }
+
+            m->params[m->param_count++] = t[i++].value;
+        }
+
+        if (i >= n || !pp_is_op(&t[i], kOperatorRParen)) {
+            return EINVAL;
+        }
+
+        ++i;
+    }
+
+    // __VA_ARGS__ is only allowed in variadic macros
+    for (size_t k = i; k < n; ++k) {
+        if (_S(t[k].value) == _S(pp->va_args) && !m->variadic) {
+            return EINVAL;
+        }
+    }
+
+    m->token_count = n - i;
+    if (m->token_count) {
+        m->tokens = arena_alloc(pp->arena, m->token_count * sizeof(*m->tokens));
+        m->refs = (m->function_like ? arena_alloc(pp->arena, m->token_count * sizeof(*m->refs)) : NULL);
+        if (!m->tokens || (m->function_like && !m->refs)) {
+            return ENOMEM;
+        }
+    }
+
+    for (size_t k = 0; k < m->token_count; ++k) {
+        const token_t* b = &t[i + k];
+        m->tokens[k] = (pp_token_t){ .token = *b, .hs = NULL };
+        if (m->function_like) {
+            m->refs[k] = pp_param_ref(m, b);
+        }
+
+        if (pp_is_op(b, kOperatorHashHash)) {
+            // ## needs operands on both sides
+            if (k == 0 || k + 1 == m->token_count) {
+                return EINVAL;
+            }
+
+            m->has_ops = true;
+        } else if (m->function_like && pp_is_op(b, kOperatorHash)) {
+            // # only applies to parameters
+            if (k + 1 == m->token_count || !pp_param_ref(m, b + 1)) {
+                return EINVAL;
+            }
+
+            m->has_ops = true;
+        }
+    }
+
+    // Macro can only be redefined the same way it is defined
+    pp_macro_t* old = dict_search(pp->definitions, m->name);
+    if (old) {
+        pp->loc = m->loc;
+        return pp_same_definition(old, m) ? 0 : EINVAL;
+    }
+
+    error = dict_insert(pp->definitions, m->name, m);
+    if (error) {
+        return error;
+    }
+
+    m->next = pp->macros;
+    pp->macros = m;
+    string_info(m->name)->macro = m;
+    return 0;
+}
+
+static int pp_undef(preproc_t* pp, pp_source_t* src)
+{
+    int error = pp_read_line(pp, src);
+    if (error) {
+        return error;
+    }
+
+    if (pp->line_count == 0 || !pp_is_name(&pp->line[0])) {
+        return EINVAL;
+    }
+
+    dict_remove(pp->definitions, pp->line[0].value);
+    string_info(pp->line[0].value)->macro = NULL;
+    return 0;
+}
+
+static int pp_pragma(preproc_t* pp, pp_source_t* src)
+{
+    token_t token;
+    int error = pp_lex_line(pp, src, &token);
+    if (error) {
+        return error == -1 ? 0 : error;
+    }
+
+    // Other pragmas are for the compiler and are dropped
+    if (_S(token.value) == _S(pp->once) && src->file) {
+        src->file->once = true;
+    }
+
+    pp_skip_directive(src);
+    return 0;
+}
+
+// Execute a directive in a group that is not skipped, '#' is already read
+static int pp_directive(preproc_t* pp, pp_source_t* src, uint32_t loc)
+{
+    token_t name;
+    int error = pp_lex_line(pp, src, &name);
+    if (error) {
+        return error == -1 ? 0 : error;   // Null directive
+    }
+
+    // Only the conditional opening the file can be its guard, anything after its end breaks it
+    bool first = (src->guard == kGuardStart);
+    if (src->guard != kGuardInside) {
+        src->guard = kGuardNone;
+    }
+
+    directive_kind_t kind = pp_directive_kind(pp, &name);
+    switch (kind) {
+    case kDirectiveInclude:
+        return pp_include(pp, src);
+
+    case kDirectiveDefine:
+        return pp_define(pp, src);
+
+    case kDirectiveUndef:
+        return pp_undef(pp, src);
+
+    case kDirectiveIfdef:
+    case kDirectiveIfndef: {
+        error = pp_read_line(pp, src);
+        if (error) {
+            return error;
+        } else if (pp->line_count == 0 || !pp_is_name(&pp->line[0])) {
+            return EINVAL;
+        }
+
+        string_t macro = pp->line[0].value;
+        bool value = (pp_defined(macro) == (kind == kDirectiveIfdef));
+        return pp_cond(pp, src, loc, value, (first && kind == kDirectiveIfndef) ? macro : _MAKESTR(NULL));
+    }
+
+    case kDirectiveIf: {
+        bool value = false;
+        string_t guard = _MAKESTR(NULL);
+        error = pp_eval(pp, src, &value, first ? &guard : NULL);
+        if (error) {
+            return error;
+        }
+
+        return pp_cond(pp, src, loc, value, guard);
+    }
+
+    case kDirectiveElif:
+    case kDirectiveElse: {
+        if (pp->cond_count <= src->cond_base || pp->conds[pp->cond_count - 1].seen_else) {
+            return EINVAL;
+        }
+
+        // Group that just ended was taken, so everything up to #endif is skipped
+        pp_guard_branch(pp, src);
+        pp->conds[pp->cond_count - 1].seen_else = (kind == kDirectiveElse);
+        pp_skip_directive(src);
+        return pp_skip(pp, src);
+    }
+
+    case kDirectiveEndif:
+        return pp_endif(pp, src);
+
+    case kDirectivePragma:
+        return pp_pragma(pp, src);
+
+    case kDirectiveLine:
+    case kDirectiveWarning:
+        pp_skip_directive(src);
+        return 0;
+
+    case kDirectiveError:
+        pp->loc = loc;
+        return ECANCELED;
+
+    default:
+        return EINVAL;
+    }
+}
+
+// End current source, all conditionals opened in it should be closed
+static int pp_pop(preproc_t* pp)
+{
+    pp_source_t* src = pp->top;
+    if (pp->cond_count > src->cond_base) {
+        pp->loc = pp->conds[pp->cond_count - 1].loc;
+        return EINVAL;
+    }
+
+    if (src->file) {
+        src->file->guard = (src->guard == kGuardEnded ? src->guard_macro : _MAKESTR(NULL));
+    }
+
+    pp->top = src->parent;
+    --pp->depth;
+
+    src->parent = pp->retired;
+    pp->retired = src;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Macro expansion
+ */
+
+static inline uintptr_t pp_addr(string_t name)
+{
+    return (uintptr_t)_S(name);
+}
+
+static inline uint32_t pp_hideset_hash(string_t name, const pp_hideset_t* rest)
+{
+    uint64_t key = ((uint64_t)pp_addr(name) ^ ((uint64_t)(uintptr_t)rest * 31)) * 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(key >> 32);
+}
+
+// Hide set made of 'name' followed by 'rest', name must be higher than all names in rest
+static int pp_hideset_intern(preproc_t* pp, string_t name, const pp_hideset_t* rest, const pp_hideset_t** out)
+{
+    if (2 * (pp->hideset_count + 1) > pp->hideset_capacity) {
+        size_t newcap = (pp->hideset_capacity ? pp->hideset_capacity * 2 : 256);
+        const pp_hideset_t** table = calloc(newcap, sizeof(*table));
+        if (!table) {
+            return ENOMEM;
+        }
+
+        for (size_t i = 0; i < pp->hideset_capacity; ++i) {
+            const pp_hideset_t* hs = pp->hidesets[i];
+            if (hs) {
+                size_t k = pp_hideset_hash(hs->name, hs->rest) & (newcap - 1);
+                while (table[k]) {
+                    k = (k + 1) & (newcap - 1);
+                }
+
+                table[k] = hs;
+            }
+        }
+
+        free(pp->hidesets);
+        pp->hidesets = table;
+        pp->hideset_capacity = newcap;
+    }
+
+    size_t mask = pp->hideset_capacity - 1;
+    size_t k = pp_hideset_hash(name, rest) & mask;
+    for (; pp->hidesets[k]; k = (k + 1) & mask) {
+        if (_S(pp->hidesets[k]->name) == _S(name) && pp->hidesets[k]->rest == rest) {
+            *out = pp->hidesets[k];
+            return 0;
+        }
+    }
+
+    pp_hideset_t* hs = arena_alloc(pp->arena, sizeof(*hs));
+    if (!hs) {
+        return ENOMEM;
+    }
+
+    hs->name = name;
+    hs->rest = rest;
+    pp->hidesets[k] = hs;
+    ++pp->hideset_count;
+    *out = hs;
+    return 0;
+}
+
+static bool pp_hideset_contains(const pp_hideset_t* hs, string_t name)
+{
+    for (; hs && pp_addr(hs->name) >= pp_addr(name); hs = hs->rest) {
+        if (_S(hs->name) == _S(name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int pp_hideset_union(preproc_t* pp, const pp_hideset_t* a, const pp_hideset_t* b, const pp_hideset_t** out)
+{
+    if (!a || !b || a == b) {
+        *out = (a ? a : b);
+        return 0;
+    }
+
+    // Merge sorted lists, sharing the tail that does not change
+    const pp_hideset_t* head = (pp_addr(a->name) >= pp_addr(b->name) ? a : b);
+    const pp_hideset_t* lhs = (head == a ? a->rest : a);
+    const pp_hideset_t* rhs = (pp_addr(b->name) >= pp_addr(a->name) ? b->rest : b);
+
+    const pp_hideset_t* rest = NULL;
+    int error = pp_hideset_union(pp, lhs, rhs, &rest);
+    if (error) {
+        return error;
+    }
+
+    if (rest == head->rest) {
+        *out = head;
+        return 0;
+    }
+
+    return pp_hideset_intern(pp, head->name, rest, out);
+}
+
+static int pp_hideset_intersect(preproc_t* pp, const pp_hideset_t* a, const pp_hideset_t* b, const pp_hideset_t** out)
+{
+    while (a && b && a != b && _S(a->name) != _S(b->name)) {
+        if (pp_addr(a->name) > pp_addr(b->name)) {
+            a = a->rest;
+        } else {
+            b = b->rest;
+        }
+    }
+
+    if (!a || !b || a == b) {
+        *out = (a == b ? a : NULL);
+        return 0;
+    }
+
+    const pp_hideset_t* rest = NULL;
+    int error = pp_hideset_intersect(pp, a->rest, b->rest, &rest);
+    if (error) {
+        return error;
+    }
+
+    if (rest == a->rest) {
+        *out = a;
+        return 0;
+    }
+
+    return pp_hideset_intern(pp, a->name, rest, out);
+}
+
+static int pp_hideset_add(preproc_t* pp, const pp_hideset_t* hs, string_t name, const pp_hideset_t** out)
+{
+    const pp_hideset_t* single = NULL;
+    int error = pp_hideset_intern(pp, name, NULL, &single);
+    return error ? error : pp_hideset_union(pp, hs, single, out);
+}
+
+// Growable token array for tokens that have to be copied
+typedef struct pp_vector
+{
+    pp_token_t* tokens;
+    size_t count;
+    size_t capacity;
+} pp_vector_t;
+
+static int pp_vector_push(pp_vector_t* v, const pp_token_t* t)
+{
+    if (v->count == v->capacity) {
+        size_t newcap = (v->capacity ? v->capacity * 2 : 16);
+        pp_token_t* tokens = realloc(v->tokens, newcap * sizeof(*tokens));
+        if (!tokens) {
+            return ENOMEM;
+        }
+
+        v->tokens = tokens;
+        v->capacity = newcap;
+    }
+
+    v->tokens[v->count++] = *t;
+    return 0;
+}
+
+// Append tokens of a span, with span hide set added to their own
+static int pp_vector_append(preproc_t* pp, pp_vector_t* v, const pp_span_t* span)
+{
+    for (size_t i = 0; i < span->count; ++i) {
+        pp_token_t t = { .token = span->tokens[i].token };
+        int error = pp_hideset_union(pp, span->tokens[i].hs, span->hs, &t.hs);
+        if (!error) {
+            error = pp_vector_push(v, &t);
+        }
+
+        if (error) {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+// Move vector contents to the expansion arena
+static int pp_vector_span(preproc_t* pp, pp_vector_t* v, pp_span_t* out)
+{
+    *out = (pp_span_t){ .tokens = NULL, .count = v->count, .hs = NULL };
+    if (v->count) {
+        pp_token_t* tokens = arena_alloc(pp->expansion, v->count * sizeof(*tokens));
+        if (!tokens) {
+            return ENOMEM;
+        }
+
+        memcpy(tokens, v->tokens, v->count * sizeof(*tokens));
+        out->tokens = tokens;
+    }
+
+    free(v->tokens);
+    *v = (pp_vector_t){ 0 };
+    return 0;
+}
+
+static int pp_push_frame(preproc_t* pp, const pp_frame_t* frame)
+{
+    if (pp->frame_count == pp->frame_capacity) {
+        size_t newcap = (pp->frame_capacity ? pp->frame_capacity * 2 : 16);
+        pp_frame_t* frames = realloc(pp->frames, newcap * sizeof(*frames));
+        if (!frames) {
+            return ENOMEM;
+        }
+
+        pp->frames = frames;
+        pp->frame_capacity = newcap;
+    }
+
+    pp->frames[pp->frame_count++] = *frame;
+    return 0;
+}
+
+// Leave the innermost frame, everything allocated for expansions goes away with the last one
+static void pp_pop_frame(preproc_t* pp)
+{
+    if (--pp->frame_count == 0) {
+        arena_reset(pp->expansion);
+    }
+}
+
+// Lex a token made by # or ##. Its text is registered as a source of its own, so that it has a location.
+static int pp_scratch_token(preproc_t* pp, char* text, size_t len, token_t* out)
+{
+    if (pp->scratch_count == pp->scratch_capacity) {
+        size_t newcap = (pp->scratch_capacity ? pp->scratch_capacity * 2 : 16);
+        input_buffer_t** scratch = realloc(pp->scratch, newcap * sizeof(*scratch));
+        if (!scratch) {
+            return ENOMEM;
+        }
+
+        pp->scratch = scratch;
+        pp->scratch_capacity = newcap;
+    }
+
+    input_buffer_t* in = buffer_mem(text, len);
+    if (!in) {
+        return ENOMEM;
+    }
+
+    pp->scratch[pp->scratch_count++] = in;
+
+    // Text has to make exactly one token
+    token_t extra;
+    int error = parse_next_pp_token(pp->ctx, in, out);
+    if (!error) {
+        error = parse_next_pp_token(pp->ctx, in, &extra);
+        error = (error == -1 ? 0 : (error ? error : EINVAL));
+    }
+
+    return (error == -1 || error == EILSEQ) ? EINVAL : error;
+}
+
+// String literal with the spelling of argument tokens (C11 6.10.3.2)
+static int pp_stringify(preproc_t* pp, const pp_span_t* arg, token_t* out)
+{
+    // Every token may be preceded by a space and have all of its characters escaped
+    size_t size = 2;
+    for (size_t i = 0; i < arg->count; ++i) {
+        size_t len;
+        pp_spelling(&arg->tokens[i].token, &len);
+        size += 1 + 2 * len;
+    }
+
+    char* text = arena_alloc(pp->arena, size);
+    if (!text) {
+        return ENOMEM;
+    }
+
+    size_t n = 0;
+    text[n++] = '"';
+    for (size_t i = 0; i < arg->count; ++i) {
+        const token_t* t = &arg->tokens[i].token;
+        if (i && (t->flags & (kTokenFlagLeadingSpace | kTokenFlagLineStart))) {
+            text[n++] = ' ';
+        }
+
+        size_t len;
+        const char* p = pp_spelling(t, &len);
+        bool literal = (t->type == kTokenStrConstant || t->type == kTokenCharConstant);
+        for (size_t k = 0; k < len; ++k) {
+            if (literal && (p[k] == '"' || p[k] == '\\')) {
+                text[n++] = '\\';
+            }
+
+            text[n++] = p[k];
+        }
+    }
+
+    text[n++] = '"';
+    return pp_scratch_token(pp, text, n, out);
+}
+
+// Token made of spellings of two tokens (C11 6.10.3.3)
+static int pp_paste(preproc_t* pp, const token_t* lhs, const token_t* rhs, token_t* out)
+{
+    size_t llen, rlen;
+    const char* l = pp_spelling(lhs, &llen);
+    const char* r = pp_spelling(rhs, &rlen);
+
+    char* text = arena_alloc(pp->arena, llen + rlen);
+    if (!text) {
+        return ENOMEM;
+    }
+
+    memcpy(text, l, llen);
+    memcpy(text + llen, r, rlen);
+
+    uint16_t flags = lhs->flags;
+    int error = pp_scratch_token(pp, text, llen + rlen, out);
+    out->flags = flags;
+    return error;
+}
+
+// Fully macro expand an argument on its own, before it replaces a parameter
+static int pp_expand_arg(preproc_t* pp, pp_arg_t* arg)
+{
+    // Arguments without macro names stay as they are
+    bool plain = true;
+    for (size_t i = 0; plain && i < arg->raw.count; ++i) {
+        const token_t* t = &arg->raw.tokens[i].token;
+        plain = !(pp_is_name(t) && pp_defined(t->value));
+    }
+
+    if (plain) {
+        arg->expanded = arg->raw;
+        arg->is_expanded = true;
+        return 0;
+    }
+
+    pp_frame_t frame = { .span = arg->raw, .barrier = true };
+    int error = pp_push_frame(pp, &frame);
+    if (error) {
+        return error;
+    }
+
+    size_t base = pp->frame_count - 1;
+    int flags = pp->pending_flags;
+    pp->pending_flags = -1;
+
+    pp_vector_t v = { 0 };
+    for (;;) {
+        pp_token_t t;
+        error = pp_expand_next(pp, &t);
+        if (!error) {
+            error = pp_vector_push(&v, &t);
+        }
+
+        if (error) {
+            break;
+        }
+    }
+
+    // Frames above the barrier have ended, it is never popped on its own
+    pp->frame_count = base;
+    pp->pending_flags = flags;
+
+    if (error == -1) {
+        error = pp_vector_span(pp, &v, &arg->expanded);
+        arg->is_expanded = !error;
+    }
+
+    free(v.tokens);
+    return error;
+}
+
+// Read from the expanded argument in place of a parameter, its first token is placed where the parameter was
+static int pp_push_arg(preproc_t* pp, pp_arg_t* arg, const pp_hideset_t* hs, uint16_t flags)
+{
+    int error = (arg->is_expanded ? 0 : pp_expand_arg(pp, arg));
+    if (error || !arg->expanded.count) {
+        return error;
+    }
+
+    // Placement of a macro name wins when the parameter starts the replacement list
+    if (pp->pending_flags < 0) {
+        pp->pending_flags = flags & (kTokenFlagLineStart | kTokenFlagLeadingSpace);
+    }
+
+    pp_frame_t frame = { .span = arg->expanded };
+    error = pp_hideset_union(pp, arg->expanded.hs, hs, &frame.span.hs);
+    return error ? error : pp_push_frame(pp, &frame);
+}
+
+// Next token from the source, executing directives on the way. Returns -1 at the end of the current source.
+static int pp_read_source(preproc_t* pp, token_t* out)
+{
+    for (;;) {
+        pp_source_t* src = pp->top;
+        if (!src) {
+            return -1;
+        }
+
+        int error = pp_lex(pp, src, out);
+        if (error) {
+            return error;
+        }
+
+        if ((out->flags & kTokenFlagLineStart) && pp_is_op(out, kOperatorHash)) {
+            error = pp_directive(pp, src, out->loc);
+            if (error) {
+                return error;
+            }
+
+            continue;
+        }
+
+        if (src->guard != kGuardInside) {
+            src->guard = kGuardNone;
+        }
+
+        return 0;
+    }
+}
+
+// Next token before expansion, from the innermost frame or from the source when there are no frames.
+// Returns -1 at the end of an argument expanded on its own, at the end of the current source
+// and at the end of the directive line while one is evaluated.
+static int pp_read(preproc_t* pp, pp_token_t* out)
+{
+    for (;;) {
+        if (!pp->frame_count) {
+            out->hs = NULL;
+            int error = (pp->line_src ? pp_lex_line(pp, pp->line_src, &out->token) : pp_read_source(pp, &out->token));
+            if (error) {
+                return error;
+            }
+
+            break;
+        }
+
+        pp_frame_t* f = &pp->frames[pp->frame_count - 1];
+        if (f->pos == f->span.count) {
+            if (f->barrier) {
+                return -1;
+            }
+
+            pp_pop_frame(pp);
+            continue;
+        }
+
+        size_t pos = f->pos++;
+        if (f->macro && f->macro->refs[pos]) {
+            int error = pp_push_arg(pp, &f->args[f->macro->refs[pos] - 1], f->span.hs, f->span.tokens[pos].token.flags);
+            if (error) {
+                return error;
+            }
+
+            continue;
+        }
+
+        out->token = f->span.tokens[pos].token;
+        int error = pp_hideset_union(pp, f->span.tokens[pos].hs, f->span.hs, &out->hs);
+        if (error) {
+            return error;
+        }
+
+        break;
+    }
+
+    // First token of an expansion is placed where the macro name was
+    if (pp->pending_flags >= 0) {
+        out->token.flags = (out->token.flags & ~(kTokenFlagLineStart | kTokenFlagLeadingSpace)) | pp->pending_flags;
+        pp->pending_flags = -1;
+    }
+
+    return 0;
+}
+
+// Split an argument list that ends with its closing parenthesis
+static int pp_split_args(preproc_t* pp, const pp_macro_t* m, const pp_token_t* tokens, size_t count,
+                         const pp_hideset_t* hs, pp_arg_t** out)
+{
+    size_t slots = (m->param_count ? m->param_count : 1);
+    pp_arg_t* args = arena_alloc(pp->expansion, slots * sizeof(*args));
+    if (!args) {
+        return ENOMEM;
+    }
+
+    memset(args, 0, slots * sizeof(*args));
+
+    size_t n = 0;
+    size_t start = 0;
+    size_t depth = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const token_t* t = &tokens[i].token;
+        if (pp_is_op(t, kOperatorLParen)) {
+            ++depth;
+        } else if (pp_is_op(t, kOperatorRParen) && depth) {
+            --depth;
+        } else if (i + 1 == count || (depth == 0 && pp_is_op(t, kOperatorComma) && !(m->variadic && n + 1 == m->param_count))) {
+            if (n == slots) {
+                return EINVAL;
+            }
+
+            args[n++].raw = (pp_span_t){ .tokens = tokens + start, .count = i - start, .hs = hs };
+            start = i + 1;
+        }
+    }
+
+    // Empty parentheses pass no arguments to a macro without parameters, variable arguments can be left out
+    if (m->param_count == 0 && args[0].raw.count == 0) {
+        n = 0;
+    } else if (m->variadic && n + 1 == m->param_count) {
+        ++n;
+    }
+
+    if (n != m->param_count) {
+        return EINVAL;
+    }
+
+    *out = args;
+    return 0;
+}
+
+// Read arguments of a function-like macro invocation, the opening parenthesis is already read.
+// Arguments are spans of the innermost frame when they are all inside of it, otherwise they are copied.
+static int pp_collect_args(preproc_t* pp, const pp_macro_t* m, pp_arg_t** out_args, const pp_hideset_t** out_hs)
+{
+    if (pp->frame_count) {
+        pp_frame_t* f = &pp->frames[pp->frame_count - 1];
+        size_t depth = 0;
+        for (size_t i = f->pos; i < f->span.count && !(f->macro && f->macro->refs[i]); ++i) {
+            const token_t* t = &f->span.tokens[i].token;
+            if (pp_is_op(t, kOperatorLParen)) {
+                ++depth;
+            } else if (pp_is_op(t, kOperatorRParen) && depth-- == 0) {
+                int error = pp_split_args(pp, m, f->span.tokens + f->pos, i + 1 - f->pos, f->span.hs, out_args);
+                if (!error) {
+                    error = pp_hideset_union(pp, f->span.tokens[i].hs, f->span.hs, out_hs);
+                }
+
+                f->pos = i + 1;
+                return error;
+            }
+        }
+    }
+
+    pp_vector_t v = { 0 };
+    size_t depth = 0;
+    int error = 0;
+    for (;;) {
+        pp_token_t t;
+        error = pp_read(pp, &t);
+        if (!error) {
+            error = pp_vector_push(&v, &t);
+        }
+
+        if (error == -1) {
+            error = EINVAL;     // Unterminated argument list
+        }
+
+        if (error) {
+            free(v.tokens);
+            return error;
+        }
+
+        if (pp_is_op(&t.token, kOperatorLParen)) {
+            ++depth;
+        } else if (pp_is_op(&t.token, kOperatorRParen) && depth-- == 0) {
+            *out_hs = t.hs;
+            break;
+        }
+    }
+
+    pp_span_t span;
+    error = pp_vector_span(pp, &v, &span);
+    return error ? error : pp_split_args(pp, m, span.tokens, span.count, NULL, out_args);
+}
+
+// Replacement list with arguments in place, for macros with # and ## operators
+static int pp_substitute(preproc_t* pp, const pp_macro_t* m, pp_arg_t* args, pp_span_t* out)
+{
+    pp_vector_t v = { 0 };
+    bool placemarker = false;   // Last operand of ## was an empty argument
+    int error = 0;
+
+    for (size_t i = 0; !error && i < m->token_count; ++i) {
+        const pp_token_t* t = &m->tokens[i];
+        size_t ref = (m->refs ? m->refs[i] : 0);
+
+        if (m->function_like && pp_is_op(&t->token, kOperatorHash)) {
+            pp_token_t str = { .hs = NULL };
+            error = pp_stringify(pp, &args[m->refs[++i] - 1].raw, &str.token);
+            if (!error) {
+                str.token.flags = t->token.flags;
+                error = pp_vector_push(&v, &str);
+            }
+
+            placemarker = false;
+        } else if (pp_is_op(&t->token, kOperatorHashHash)) {
+            ++i;
+            pp_span_t rhs = { .tokens = &m->tokens[i], .count = 1, .hs = NULL };
+            if (m->refs && m->refs[i]) {
+                rhs = args[m->refs[i] - 1].raw;
+            }
+
+            if (rhs.count == 0) {
+                continue;
+            } else if (placemarker) {
+                error = pp_vector_append(pp, &v, &rhs);
+            } else {
+                pp_token_t* lhs = &v.tokens[v.count - 1];
+                error = pp_paste(pp, &lhs->token, &rhs.tokens[0].token, &lhs->token);
+                lhs->hs = NULL;
+
+                pp_span_t rest = { .tokens = rhs.tokens + 1, .count = rhs.count - 1, .hs = rhs.hs };
+                if (!error) {
+                    error = pp_vector_append(pp, &v, &rest);
+                }
+            }
+
+            placemarker = false;
+        } else if (ref) {
+            // Operands of ## are not expanded
+            bool operand = (i + 1 < m->token_count && pp_is_op(&m->tokens[i + 1].token, kOperatorHashHash));
+            pp_arg_t* arg = &args[ref - 1];
+            if (!operand && !arg->is_expanded) {
+                error = pp_expand_arg(pp, arg);
+            }
+
+            pp_span_t span = (operand ? arg->raw : arg->expanded);
+            size_t at = v.count;
+            if (!error) {
+                error = pp_vector_append(pp, &v, &span);
+            }
+
+            // Argument is spaced like the parameter it replaces
+            if (!error && v.count > at) {
+                uint16_t placement = kTokenFlagLineStart | kTokenFlagLeadingSpace;
+                v.tokens[at].token.flags = (v.tokens[at].token.flags & ~placement) | (t->token.flags & placement);
+            }
+
+            placemarker = (operand && span.count == 0);
+        } else {
+            error = pp_vector_push(&v, t);
+            placemarker = false;
+        }
+    }
+
+    if (!error) {
+        error = pp_vector_span(pp, &v, out);
+    }
+
+    free(v.tokens);
+    return error;
+}
+
+// Expand a macro whose name was just read, '*expanded' is not set for function-like macros without arguments
+static int pp_invoke(preproc_t* pp, const pp_macro_t* m, const pp_token_t* name, bool* expanded)
+{
+    pp_frame_t frame = { .span = { .tokens = m->tokens, .count = m->token_count } };
+    int error = 0;
+
+    if (!m->function_like) {
+        error = pp_hideset_add(pp, name->hs, m->name, &frame.span.hs);
+    } else {
+        // Function-like macro name is only an invocation if an argument list follows
+        pp_token_t next;
+        error = pp_read(pp, &next);
+        if (error == -1) {
+            return 0;
+        } else if (error) {
+            return error;
+        }
+
+        if (!pp_is_op(&next.token, kOperatorLParen)) {
+            if (pp->frame_count) {
+                --pp->frames[pp->frame_count - 1].pos;
+            } else {
+                pp_unget(pp->top, &next.token);
+            }
+
+            return 0;
+        }
+
+        const pp_hideset_t* hs = NULL;
+        error = pp_collect_args(pp, m, &frame.args, &hs);
+        if (!error) {
+            error = pp_hideset_intersect(pp, name->hs, hs, &hs);
+        }
+
+        if (!error) {
+            error = pp_hideset_add(pp, hs, m->name, &frame.span.hs);
+        }
+
+        frame.macro = m;
+    }
+
+    if (!error && m->has_ops) {
+        const pp_hideset_t* hs = frame.span.hs;
+        error = pp_substitute(pp, m, frame.args, &frame.span);
+        frame.span.hs = hs;
+        frame.macro = NULL;
+    }
+
+    if (error) {
+        pp->loc = (error == EINVAL ? name->token.loc : pp->loc);
+        return error;
+    }
+
+    *expanded = true;
+    pp->pending_flags = name->token.flags & (kTokenFlagLineStart | kTokenFlagLeadingSpace);
+    return frame.span.count ? pp_push_frame(pp, &frame) : 0;
+}
+
+// Next token after macro expansion
+static int pp_expand_next(preproc_t* pp, pp_token_t* out)
+{
+    for (;;) {
+        int error = pp_read(pp, out);
+        if (error || !pp_is_name(&out->token)) {
+            return error;
+        }
+
+        const pp_macro_t* m = string_info(out->token.value)->macro;
+        if (!m || pp_hideset_contains(out->hs, m->name)) {
+            return 0;
+        }
+
+        bool expanded = false;
+        pp_token_t name = *out;
+        error = pp_invoke(pp, m, &name, &expanded);
+        if (error || !expanded) {
+            return error;
+        }
+    }
+}
+
+int preproc_next(preproc_t* pp, token_t* out)
+{
+    if (!pp || !out) {
+        return EINVAL;
+    }
+
+    for (;;) {
+        pp_token_t token;
+        int error = pp_expand_next(pp, &token);
+        if (error == -1 && pp->top) {
+            error = pp_pop(pp);
+            if (error) {
+                return error;
+            }
+
+            continue;
+        }
+
+        // Numbers that are not constants are fine until they get out of the preprocessor
+        if (!error && token.token.type == kTokenNumber) {
+            pp->loc = token.token.loc;
+            return EILSEQ;
+        }
+
+        if (!error) {
+            *out = token.token;
+        }
+
+        return error;
+    }
+}
+
+int preproc_scan(preproc_t* pp, preproc_include_fn on_include, void* ctx)
+{
+    if (!pp || pp->frame_count) {
+        return EINVAL;
+    }
+
+    pp->on_include = on_include;
+    pp->on_include_ctx = ctx;
+
+    int error = 0;
+    while (!error && pp->top) {
+        pp_source_t* src = pp->top;
+        const char* begin = buffer_get_data(src->in);
+        const char* end = begin + buffer_get_size(src->in);
+
+        // Lines that are not directives are not lexed, but they still break include guards
+        bool content = false;
+        const char* p = pp_next_directive(pp_rewind(src), end, &content);
+        if (content && src->guard != kGuardInside) {
+            src->guard = kGuardNone;
+        }
+
+        if (!p) {
+            buffer_set_offset(src->in, end - begin);
+            error = pp_pop(pp);
+            continue;
+        }
+
+        buffer_set_offset(src->in, p + (*p == '#' ? 1 : 2) - begin);
+        error = pp_directive(pp, src, src->base + (uint32_t)(p - begin));
+    }
+
+    pp->on_include = NULL;
+    pp->on_include_ctx = NULL;
+    return error;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(TEST)
+
+#include <unistd.h>
+
+// Preprocess a buffer and print token spellings separated with spaces
+static int pp_test_run(preproc_t* pp, const char* str, char* out, size_t size)
+{
+    input_buffer_t* ib = buffer_mem((void*)str, strlen(str));
+    int error = preproc_push_buffer(pp, ib);
+
+    size_t len = 0;
+    out[0] = '\0';
+    while (!error) {
+        token_t token;
+        error = preproc_next(pp, &token);
+        if (!error) {
+            size_t n;
+            const char* p = pp_spelling(&token, &n);
+            len += snprintf(out + len, size - len, "%s%.*s", len ? " " : "", (int)n, p);
+        }
+    }
+
+    return error == -1 ? 0 : error;
+}
+
+static bool pp_test_expect(const char* str, int expected_error, const char* expected)
+{
+    cc_context_t* ctx = cc_context_create();
+    preproc_t* pp = preproc_create(ctx);
+    char buf[4096];
+    int error = pp_test_run(pp, str, buf, sizeof(buf));
+    preproc_destroy(pp);
+    cc_context_destroy(ctx);
+
+    bool match = (error == expected_error && (!expected || 0 == strcmp(buf, expected)));
+    if (!match) {
+        printf("\n  '%s' gave %d '%s'\n", str, error, buf);
+    }
+
+    return match;
+}
+
+static void preproc_test(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    struct {
+        const char* str;
+        int error;
+        const char* expected;
+    } cases[] = {
+        { "a b\n", 0, "a b" },
+        { "#define X 1\n#ifdef X\na\n#else\nb\n#endif\nc", 0, "a c" },
+        { "#ifndef X\na\n#elif 1\nb\n#else\nc\n#endif", 0, "a" },
+        { "#if 0\na\n#elif 0\nb\n#elif 1\nc\n#elif 1\nd\n#else\ne\n#endif", 0, "c" },
+        { "#if 0\n#if 1\na\n#else\nb\n#endif\n#else\nc\n#endif", 0, "c" },
+        { "#define A\n#if defined(A) && !defined B || 0\na\n#endif", 0, "a" },
+        { "#if (0 || 'x') && !(unknown)\na\n#endif", 0, "a" },
+        { "#define F(x, y) x\n#undef F\n#ifdef F\na\n#endif\nb", 0, "b" },
+        { "# /* null */\n#\nx # y", 0, "x # y" },
+        { "#pragma pack(1)\n#line 10\n#warning don't\na", 0, "a" },
+
+        // Skipped groups are not lexed, except for directive names
+        { "#if 0\ndon't \"/*\n#else @\n#endif\na", 0, "a" },
+        { "#if 0\n/*\n#else\n*/ b\n#endif\na", 0, "a" },
+        { "#if 0\n  %: else\na\n#endif", 0, "a" },
+
+        { "#if 1\na", EINVAL, NULL },
+        { "#endif", EINVAL, NULL },
+        { "#if 0\n#else\n#else\n#endif", EINVAL, NULL },
+        { "#if 1\n#else\n#elif 1\n#endif", EINVAL, NULL },
+        { "#if\n#endif", EINVAL, NULL },
+        { "#if 1 2\n#endif", EINVAL, NULL },
+        { "#define\n", EINVAL, NULL },
+        { "#define F(x, x)\n", EINVAL, NULL },
+        { "#define F(x\n", EINVAL, NULL },
+        { "#define F __VA_ARGS__\n", EINVAL, NULL },
+        { "#define F(...) __VA_ARGS__\n", 0, "" },
+        { "#foo\n", EINVAL, NULL },
+        { "#error don't\n", ECANCELED, NULL },
+        { "#include\n", EINVAL, NULL },
+        { "#include <>\n", EINVAL, NULL },
+        { "#include <shlang-cc-missing.h>\n", ENOENT, NULL },
+        { "#define H <shlang-cc-missing.h>\n#include H\n", ENOENT, NULL },
+        { "#define E\n#include E\n", EINVAL, NULL },
+        { "#include 1\n", EINVAL, NULL },
+        { "#define H <x.h\n#include H\n", EINVAL, NULL },
+        { "#define H \"x.h\" y\n#include H\n", EINVAL, NULL },
+        { "#include u8\"x.h\"\n", EINVAL, NULL },
+    };
+
+    for (size_t i = 0; i < countof(cases); ++i) {
+        CU_ASSERT_TRUE(pp_test_expect(cases[i].str, cases[i].error, cases[i].expected));
+    }
+
+    // Errors point at the offending directive
+    preproc_t* pp = preproc_create(ctx);
+    char buf[256];
+    const char* str = "a\n#if 1\nb";
+    CU_ASSERT_EQUAL(pp_test_run(pp, str, buf, sizeof(buf)), EINVAL);
+
+    source_location_t sl;
+    CU_ASSERT_FALSE(srcmgr_locate(preproc_location(pp), &sl));
+    CU_ASSERT_EQUAL(sl.line, 2);
+    CU_ASSERT_EQUAL(sl.column, 1);
+    preproc_destroy(pp);
+
+    // Macros are gone with their preprocessor
+    CU_ASSERT_FALSE(string_info(string(ctx, "X"))->macro);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(preproc_test);
+
+static void preproc_expand_test(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    struct {
+        const char* str;
+        int error;
+        const char* expected;
+    } cases[] = {
+        { "#define A 1 + A\nA B", 0, "1 + A B" },
+        { "#define A B\n#define B A\nA B", 0, "A B" },
+        { "#define f(x) x\nf(f(1)) f (2) f\n(3) f", 0, "1 2 3 f" },
+        { "#define f(x, y) y x\nf((a, b), c) f(,)", 0, "c ( a , b )" },
+        { "#define f(a) a*g\n#define g(a) f(a)\nf(2)(9)", 0, "2 * 9 * g" },
+        { "#define LP (\n#define f(x) [x]\nf LP 1)", 0, "f ( 1 )" },
+        { "#define p() int\n#define q(x) x\np() q() q(())", 0, "int ( )" },
+        { "#define f(x, ...) x: __VA_ARGS__\nf(1) f(1, 2, (3, 4))", 0, "1 : 1 : 2 , ( 3 , 4 )" },
+        { "#define showlist(...) puts(#__VA_ARGS__)\nshowlist(The first, second,  and\tthird items.);", 0,
+          "puts ( \"The first, second, and third items.\" ) ;" },
+        { "#define t(x,y,z) x ## y ## z\nt(1,2,3) t(,4,5) t(6,,7) t(8,9,) t(10,,) t(,11,) t(,,12) t(,,)", 0,
+          "123 45 67 89 10 11 12" },
+        { "#define hash_hash # ## #\n#define mkstr(a) # a\n#define in_between(a) mkstr(a)\n"
+          "#define join(c, d) in_between(c hash_hash d)\njoin(x, y)", 0, "\"x ## y\"" },
+        { "#define cat(a, b) a ## b\n#define AB done\ncat(A, B) cat(1, .5) cat(<, <=) cat(L, 'a')", 0, "done 1.5 <<= L'a'" },
+        { "#define X 1 + 2\n#define X 1  +  2\n#define F(a) a\n#define F(a) a\nX", 0, "1 + 2" },
+        { "#define X <:\n#define X <:\nX", 0, "<:" },
+
+        // Digraphs and constant suffixes keep their spelling
+        { "#define s(x) #x\n#define xs(x) s(x)\n#define cat(a, b) a ## b\n"
+          "s(<: %: a) s(12u 1.5f) xs(cat(%:, %:)) cat(<, :)", 0, "\"<: %: a\" \"12u 1.5f\" \"%:%:\" <:" },
+
+        // Pasted and stringified tokens are preprocessing numbers, not only constants
+        { "#define HEX(x) 0x##x\n#define cat(a, b) a ## b\nHEX(FF) HEX(1p+1) cat(1, e10) cat(., 5)", 0, "0xFF 0x1p+1 1e10 .5" },
+        { "#define s(x) #x\ns(0x 1.2.3 1e+e)", 0, "\"0x 1.2.3 1e+e\"" },
+        { "#if 0\n0x\n#endif\n#define Z 0x\n1", 0, "1" },
+        { "#define HEX(x) 0x##x\nHEX()", EILSEQ, NULL },
+        { "0x1e+1", EILSEQ, NULL },
+
+        // Arguments are spaced like the parameters they replace, not like the invocation
+        { "#define s(x) #x\n#define xs(x) s(x)\n#define sp(x) - x\n#define two(x) x x\nxs(sp(1)) xs(two(1))", 0,
+          "\"- 1\" \"1 1\"" },
+        { "#define s(x) #x\n#define xs(x) s(x)\n#define cat(a, b) a ## b x b\n#define x -\nxs(cat(1,2))", 0, "\"12 - 2\"" },
+        { "#define s(x) #x\n#define xs(x) s(x)\n#define id(x) x\nxs(a id(b)c) xs(id( b ))", 0, "\"a bc\" \"b\"" },
+
+        // C11 6.10.3.5 EXAMPLE 3
+        { "#define x 3\n#define f(a) f(x * (a))\n#undef x\n#define x 2\n#define g f\n#define z z[0]\n"
+          "#define h g(~\n#define m(a) a(w)\n#define w 0,1\n#define t(a) a\n#define p() int\n#define q(x) x\n"
+          "#define r(x,y) x ## y\n#define str(x) # x\n"
+          "f(y+1) + f(f(z)) % t(t(g)(0) + t)(1);\n"
+          "g(x+(3,4)-w) | h 5) & m\n(f)^m(m);\n"
+          "p() i[q()] = { q(1), r(2,3), r(4,), r(,5), r(,) };\n"
+          "char c[2][6] = { str(hello), str() };", 0,
+          "f ( 2 * ( y + 1 ) ) + f ( 2 * ( f ( 2 * ( z [ 0 ] ) ) ) ) % f ( 2 * ( 0 ) ) + t ( 1 ) ; "
+          "f ( 2 * ( 2 + ( 3 , 4 ) - 0 , 1 ) ) | f ( 2 * ( ~ 5 ) ) & f ( 2 * ( 0 , 1 ) ) ^ m ( 0 , 1 ) ; "
+          "int i [ ] = { 1 , 23 , 4 , 5 , } ; "
+          "char c [ 2 ] [ 6 ] = { \"hello\" , \"\" } ;" },
+
+        // C11 6.10.3.5 EXAMPLE 4
+        { "#define str(s) # s\n#define xstr(s) str(s)\n"
+          "#define debug(s, t) printf(\"x\" # s \"= %d, x\" # t \"= %s\", \\\n x ## s, x ## t)\n"
+          "#define INCFILE(n) vers ## n\n#define glue(a, b) a ## b\n#define xglue(a, b) glue(a, b)\n"
+          "#define HIGHLOW \"hello\"\n#define LOW LOW \", world\"\n"
+          "debug(1, 2);\n"
+          "fputs(str(strncmp(\"abc\\0d\", \"abc\", '\\4') // this goes away\n== 0), s);\n"
+          "xstr(INCFILE(2).h) glue(HIGH, LOW); xglue(HIGH, LOW)", 0,
+          "printf ( \"x\" \"1\" \"= %d, x\" \"2\" \"= %s\" , x1 , x2 ) ; "
+          "fputs ( \"strncmp(\\\"abc\\\\0d\\\", \\\"abc\\\", '\\\\4') == 0\" , s ) ; "
+          "\"vers2.h\" \"hello\" ; \"hello\" \", world\"" },
+
+        { "#define f(x) x\nf(1, 2)", EINVAL, NULL },
+        { "#define f(x, y) x\nf(1)", EINVAL, NULL },
+        { "#define f() x\nf(1)", EINVAL, NULL },
+        { "#define f(x) x\nf(1", EINVAL, NULL },
+        { "#define LP (\n#define f(x) x\n#define g(x) x\ng(f LP 1)", EINVAL, NULL },
+        { "#define f(x) # y\n", EINVAL, NULL },
+        { "#define f(x) x #\n", EINVAL, NULL },
+        { "#define f ## x\n", EINVAL, NULL },
+        { "#define f x ##\n", EINVAL, NULL },
+        { "#define cat(a, b) a ## b\ncat(+, -)", EINVAL, NULL },
+        { "#define cat(a, b) a ## b\ncat(/, /)", EINVAL, NULL },
+        { "#define X 1\n#define X 2\n", EINVAL, NULL },
+        { "#define X 1+2\n#define X 1 + 2\n", EINVAL, NULL },
+        { "#define X <:\n#define X [\n", EINVAL, NULL },
+        { "#define F(a) a\n#define F(b) b\n", EINVAL, NULL },
+    };
+
+    for (size_t i = 0; i < countof(cases); ++i) {
+        CU_ASSERT_TRUE(pp_test_expect(cases[i].str, cases[i].error, cases[i].expected));
+    }
+
+    // Expansion keeps placement of the macro name and locations of replacement tokens
+    preproc_t* pp = preproc_create(ctx);
+    const char* str = "#define A x y\n(A)";
+    CU_ASSERT_FALSE(preproc_push_buffer(pp, buffer_mem((void*)str, strlen(str))));
+
+    token_t token;
+    CU_ASSERT_FALSE(preproc_next(pp, &token));
+    CU_ASSERT_FALSE(preproc_next(pp, &token));
+    CU_ASSERT_EQUAL(_S(token.value), _S(string(ctx, "x")));
+    CU_ASSERT_EQUAL(token.flags, 0);
+
+    source_location_t sl;
+    CU_ASSERT_FALSE(srcmgr_locate(token.loc, &sl));
+    CU_ASSERT_EQUAL(sl.line, 1);
+    CU_ASSERT_EQUAL(sl.column, 11);
+    preproc_destroy(pp);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(preproc_expand_test);
+
+static void preproc_eval_test(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    struct {
+        const char* expr;
+        int error;
+        bool value;
+    } cases[] = {
+        { "1 + 2 * 3 == 7", 0, true },
+        { "(1 + 2) * 3 == 9 && 10 - 2 - 3 == 5", 0, true },
+        { "-1 < 0", 0, true },
+        { "-1 < 0u", 0, false },
+        { "-1 > 0 ? 1 : -1u", 0, true },
+        { "(0 ? 1 : -1u) > 0", 0, true },
+        { "(0 ? -1 : 1) < 0", 0, false },
+        { "0xFFFFFFFFFFFFFFFF == -1", 0, true },
+        { "0xFFFFFFFFFFFFFFFF > 0", 0, true },
+        { "18446744073709551615 / 2 == 9223372036854775807", 0, true },
+        { "-7 / 2 == -3 && -7 % 2 == -1", 0, true },
+        { "(-9223372036854775807 - 1) / -1 < 0", 0, true },
+        { "1 << 62 > 0 && 1 << 63 < 0 && 1u << 63 > 0", 0, true },
+        { "-16 >> 2 == -4 && 16 >> -2 == 64 && 1 << 64 == 0 && -1 >> 64 == -1", 0, true },
+        { "~0 == -1 && ~0u == 18446744073709551615u", 0, true },
+        { "(5 & 3) == 1 && (5 | 3) == 7 && (5 ^ 3) == 6", 0, true },
+        { "!0 == 1 && !5 == 0 && - - 1 == + 1", 0, true },
+        { "'a' == 97 && '\\377' < 0 && L'\\xffffffff' < 0 && U'\\xffffffff' > 0", 0, true },
+        { "1 ? 2 : 0 ? 3 : 4", 0, true },
+        { "0 ? 1 : 0 ? 1 : 0", 0, false },
+        { "(1, 0)", 0, false },
+        { "undefined_name + 1 == 1", 0, true },
+        { "ONE + TWO == 3", 0, true },
+        { "ADD(ONE, TWO) * 2 == 6", 0, true },
+        { "defined ONE && defined(TWO) && !defined THREE", 0, true },
+        { "DEF ONE && !DEF(THREE)", 0, true },
+        { "0 && 1 / 0", 0, false },
+        { "1 || 1 % 0", 0, true },
+        { "1 ? 1 : 1 / 0", 0, true },
+        { "1 / 0", EINVAL, false },
+        { "1 % (2 - 2)", EINVAL, false },
+        { "1 +", EINVAL, false },
+        { "(1", EINVAL, false },
+        { "1 ? 2", EINVAL, false },
+        { "1 = 1", EINVAL, false },
+        { "1.0", EINVAL, false },
+        { "\"a\"", EINVAL, false },
+        { "defined", EINVAL, false },
+        { "defined(ONE", EINVAL, false },
+        { "ADD(1,", EINVAL, false },
+        { "IS_DEF(ONE)", EINVAL, false },
+    };
+
+    for (size_t i = 0; i < countof(cases); ++i) {
+        char str[256];
+        snprintf(str, sizeof(str),
+                 "#define ONE 1\n#define TWO 2\n#define ADD(a, b) (a + b)\n#define IS_DEF(x) defined(x)\n#define DEF defined\n"
+                 "#if %s\nyes\n#else\nno\n#endif", cases[i].expr);
+        CU_ASSERT_TRUE(pp_test_expect(str, cases[i].error, cases[i].error ? NULL : (cases[i].value ? "yes" : "no")));
+    }
+
+    // #elif is evaluated only when no group was taken yet, macros are expanded up to the line end
+    CU_ASSERT_TRUE(pp_test_expect("#define F(x) x\n#if 0\n#elif F\n(1)\n#endif\na", 0, "a"));
+    CU_ASSERT_TRUE(pp_test_expect("#define F(x) x\n#if 0\n#elif F(1)\na\n#endif\nF(b)", 0, "a b"));
+    CU_ASSERT_TRUE(pp_test_expect("#if 1\na\n#elif 1 / 0\nb\n#endif", 0, "a"));
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(preproc_eval_test);
+
+static void pp_test_write(const char* dir, const char* name, const char* text)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* f = fopen(path, "w");
+    CU_ASSERT(f != NULL);
+    if (f) {
+        fputs(text, f);
+        fclose(f);
+    }
+}
+
+static void pp_test_remove(const char* dir, const char* name)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    CU_ASSERT_FALSE(unlink(path));
+}
+
+static void preproc_guard_test(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    char dir[] = "/tmp/shlang-preproc-XXXXXX";
+    CU_ASSERT(NULL != mkdtemp(dir));
+
+    const char* files[][2] = {
+        { "guarded.h", "// Comments are fine\n#ifndef GUARDED_H\n#define GUARDED_H\n#if 1\ng\n#endif\n#endif\n" },
+        { "defined.h", "#if !defined(DEFINED_H)\n#define DEFINED_H\nd\n#endif" },
+        { "once.h", "#pragma once\no\n" },
+        { "after.h", "#ifndef AFTER_H\n#define AFTER_H\n#endif\na\n" },
+        { "else.h", "#ifndef ELSE_H\n#define ELSE_H\ne\n#else\n#endif\n" },
+        { "before.h", "b\n#ifndef BEFORE_H\n#define BEFORE_H\n#endif\n" },
+        { "nested.h", "#include \"guarded.h\"\nn\n" },
+        { "tri.h", "?\?=define T \"?\?!\"\nT\n" },
+    };
+
+    for (size_t i = 0; i < countof(files); ++i) {
+        pp_test_write(dir, files[i][0], files[i][1]);
+    }
+
+    preproc_t* pp = preproc_create(ctx);
+    CU_ASSERT_FALSE(preproc_add_include_dir(pp, dir));
+
+    char buf[1024];
+    const char* str =
+        "#include <guarded.h>\n#include \"guarded.h\"\n#include <nested.h>\n"
+        "#include <defined.h>\n#include <defined.h>\n"
+        "#include <once.h>\n#include <once.h>\n"
+        "#include <after.h>\n#include <after.h>\n"
+        "#include <else.h>\n#include <else.h>\n"
+        "#include <before.h>\n#include <before.h>\n"
+        "#undef GUARDED_H\n#include <guarded.h>\n";
+
+    CU_ASSERT_FALSE(pp_test_run(pp, str, buf, sizeof(buf)));
+    CU_ASSERT_STRING_EQUAL(buf, "g n d o a a e b b g");
+
+    // Every file is opened once, except for the ones that are not guarded and the one that lost its guard
+    preproc_stats_t stats;
+    preproc_get_stats(pp, &stats);
+    CU_ASSERT_EQUAL(stats.files_opened, 11);
+    CU_ASSERT_EQUAL(stats.includes_skipped, 4);
+    preproc_destroy(pp);
+
+    // Computed includes
+    pp = preproc_create(ctx);
+    CU_ASSERT_FALSE(preproc_add_include_dir(pp, dir));
+    str =
+        "#define HDR \"once.h\"\n#include HDR\n"
+        "#define NAME after\n#define SYS <NAME.h>\n#include SYS\n"
+        "#define STR(x) #x\n#define Q(x) STR(x.h)\n#include Q(before)\n";
+
+    CU_ASSERT_FALSE(pp_test_run(pp, str, buf, sizeof(buf)));
+    CU_ASSERT_STRING_EQUAL(buf, "o a b");
+    preproc_destroy(pp);
+
+    // Trigraphs are a setting of the context, contexts that differ can share one cached file
+    cc_context_t* tri = cc_context_create();
+    CU_ASSERT_FATAL(tri != NULL);
+    tri->trigraphs = true;
+
+    cc_context_t* contexts[] = { ctx, tri };
+    const char* expected[] = { "? ? = define T \"?\?!\" T", "\"|\"" };
+    for (size_t i = 0; i < countof(contexts); ++i) {
+        pp = preproc_create(contexts[i]);
+        CU_ASSERT_FALSE(preproc_add_include_dir(pp, dir));
+        CU_ASSERT_FALSE(pp_test_run(pp, "#include <tri.h>\n", buf, sizeof(buf)));
+        CU_ASSERT_STRING_EQUAL(buf, expected[i]);
+        preproc_destroy(pp);
+    }
+
+    cc_context_destroy(tri);
+
+    for (size_t i = 0; i < countof(files); ++i) {
+        pp_test_remove(dir, files[i][0]);
+    }
+
+    CU_ASSERT_FALSE(rmdir(dir));
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(preproc_guard_test);
+
+// Print include edges as "from>path", with '!' for skipped includes, file names only
+static int pp_test_on_include(void* ctx, const preproc_include_t* inc)
+{
+    char* out = ctx;
+    const char* from = (inc->from ? strrchr(inc->from, '/') + 1 : "-");
+    const char* path = strrchr(inc->path, '/') + 1;
+    size_t len = strlen(out);
+    snprintf(out + len, 1024 - len, "%s%s>%s%s", len ? " " : "", from, path, inc->skipped ? "!" : "");
+    return 0;
+}
+
+static void preproc_scan_test(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    char dir[] = "/tmp/shlang-preproc-XXXXXX";
+    CU_ASSERT(NULL != mkdtemp(dir));
+
+    const char* files[][2] = {
+        { "main.c",
+          "/* #include \"never.h\"\n#include \"never.h\" */\n"
+          "int x = '#'; char* s = \"#include \\\"never.h\\\"\"; // #include \"never.h\"\n"
+          "#include \"a.h\"\n#include \"a.h\"\n"
+          "#ifdef MISSING\n#include \"never.h\"\n#elif defined(A_H)\n  %: include <b.h>\n#endif\n"
+          "#define X 1\ndon't lex @ this \"line\n"
+          "#include \"c.h\"\n" },
+        { "a.h", "#ifndef A_H\n#define A_H\nstruct a { int x; };\n#include \"c.h\"\n#endif\n" },
+        { "b.h", "#pragma once\n#include \"a.h\"\n" },
+        { "c.h", "enum { C };\n#if 0\n#include \"never.h\"\n#endif\n" },
+    };
+
+    for (size_t i = 0; i < countof(files); ++i) {
+        pp_test_write(dir, files[i][0], files[i][1]);
+    }
+
+    preproc_t* pp = preproc_create(ctx);
+    CU_ASSERT_FALSE(preproc_add_include_dir(pp, dir));
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/main.c", dir);
+    CU_ASSERT_FALSE(preproc_push_file(pp, path));
+
+    char buf[1024] = "";
+    CU_ASSERT_FALSE(preproc_scan(pp, pp_test_on_include, buf));
+    CU_ASSERT_STRING_EQUAL(buf, "main.c>a.h a.h>c.h main.c>a.h! main.c>b.h b.h>a.h! main.c>c.h");
+
+    preproc_stats_t stats;
+    preproc_get_stats(pp, &stats);
+    CU_ASSERT_EQUAL(stats.files_opened, 5);
+    CU_ASSERT_EQUAL(stats.includes_skipped, 2);
+    preproc_destroy(pp);
+
+    // Same errors as in full preprocessing
+    const char* str = "#if 1\n";
+    pp = preproc_create(ctx);
+    CU_ASSERT_FALSE(preproc_push_buffer(pp, buffer_mem((void*)str, strlen(str))));
+    CU_ASSERT_EQUAL(preproc_scan(pp, pp_test_on_include, buf), EINVAL);
+    preproc_destroy(pp);
+
+    for (size_t i = 0; i < countof(files); ++i) {
+        pp_test_remove(dir, files[i][0]);
+    }
+
+    CU_ASSERT_FALSE(rmdir(dir));
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(preproc_scan_test);
+
+#endif // TEST
@@ -0,0 +1,121 @@
+/*
+ * preproc.h
+ * Preprocessor
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include "scanner.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct preproc preproc_t;
+
+/**
+ * \brief   Preprocessor counters
+ */
+typedef struct preproc_stats
+{
+    size_t files_opened;        /* Source files opened and lexed */
+    size_t includes_skipped;    /* Includes of guarded or #pragma once files skipped without opening them */
+} preproc_stats_t;
+
+/**
+ * \brief   Include of a file, as reported by @preproc_scan
+ */
+typedef struct preproc_include
+{
+    const char* from;       /* Path of the including file, NULL if it is a buffer */
+    const char* path;       /* Path the included file was found at */
+    uint32_t loc;           /* Global source offset of the header name */
+    bool skipped;           /* File was not entered because of its include guard or #pragma once */
+} preproc_include_t;
+
+/**
+ * \brief   Include callback, a non-zero return value stops the scan and is returned from it
+ */
+typedef int (*preproc_include_fn)(void* ctx, const preproc_include_t* inc);
+
+/**
+ * \brief   Create a preprocessor storing its strings in 'ctx'
+ *
+ * Current macro definitions are also kept in info records of stored strings, see @string_info,
+ * so only one preprocessor can be used at a time in a context. It must be destroyed before its context.
+ *
+ * \return  NULL if out of memory
+ */
+preproc_t* preproc_create(cc_context_t* ctx);
+
+/**
+ * \brief   Destroy a preprocessor, closing all its sources and forgetting its macros
+ */
+void preproc_destroy(preproc_t* pp);
+
+/**
+ * \brief   Add a directory to search for included files
+ *
+ * Directories are searched in the order they were added, for "" includes after the directory of the including file.
+ *
+ * \return  0 on success, system error code on failure
+ */
+int preproc_add_include_dir(preproc_t* pp, const char* dir);
+
+/**
+ * \brief   Start reading a source file, as if it was included at the current position
+ *
+ * \return  0 on success, system error code on failure
+ */
+int preproc_push_file(preproc_t* pp, const char* path);
+
+/**
+ * \brief   Start reading an input buffer, as if it was included at the current position
+ *
+ * Preprocessor takes ownership of the buffer. Quoted includes from a buffer are searched relative
+ * to the current directory.
+ *
+ * \return  0 on success, system error code on failure
+ */
+int preproc_push_buffer(preproc_t* pp, input_buffer_t* in);
+
+/**
+ * \brief   Get next token after preprocessing
+ *
+ * Directives are executed, skipped groups are dropped and macros are expanded.
+ * Tokens coming from a macro expansion are located in its replacement list, tokens made by # and ##
+ * in text of their own. A file that was found to be wrapped in
+ * an include guard or marked with #pragma once is not opened again while its guard macro is defined.
+ *
+ * \return  0 on success,
+ *          -1 when all sources have ended,
+ *          EILSEQ if input could not be lexed or a preprocessing number is not a valid constant,
+ *          ENOENT if included file was not found,
+ *          EINVAL for malformed directives, unbalanced conditionals and bad macro invocations,
+ *          ECANCELED for #error,
+ *          system error code on other failures.
+ *          See @preproc_location for where the error is.
+ */
+int preproc_next(preproc_t* pp, token_t* out);
+
+/**
+ * \brief   Global source offset of the last token read, the place of the error after a failure
+ */
+uint32_t preproc_location(const preproc_t* pp);
+
+/**
+ * \brief   Get preprocessor counters
+ */
+void preproc_get_stats(const preproc_t* pp, preproc_stats_t* out);
+
+/**
+ * \brief   Run through all sources only executing directives, to find what they include
+ *
+ * Meant for dependency generation: lines that are not directives are skipped with a vectorized search
+ * for the next line start and are never lexed. Conditionals are evaluated and included files are entered,
+ * every include is reported to 'on_include' in the order it is met.
+ *
+ * \return  0 when all sources have ended, error codes as @preproc_next otherwise
+ */
+int preproc_scan(preproc_t* pp, preproc_include_fn on_include, void* ctx);
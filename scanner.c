@@ -1,400 +1,219 @@
 #include "scanner.h"
+#include "context.h"
+#include "charscan.h"
+#include "srcmgr.h"
 #include "string.h"
 #include "support.h"
 #include "test.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #define SHL_IDENTIFIER_LIMIT 63
 
+// Indexed by keyword_kind_t
 static const char* g_keywords[] = {
-    "auto",
-    "break",
-    "case", "char", "const", "continue",
-    "default", "do", "double",
-    "else", "enum", "extern",
-    "float", "for",
-    "goto",
-    "if", "inline", "int",
-    "long",
-    "register", "restrict", "return",
-    "short", "signed", "sizeof", "static", "struct", "switch",
-    "typedef",
-    "union", "unsigned",
-    "void", "volatile",
-    "while",
-    "_Alignas", "_Alignof", "_Atomic",
-    "_Bool",
-    "_Complex",
-    "_Generic",
-    "_Imaginary",
-    "_Noreturn",
-    "_Static_assert",
-    "_Thread_local",
+#define SHL_KEYWORD(name, str) str,
+#include "tokens.def"
+#undef SHL_KEYWORD
 };
 
+static const uint8_t g_keyword_lengths[] = {
+#define SHL_KEYWORD(name, str) sizeof(str) - 1,
+#include "tokens.def"
+#undef SHL_KEYWORD
+};
+
+// Indexed by operator_kind_t
 static const char* g_operators[] = {
-    "+", "++", "+=",
-    "-", "--", "-=",
-    "*", "*=",
-    "/", "/=",
-    "%", "%=",
-    "=", "==",
-    "!", "!=",
-    "<", "<=",
-    ">", ">=",
-    "<<", "<<=",
-    ">>", ">>=",
-    "&", "&&", "&=",
-    "|", "||", "|=",
-    "^", "^=",
-    "~", "~=",
+#define SHL_OPERATOR(name, str) str,
+#include "tokens.def"
+#undef SHL_OPERATOR
 };
 
-// Is end of word
-static bool iseow(char c)
+_Static_assert(countof(g_keywords) == kKeywordTotal, "Keyword list does not match keyword_kind_t");
+_Static_assert(countof(g_operators) == kOperatorTotal, "Operator list does not match operator_kind_t");
+
+// Operator DFA and keyword perfect hash generated by tools/lexgen
+#include "lexer_tables.inc"
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// Candidate types in C11 6.4.4.1 order, suffix picks the first one
+static const integer_literal_type_t g_integer_promotions[] = {
+    kIntegerTypeInt,
+    kIntegerTypeUnsigned,
+    kIntegerTypeLong,
+    kIntegerTypeUnsignedLong,
+    kIntegerTypeLongLong,
+    kIntegerTypeUnsignedLongLong,
+};
+
+static bool integer_type_is_unsigned(integer_literal_type_t type)
 {
-    // Now i see why older compilers required a new line at the end of file
-    return (isspace(c) || (c == EOF));
+    return type >= kIntegerTypeUnsigned;
 }
 
-static bool make_token(token_t* token, token_type_t type, const char* value, integer_literal_type_t inttype)
+static bool integer_type_fits(integer_literal_type_t type, uint64_t value)
 {
-    token->type = type;
-    token->value = string(value);
-    token->inttype = inttype;
+    switch (type) {
+    case kIntegerTypeInt:               return value <= INT_MAX;
+    case kIntegerTypeLong:              return value <= LONG_MAX;
+    case kIntegerTypeLongLong:          return value <= LLONG_MAX;
+    case kIntegerTypeUnsigned:          return value <= UINT_MAX;
+    case kIntegerTypeUnsignedLong:      return value <= ULONG_MAX;
+    case kIntegerTypeUnsignedLongLong:  return value <= ULLONG_MAX;
+    };
 
-    return true;
+    return false;
 }
 
-typedef struct dfa_rule {
-    char symbol;
-    size_t total;
-    const struct dfa_rule* next;
-} dfa_rule_t;
-
-static bool dfa_match(const dfa_rule_t* dfa, size_t total, input_buffer_t* ib, char* buf, size_t bufsize)
+// Type of an integer constant given its suffix type.
+// Decimal constants without 'u' only promote to signed types, others may also become unsigned.
+static integer_literal_type_t integer_literal_type(uint64_t value, integer_literal_type_t suffix, bool decimal)
 {
-    assert(ib);
-    assert(buf);
+    bool is_unsigned = integer_type_is_unsigned(suffix);
 
-    char c = buffer_getchar(ib);
-    if (iseow(c)) {
-        return true;
+    size_t i = 0;
+    while (g_integer_promotions[i] != suffix) {
+        ++i;
     }
 
-    if (bufsize == 0) {
-        return false;
-    }
+    for (; i < countof(g_integer_promotions); ++i) {
+        integer_literal_type_t type = g_integer_promotions[i];
+        if (is_unsigned && !integer_type_is_unsigned(type)) {
+            continue;
+        }
 
-    for (size_t i = 0; i < total; ++i) {
-        if (dfa[i].symbol == c) {
-            *buf = c;
-            return dfa_match(dfa[i].next, dfa[i].total, ib, ++buf, --bufsize);
+        if (decimal && !is_unsigned && integer_type_is_unsigned(type)) {
+            continue;
+        }
+
+        if (integer_type_fits(type, value)) {
+            return type;
         }
     }
 
-    return false;
+    // Decimal constant too large for long long has no standard type, treat it as unsigned like gcc does
+    return kIntegerTypeUnsignedLongLong;
 }
 
-static bool match_full_word(const char* word, size_t offset, input_buffer_t* in, token_t* token)
-{
-    assert(word);
-    assert(in);
-    assert(token);
+#if defined(TEST)
 
-    const char* str = word + offset;
-    while (*str != '\0') {
-        char c = buffer_getchar(in);
-        if (*str != c) {
-            return false;
-        }
+/*
+ * Reference matchers.
+ * Each one tries to match a whole word on its own and the caller rewinds the input if it fails.
+ * Lexer below scans every token exactly once, these are kept to check its output against.
+ */
 
-        ++str;
-    }
+static bool make_token(cc_context_t* ctx, token_t* token, token_type_t type, const char* value, integer_literal_type_t inttype)
+{
+    token->type = type;
+    token->value = string(ctx, value);
+    token->inttype = inttype;
+    token->intval = 0;
 
-    // We should see end of word now or match fails
-    if (!iseow(buffer_getchar(in))) {
+    return true;
+}
+
+static bool make_integer_token(cc_context_t* ctx, token_t* token, const char* value, integer_literal_type_t suffix)
+{
+    errno = 0;
+    unsigned long long intval = strtoull(value, NULL, 0);
+    if (errno == ERANGE) {
         return false;
     }
 
-    token->value = string(word);
+    bool decimal = (value[0] != '0');
+    make_token(ctx, token, kTokenIntConstant, value, integer_literal_type(intval, suffix, decimal));
+    token->intval = intval;
     return true;
 }
 
-static bool match_keyword(input_buffer_t* in, token_t* token)
+// Is end of word
+static bool iseow(char c)
 {
-    assert(in);
-    assert(token);
-
-#if 0
-    dfa_rule_t l3_1[]  = { { '=', 0, NULL } };
-
-    dfa_rule_t l2_1[]  = { { '=', 0, NULL }, { '+', 0, NULL } }; // '+'
-    dfa_rule_t l2_2[]  = { { '=', 0, NULL }, { '-', 0, NULL } }; // '-'
-    dfa_rule_t l2_3[]  = { { '=', 0, NULL } }; // '*'
-    dfa_rule_t l2_4[]  = { { '=', 0, NULL } }; // '/'
-    dfa_rule_t l2_5[]  = { { '=', 0, NULL } }; // '='
-    dfa_rule_t l2_6[]  = { { '=', 0, NULL }, { '<', countof(l3_1), l3_1 } }; // '<'
-    dfa_rule_t l2_7[]  = { { '=', 0, NULL }, { '>', countof(l3_1), l3_1 } }; // '>'
-    dfa_rule_t l2_8[]  = { { '=', 0, NULL } }; // '!'
-    dfa_rule_t l2_9[]  = { { '=', 0, NULL } }; // '%'
-    dfa_rule_t l2_10[] = { { '=', 0, NULL }, { '&', 0, NULL } }; // '&'
-    dfa_rule_t l2_11[] = { { '=', 0, NULL }, { '|', 0, NULL } }; // '|'
-    dfa_rule_t l2_12[] = { { '=', 0, NULL } }; // '^'
-    dfa_rule_t l2_13[] = { { '=', 0, NULL } }; // '~'
-
-    dfa_rule_t dfa_c_o_n [] = {
-        { 's', 1, dfa_match_word("const", 3) },
-        { 't', 1, dfa_match_word("continue", 3) },
-    };
-
-    dfa_rule_t dfa_c_o[] = {
-        { 'n', countof(dfa_c_o_n), dfa_c_o_n },
-    };
-
-    dfa_rule_t dfa_c[] = {
-        { 'a', 1, dfa_match_word("case", 2) },
-        { 'h', 1, dfa_match_word("char", 2) },
-        { 'o', countof(dfa_c_o), dfa_c_o },
-    };
-
-    dfa_rule_t dfa[] = {
-        { 'a', 1, dfa_match_word("auto", 1) },
-        { 'b', 1, dfa_match_word("break", 1) },
-        { 'c', countof(dfa_c), dfa_c },
-        { 'd', countof(dfa_d), dfa_d },
-        { 'e', countof(l2_5), l2_5 },
-        { 'f', countof(l2_6), l2_6 },
-        { 'g', countof(l2_7), l2_7 },
-        { 'i', countof(l2_8), l2_8 },
-        { 'l', countof(l2_9), l2_9 },
-        { 'r', countof(l2_10), l2_10 },
-        { 's', countof(l2_11), l2_11 },
-        { 't', countof(l2_12), l2_12 },
-        { 'u', countof(l2_13), l2_13 },
-        { 'v', countof(l2_13), l2_13 },
-        { 'w', countof(l2_13), l2_13 },
-        { '_', countof(l2_13), l2_13 },
-    };
-#endif // 0
-
-    token->type = kTokenKeyword;
-
-    char c;
-    switch(c = buffer_getchar(in)) {
-
-    /* auto */
-    case 'a':   return match_full_word("auto", 1, in, token);
-
-    /* break */
-    case 'b':   return match_full_word("break", 1, in, token);
-
-    /* const | char | continue | case */
-    case 'c':
-        switch (c = buffer_getchar(in)) {
-        case 'a':   return match_full_word("case", 2, in, token);
-        case 'h':   return match_full_word("char", 2, in, token);
-        case 'o':
-            switch (c = buffer_getchar(in)) {
-            case 'n':
-                switch (c = buffer_getchar(in)) {
-                case 's':   return match_full_word("const", 4, in, token);
-                case 't':   return match_full_word("continue", 4, in, token);
-                default:    return false;
-                };
-            default:    return false;
-            };
-        default: return false;
-        };
-
-    /* double | do | default */
-    case 'd':
-        switch (c = buffer_getchar(in)) {
-        case 'e':   return match_full_word("default", 2, in, token);
-        case 'o':
-            switch (c = buffer_getchar(in)) {
-            case 'u':   return match_full_word("double", 3, in, token);
-            default:
-                if (isspace(c) || buffer_iseof(in)) {
-                    token->value = string("do");
-                    return true;
-                } else {
-                    return false;
-                }
-            };
-        default:    return false;
-        };
-
-    /* extern | else | enum */
-    case 'e':
-        switch (c = buffer_getchar(in)) {
-        case 'x':   return match_full_word("extern", 2, in, token);
-        case 'l':   return match_full_word("else", 2, in, token);
-        case 'n':   return match_full_word("enum", 2, in, token);
-        default:    return false;
-        };
-
-    /* float | for */
-    case 'f':
-        switch (c = buffer_getchar(in)) {
-        case 'l':   return match_full_word("float", 2, in, token);
-        case 'o':   return match_full_word("for", 2, in, token);
-        default:    return false;
-        };
-
-    /* goto */
-    case 'g':   return match_full_word("goto", 1, in, token);
-
-    /* int | if | inline */
-    case 'i':
-        switch (c = buffer_getchar(in)) {
-        case 'f':   return match_full_word("if", 2, in, token);
-        case 'n':
-            switch (c = buffer_getchar(in)) {
-            case 't':   return match_full_word("int", 3, in, token);
-            case 'l':   return match_full_word("inline", 3, in, token);
-            default:    return false;
-            };
-        default:    return false;
-        };
-
-    /* long */
-    case 'l':   return match_full_word("long", 1, in, token);
-
-    /* return | register | restrict */
-    case 'r':
-        switch (c = buffer_getchar(in)) {
-        case 'e':
-            switch (c = buffer_getchar(in)) {
-            case 'g':   return match_full_word("register", 3, in, token);
-            case 's':   return match_full_word("restrict", 3, in, token);
-            case 't':   return match_full_word("return", 3, in, token);
-            default:    return false;
-            };
-        default:    return false;
-        };
-
-    /* static | short | signed | sizeof | struct | switch */
-    case 's':
-        switch(c = buffer_getchar(in)) {
-        case 'h':   return match_full_word("short", 2, in, token);
-        case 't':
-            switch(c = buffer_getchar(in)) {
-            case 'a':   return match_full_word("static", 3, in, token);
-            case 'r':   return match_full_word("struct", 3, in, token);
-            default:    return false;
-            };
-        case 'i':
-            switch (c = buffer_getchar(in)) {
-            case 'g':   return match_full_word("signed", 3, in, token);
-            case 'z':   return match_full_word("sizeof", 3, in, token);
-            default:    return false;
-            };
-        case 'w':   return match_full_word("switch", 2, in, token);
-        default:    return false;
-        };
-
-    /* typedef */
-    case 't':   return match_full_word("typedef", 1, in, token);
-
-    /* unsigned | union */
-    case 'u':
-        switch (c = buffer_getchar(in)) {
-        case 'n':
-            switch (c = buffer_getchar(in)) {
-            case 's':   return match_full_word("unsigned", 3, in, token);
-            case 'i':   return match_full_word("union", 3, in, token);
-            default:    return false;
-            };
-        default:    return false;
-        };
-
-    /* volatile | void */
-    case 'v':
-        switch (c = buffer_getchar(in)) {
-        case 'o':
-            switch (c = buffer_getchar(in)) {
-            case 'i':   return match_full_word("void", 3, in, token);
-            case 'l':   return match_full_word("volatile", 3, in, token);
-            default:    return false;
-            };
-        default:    return false;
-        };
-
-    /* while */
-    case 'w':   return match_full_word("while", 1, in, token);
-
-    /* underscore keywords deserve a separate section */
-    case '_':
-        switch (c = buffer_getchar(in)) {
+    // Now i see why older compilers required a new line at the end of file
+    return (isspace(c) || (c == EOF));
+}
 
-        /* _Alignas, _Alignof, _Atomic */
-        case 'A':
-            switch (c = buffer_getchar(in)) {
-            case 't':   return match_full_word("_Atomic", 3, in, token);
-            case 'l':
-                switch (c = buffer_getchar(in)) {
-                case 'i':
-                    switch (c = buffer_getchar(in)) {
-                    case 'g':
-                        switch (c = buffer_getchar(in)) {
-                        case 'n':
-                            switch (c = buffer_getchar(in)) {
-                            case 'a':   return match_full_word("_Alignas", 7, in, token);
-                            case 'o':   return match_full_word("_Alignof", 7, in, token);
-                            default:    return false;
-                            };
-                        default:    return false;
-                        };
-                    default:    return false;
-                    };
-                default:    return false;
-                };
-            default:    return false;
-            };
+// Run lexer DFA over the input and return the longest accepted match.
+// Input is left right after the match, or untouched if nothing was accepted.
+static unsigned dfa_scan(input_buffer_t* in, unsigned* out_index)
+{
+    assert(in);
+    assert(out_index);
 
-        /* _Bool */
-        case 'B':   return match_full_word("_Bool", 2, in, token);
+    size_t start = buffer_get_offset(in);
+    size_t end = start;
+    unsigned accept = DFA_ACCEPT_NONE;
+    unsigned state = DFA_STATE_START;
 
-        /* _Complex */
-        case 'C':   return match_full_word("_Complex", 2, in, token);
+    while (!buffer_iseof(in)) {
+        unsigned char c = (unsigned char)buffer_getchar(in);
+        state = g_dfa_transitions[state][g_dfa_classes[c]];
+        if (state == DFA_STATE_DEAD) {
+            break;
+        }
 
-        /* _Generic */
-        case 'G':   return match_full_word("_Generic", 2, in, token);
+        if (g_dfa_accept[state] != DFA_ACCEPT_NONE) {
+            accept = g_dfa_accept[state];
+            *out_index = g_dfa_accept_index[state];
+            end = buffer_get_offset(in);
+        }
+    }
 
-        /* _Imaginary */
-        case 'I':   return match_full_word("_Imaginary", 2, in, token);
+    buffer_set_offset(in, end);
+    return accept;
+}
 
-        /* _Noreturn */
-        case 'N':   return match_full_word("_Noreturn", 2, in, token);
+static bool match_keyword(cc_context_t* ctx, input_buffer_t* in, token_t* token)
+{
+    assert(in);
+    assert(token);
 
-        /* _Static_assert */
-        case 'S':   return match_full_word("_Static_assert", 2, in, token);
+    char buf[SHL_IDENTIFIER_LIMIT + 1] = {0};
+    for (size_t i = 0; i < SHL_IDENTIFIER_LIMIT; ++i) {
+        char c = buffer_getchar(in);
+        if (iseow(c)) {
+            break;
+        }
+        buf[i] = c;
+    }
 
-        /* _Thread_local */
-        case 'T':   return match_full_word("_Thread_local", 2, in, token);
-        };
+    for (size_t i = 0; i < countof(g_keywords); ++i) {
+        if (0 == strcmp(buf, g_keywords[i])) {
+            make_token(ctx, token, kTokenKeyword, g_keywords[i], 0);
+            token->keyword = (keyword_kind_t)i;
+            return true;
+        }
+    }
 
-    default:    return false;
-    };
+    return false;
 }
 
 static void test_keyword_matcher(void)
 {
-    strings_init();
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
 
     token_t token;
     input_buffer_t* ib;
 
     const char* invalid[] = {
         "class", "namespace", "template", "typename", "virtual", "final", "throw", "catch", "try",
-        "bool", "true", "false", "offsetof", "alignof", "containerof", "", " "
+        "bool", "true", "false", "offsetof", "alignof", "containerof", "", " ",
+        "integer", "doubles", "_Boolean", "d", "+"
     };
 
     for (size_t i = 0; i < countof(g_keywords); ++i) {
@@ -402,7 +221,7 @@ static void test_keyword_matcher(void)
 
         ib = buffer_mem((void*)str, strlen(str));
         CU_ASSERT(ib != NULL);
-        CU_ASSERT_TRUE(match_keyword(ib, &token));
+        CU_ASSERT_TRUE(match_keyword(ctx, ib, &token));
         CU_ASSERT_TRUE(token.type == kTokenKeyword);
         if (0 != strcmp(_S(token.value), str)) {
             printf("%s\n", str);
@@ -416,64 +235,40 @@ static void test_keyword_matcher(void)
         const char* str = invalid[i];
         ib = buffer_mem((void*)str, strlen(str));
         CU_ASSERT(ib != NULL);
-        if(match_keyword(ib, &token)) {
+        if(match_keyword(ctx, ib, &token)) {
             printf("%s\n", str);
             CU_ASSERT_TRUE(0);
         }
         buffer_close(ib);
     }
+
+    cc_context_destroy(ctx);
 }
 TEST_ADD(test_keyword_matcher);
 
-static bool match_operator(input_buffer_t* in, token_t* token)
+static bool match_operator(cc_context_t* ctx, input_buffer_t* in, token_t* token)
 {
     assert(in);
     assert(token);
 
-    // TODO: Generate dfa rules?
-    dfa_rule_t l3_1[]  = { { '=', 0, NULL } };
-
-    dfa_rule_t l2_1[]  = { { '=', 0, NULL }, { '+', 0, NULL } }; // '+'
-    dfa_rule_t l2_2[]  = { { '=', 0, NULL }, { '-', 0, NULL } }; // '-'
-    dfa_rule_t l2_3[]  = { { '=', 0, NULL } }; // '*'
-    dfa_rule_t l2_4[]  = { { '=', 0, NULL } }; // '/'
-    dfa_rule_t l2_5[]  = { { '=', 0, NULL } }; // '='
-    dfa_rule_t l2_6[]  = { { '=', 0, NULL }, { '<', countof(l3_1), l3_1 } }; // '<'
-    dfa_rule_t l2_7[]  = { { '=', 0, NULL }, { '>', countof(l3_1), l3_1 } }; // '>'
-    dfa_rule_t l2_8[]  = { { '=', 0, NULL } }; // '!'
-    dfa_rule_t l2_9[]  = { { '=', 0, NULL } }; // '%'
-    dfa_rule_t l2_10[] = { { '=', 0, NULL }, { '&', 0, NULL } }; // '&'
-    dfa_rule_t l2_11[] = { { '=', 0, NULL }, { '|', 0, NULL } }; // '|'
-    dfa_rule_t l2_12[] = { { '=', 0, NULL } }; // '^'
-    dfa_rule_t l2_13[] = { { '=', 0, NULL } }; // '~'
-
-    dfa_rule_t dfa[] = {
-        { '+', countof(l2_1), l2_1 },
-        { '-', countof(l2_2), l2_2 },
-        { '*', countof(l2_3), l2_3 },
-        { '/', countof(l2_4), l2_4 },
-        { '=', countof(l2_5), l2_5 },
-        { '<', countof(l2_6), l2_6 },
-        { '>', countof(l2_7), l2_7 },
-        { '!', countof(l2_8), l2_8 },
-        { '%', countof(l2_9), l2_9 },
-        { '&', countof(l2_10), l2_10 },
-        { '|', countof(l2_11), l2_11 },
-        { '^', countof(l2_12), l2_12 },
-        { '~', countof(l2_13), l2_13 },
-    };
+    unsigned index = 0;
+    if (dfa_scan(in, &index) != DFA_ACCEPT_OPERATOR) {
+        return false;
+    }
 
-    char buf[SHL_IDENTIFIER_LIMIT + 1] = {0};
-    if (dfa_match(dfa, countof(dfa), in, buf, SHL_IDENTIFIER_LIMIT)) {
-        return make_token(token, kTokenOperator, buf, 0);
+    if (!iseow(buffer_getchar(in))) {
+        return false;
     }
 
-    return false;
+    make_token(ctx, token, kTokenOperator, g_operators[index], 0);
+    token->op = (operator_kind_t)index;
+    return true;
 }
 
 static void test_operator_matcher(void)
 {
-    strings_init();
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
 
     for (size_t i = 0; i < countof(g_operators); ++i)
     {
@@ -481,7 +276,7 @@ static void test_operator_matcher(void)
         CU_ASSERT(ib != NULL);
 
         token_t token;
-        if(!match_operator(ib, &token)) {
+        if(!match_operator(ctx, ib, &token)) {
             printf("%s\n", g_operators[i]);
             CU_ASSERT(0);
         }
@@ -490,11 +285,13 @@ static void test_operator_matcher(void)
 
         buffer_close(ib);
     }
+
+    cc_context_destroy(ctx);
 }
 TEST_ADD(test_operator_matcher);
 
 
-static bool match_identifier(input_buffer_t* in, token_t* token)
+static bool match_identifier(cc_context_t* ctx, input_buffer_t* in, token_t* token)
 {
     assert(in);
     assert(token);
@@ -514,7 +311,7 @@ static bool match_identifier(input_buffer_t* in, token_t* token)
     for (int i = 1; i < SHL_IDENTIFIER_LIMIT; ++i) {
         char c = buffer_getchar(in);
         if (iseow(c)) {
-            token->value = string(buf);
+            token->value = string(ctx, buf);
             return true;
         } else if (!isalnum(c) && (c != '_')) {
             return false;
@@ -529,7 +326,8 @@ static bool match_identifier(input_buffer_t* in, token_t* token)
 
 static void test_identifier_matcher(void)
 {
-    strings_init();
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
 
     token_t token;
     input_buffer_t* ib;
@@ -556,7 +354,7 @@ static void test_identifier_matcher(void)
         const char* str = valid[i];
         ib = buffer_mem((void*)str, strlen(str));
         CU_ASSERT(ib != NULL);
-        CU_ASSERT_TRUE(match_identifier(ib, &token));
+        CU_ASSERT_TRUE(match_identifier(ctx, ib, &token));
         CU_ASSERT_TRUE(token.type == kTokenIdentifier);
         CU_ASSERT_TRUE(0 == strcmp(_S(token.value), str));
         buffer_close(ib);
@@ -566,21 +364,23 @@ static void test_identifier_matcher(void)
         const char* str = invalid[i];
         ib = buffer_mem((void*)str, strlen(str));
         CU_ASSERT(ib != NULL);
-        CU_ASSERT_FALSE(match_identifier(ib, &token));
+        CU_ASSERT_FALSE(match_identifier(ctx, ib, &token));
         buffer_close(ib);
     }
+
+    cc_context_destroy(ctx);
 }
 TEST_ADD(test_identifier_matcher);
 
 
-static bool match_integer_constant(input_buffer_t* in, token_t* token)
+static bool match_integer_constant(cc_context_t* ctx, input_buffer_t* in, token_t* token)
 {
     assert(in);
     assert(token);
 
     // Integer constant is one of those:
     // - 0x|0X followed by any alnum (hex)
-    // - 0 follwed by any num (oct)
+    // - 0 followed by octal digits (oct)
     // - any num (dec)
     //
     // All of those can have suffixes: u, ul, l, ll, ull in any case combination
@@ -601,11 +401,11 @@ static bool match_integer_constant(input_buffer_t* in, token_t* token)
         /* Hex or oct number or just 0 */
         c = buffer_getchar(in);
         if (iseow(c)) {
-            return make_token(token, kTokenIntConstant, buf, kIntegerDefaultType);
+            return make_integer_token(ctx, token, buf, kIntegerDefaultType);
         } else if (c == 'x' || c == 'X') {
             hex = true;
             buf[i++] = c;
-        } else if (c >= '1' && c <= '8') {
+        } else if (c >= '0' && c <= '7') {
             oct = true;
             buf[i++] = c;
         } else {
@@ -619,12 +419,12 @@ static bool match_integer_constant(input_buffer_t* in, token_t* token)
     for (; i < SHL_IDENTIFIER_LIMIT; ++i) {
         c = buffer_getchar(in);
         if (iseow(c)) {
-            return make_token(token, kTokenIntConstant, buf, kIntegerDefaultType);
+            return make_integer_token(ctx, token, buf, kIntegerDefaultType);
         }
 
         if (hex && !isxdigit(c)) {
             break;
-        } else if (oct && !(c >= '1' && c <= '8')) {
+        } else if (oct && !(c >= '0' && c <= '7')) {
             break;
         } else if (dec && !isdigit(c)) {
             break;
@@ -638,21 +438,21 @@ parse_suffix:
     case 'u':
     case 'U':
         if (iseow(c = buffer_getchar(in))) {
-            return make_token(token, kTokenIntConstant, buf, kIntegerTypeUnsigned);
+            return make_integer_token(ctx, token, buf, kIntegerTypeUnsigned);
         }
 
         switch (c) {
         case 'l':
         case 'L':
             if (iseow(c = buffer_getchar(in))) {
-                return make_token(token, kTokenIntConstant, buf, kIntegerTypeUnsignedLong);
+                return make_integer_token(ctx, token, buf, kIntegerTypeUnsignedLong);
             }
 
             switch (c) {
             case 'l':
             case 'L':
                 if (iseow(c = buffer_getchar(in))) {
-                    return make_token(token, kTokenIntConstant, buf, kIntegerTypeUnsignedLongLong);
+                    return make_integer_token(ctx, token, buf, kIntegerTypeUnsignedLongLong);
                 }
 
             default:
@@ -666,14 +466,14 @@ parse_suffix:
     case 'l':
     case 'L':
         if (iseow(c = buffer_getchar(in))) {
-            return make_token(token, kTokenIntConstant, buf, kIntegerTypeLong);
+            return make_integer_token(ctx, token, buf, kIntegerTypeLong);
         }
 
         switch (c) {
         case 'l':
         case 'L':
             if (iseow(c = buffer_getchar(in))) {
-                return make_token(token, kTokenIntConstant, buf, kIntegerTypeLongLong);
+                return make_integer_token(ctx, token, buf, kIntegerTypeLongLong);
             }
 
         default:
@@ -687,14 +487,20 @@ parse_suffix:
 
 static void test_integer_constant_matcher(void)
 {
-    strings_init();
-
-    const char* bases[] = {
-        "0",
-        "12",
-        "0xdeadf00d",
-        "0Xbaba17ba",
-        "012345678",
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    struct {
+        const char* str;
+        uint64_t value;
+        integer_literal_type_t type;    // Without a suffix
+    } bases[] = {
+        { "0", 0, kIntegerTypeInt },
+        { "00", 0, kIntegerTypeInt },
+        { "12", 12, kIntegerTypeInt },
+        { "0xdeadf00d", 0xdeadf00d, kIntegerTypeUnsigned },
+        { "0Xbaba17ba", 0xbaba17ba, kIntegerTypeUnsigned },
+        { "01234567", 01234567, kIntegerTypeInt },
     };
 
     const char* suffixes[] = {
@@ -709,7 +515,7 @@ static void test_integer_constant_matcher(void)
     for (size_t i = 0; i < countof(bases); ++i)
     {
         for (size_t j = 0; j < countof(suffixes); ++j) {
-            const char* base = bases[i];
+            const char* base = bases[i].str;
             const char* suffix = suffixes[j];
 
             char str[32] = {0};
@@ -720,9 +526,10 @@ static void test_integer_constant_matcher(void)
             CU_ASSERT(ib != NULL);
 
             token_t token;
-            CU_ASSERT_TRUE(match_integer_constant(ib, &token));
+            CU_ASSERT_TRUE(match_integer_constant(ctx, ib, &token));
             CU_ASSERT_TRUE(token.type == kTokenIntConstant);
-            CU_ASSERT_TRUE(token.inttype == (integer_literal_type_t)j);
+            CU_ASSERT_TRUE(token.inttype == (j ? (integer_literal_type_t)j : bases[i].type));
+            CU_ASSERT_TRUE(token.intval == bases[i].value);
             CU_ASSERT_TRUE(!strcmp(_S(token.value), base));
 
             buffer_close(ib);
@@ -733,7 +540,9 @@ static void test_integer_constant_matcher(void)
         "-42",
         "deadf00d",
         "0deaff00d",
-        "00",
+        "08",
+        "012345678",
+        "18446744073709551616",
         "",
         "-a",
         "10ulll",
@@ -747,94 +556,3341 @@ static void test_integer_constant_matcher(void)
         CU_ASSERT(ib != NULL);
 
         token_t token;
-        CU_ASSERT_FALSE(match_integer_constant(ib, &token));
+        CU_ASSERT_FALSE(match_integer_constant(ctx, ib, &token));
 
         buffer_close(ib);
     }
+
+    cc_context_destroy(ctx);
 }
 TEST_ADD(test_integer_constant_matcher);
 
 /////////////////////////////////////////////////////////////////////////////////
 
 // Order follows matcher priority
-static bool(*g_matchers[])(input_buffer_t* ib, token_t* token) = {
+static bool(*g_matchers[])(cc_context_t* ctx, input_buffer_t* ib, token_t* token) = {
     &match_keyword,
+    &match_operator,
     &match_identifier,
     &match_integer_constant,
 };
 
-//static regex_t g_keyword_re = {
+// Tokenizer the lexer replaced. Tokens must be separated by whitespace.
+static int reference_next_token(cc_context_t* ctx, input_buffer_t* in, token_t* out_token)
+{
+    if (buffer_iseof(in)) {
+        return -1;
+    }
 
-//    NULL, NULL
-//};
-//
-//static regex_t* g_all_regex[] = {
-//    &g_keyword_re
-//};
+    for (int i = 0; i < countof(g_matchers); ++i) {
+        size_t offset = buffer_get_offset(in);
+        if (g_matchers[i](ctx, in, out_token)) {
+            return 0;
+        }
+
+        buffer_set_offset(in, offset);
+    }
+
+    return EILSEQ;
+}
+
+#endif // TEST
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Lexer.
+ * First byte of a token selects its scanner through a dispatch table, each scanner consumes
+ * the longest valid token in a single pass over the input and never backtracks past it.
+ */
 
-int init_scanner(void)
+typedef enum
 {
-    // Add all keywords and operators to string table for faster comparison
-    for (size_t i = 0; i < countof(g_keywords); ++i) {
-        string_t str = string(g_keywords[i]);
-        if (!_S(str)) {
-            return ENOMEM;
+    kLexInvalid = 0,
+    kLexSpace,
+    kLexIdentifier,     // Keywords and identifiers, including extended ones
+    kLexOperator,
+    kLexNumber,
+    kLexLiteral,        // Unprefixed string and character literals
+    kLexPunctuator,     // Single byte punctuators that no longer token starts with
+} lex_class_t;
+
+static const uint8_t g_lex_dispatch[256] = {
+    [' '] = kLexSpace, ['\t'] = kLexSpace, ['\n'] = kLexSpace,
+    ['\v'] = kLexSpace, ['\f'] = kLexSpace, ['\r'] = kLexSpace,
+
+    ['a' ... 'z'] = kLexIdentifier,
+    ['A' ... 'Z'] = kLexIdentifier,
+    ['_'] = kLexIdentifier,
+    [0x80 ... 0xff] = kLexIdentifier, ['\\'] = kLexIdentifier,  // UTF-8 and universal character names
+
+    ['0' ... '9'] = kLexNumber, ['.'] = kLexNumber, // Point starts floating constants and punctuators
+
+    ['"'] = kLexLiteral, ['\''] = kLexLiteral,
+
+    ['+'] = kLexOperator, ['-'] = kLexOperator, ['*'] = kLexOperator, ['/'] = kLexOperator,
+    ['%'] = kLexOperator, ['='] = kLexOperator, ['!'] = kLexOperator, ['<'] = kLexOperator,
+    ['>'] = kLexOperator, ['&'] = kLexOperator, ['|'] = kLexOperator, ['^'] = kLexOperator,
+    [':'] = kLexOperator, ['#'] = kLexOperator,
+
+    ['('] = kLexPunctuator, [')'] = kLexPunctuator, ['['] = kLexPunctuator, [']'] = kLexPunctuator,
+    ['{'] = kLexPunctuator, ['}'] = kLexPunctuator, [';'] = kLexPunctuator, [','] = kLexPunctuator,
+    ['?'] = kLexPunctuator, ['~'] = kLexPunctuator,
+};
+
+// Characters that can continue an identifier
+static const uint8_t g_lex_ident[256] = {
+    ['a' ... 'z'] = 1,
+    ['A' ... 'Z'] = 1,
+    ['0' ... '9'] = 1,
+    ['_'] = 1,
+};
+
+// Classify identifier as a keyword using generated perfect hash.
+// Returns kKeywordTotal for identifiers that are not keywords.
+static inline keyword_kind_t lex_keyword_kind(const char* p, size_t len, uint32_t hash)
+{
+    uint32_t d = g_keyword_displacements[keyword_hash_mix(hash) % KEYWORD_HASH_BUCKETS];
+    keyword_kind_t kind = g_keyword_slots[keyword_hash_mix(hash ^ d) % KEYWORD_HASH_SLOTS];
+
+    if (len == g_keyword_lengths[kind] && 0 == memcmp(p, g_keywords[kind], len)) {
+        return kind;
+    }
+
+    return kKeywordTotal;
+}
+
+/*
+ * String and character literals.
+ * Literal body is scanned in plain runs up to the next quote, backslash or newline with vectorized search.
+ * Strings without escapes are returned as spans of the input buffer, only strings with escapes are
+ * decoded into a temporary buffer and stored.
+ */
+
+// Longest literal decoded on stack, decoded contents are never longer than the source
+#define LEX_LITERAL_STACK 256
+
+static inline bool lex_ishex(char c)
+{
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+}
+
+static inline unsigned lex_hexval(char c)
+{
+    return (c <= '9') ? (unsigned)(c - '0') : (unsigned)((c | 0x20) - 'a' + 10);
+}
+
+// C11 6.4.3: universal character names can't name surrogates, code points past Unicode
+// or basic characters other than $, @ and `
+static bool lex_valid_ucn(uint32_t cp)
+{
+    if (cp < 0xa0) {
+        return cp == '$' || cp == '@' || cp == '`';
+    }
+
+    return cp <= 0x10ffff && !(cp >= 0xd800 && cp <= 0xdfff);
+}
+
+static bool lex_valid_codepoint(uint32_t cp)
+{
+    return cp <= 0x10ffff && !(cp >= 0xd800 && cp <= 0xdfff);
+}
+
+static size_t utf8_encode(uint32_t cp, char* out)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+// Decode one UTF-8 sequence, returns NULL if it is malformed
+static const char* utf8_decode(const char* p, const char* end, uint32_t* out_cp)
+{
+    uint8_t c = *p++;
+    if (c < 0x80) {
+        *out_cp = c;
+        return p;
+    }
+
+    unsigned len;
+    uint32_t cp;
+    uint32_t min;
+    if ((c & 0xe0) == 0xc0) {
+        len = 1, cp = c & 0x1f, min = 0x80;
+    } else if ((c & 0xf0) == 0xe0) {
+        len = 2, cp = c & 0x0f, min = 0x800;
+    } else if ((c & 0xf8) == 0xf0) {
+        len = 3, cp = c & 0x07, min = 0x10000;
+    } else {
+        return NULL;
+    }
+
+    if ((size_t)(end - p) < len) {
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < len; ++i) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return NULL;
         }
+
+        cp = (cp << 6) | (p[i] & 0x3f);
     }
 
-    for (size_t i = 0; i < countof(g_operators); ++i) {
-        string_t str = string(g_operators[i]);
-        if (!_S(str)) {
-            return ENOMEM;
+    if (cp < min || !lex_valid_codepoint(cp)) {
+        return NULL;
+    }
+
+    *out_cp = cp;
+    return p + len;
+}
+
+// Universal character name following \\u or \\U, 'kind' is the letter. Returns NULL for invalid names.
+static const char* lex_ucn(const char* p, const char* end, char kind, uint32_t* out_cp)
+{
+    unsigned digits = (kind == 'u' ? 4 : 8);
+    if ((size_t)(end - p) < digits) {
+        return NULL;
+    }
+
+    uint32_t value = 0;
+    for (unsigned i = 0; i < digits; ++i) {
+        if (!lex_ishex(p[i])) {
+            return NULL;
         }
+
+        value = value * 16 + lex_hexval(p[i]);
     }
 
-//    for (size_t i = 0; i < countof(g_all_regex); ++i)
-//    {
-//        regex_t* re = g_all_regex[i];
-//
-//        const char* error_str = NULL;
-//        int error_offset = 0;
-//        re->re = pcre_compile(re->spec, PCRE_CASELESS, &error_str, &error_offset, NULL);
-//        if (!re->re) {
-//            return -1;
-//        }
-//
-//        // It's ok if study turns out to be NULL
-//        re->study = pcre_study(re->re, 0, &error_str);
-//        if (error_str) {
-//            pcre_free(re->re);
-//            return -1;
-//        }
-//    }
+    if (!lex_valid_ucn(value)) {
+        return NULL;
+    }
 
-    return 0;
+    *out_cp = value;
+    return p + digits;
 }
 
-int parse_next_token(input_buffer_t* in, token_t* out_token)
+// Decode escape sequence following a backslash. Returns NULL for invalid escapes.
+static const char* lex_escape(const char* p, const char* end, uint32_t* out_value, bool* out_ucn)
 {
-    if (!in) {
-        return EINVAL;
+    if (p >= end) {
+        return NULL;
     }
 
-    if (!out_token) {
-        return EINVAL;
+    *out_ucn = false;
+
+    char c = *p++;
+    switch (c) {
+    case '\'': case '"': case '?': case '\\':
+        *out_value = c;
+        return p;
+
+    case 'a': *out_value = '\a'; return p;
+    case 'b': *out_value = '\b'; return p;
+    case 'f': *out_value = '\f'; return p;
+    case 'n': *out_value = '\n'; return p;
+    case 'r': *out_value = '\r'; return p;
+    case 't': *out_value = '\t'; return p;
+    case 'v': *out_value = '\v'; return p;
+
+    case '0' ... '7': {
+        uint32_t value = c - '0';
+        for (int i = 0; i < 2 && p < end && *p >= '0' && *p <= '7'; ++i) {
+            value = value * 8 + (*p++ - '0');
+        }
+
+        *out_value = value;
+        return p;
     }
 
-    while (!buffer_iseof(in)) {
-        for (int i = 0; i < countof(g_matchers); ++i) {
-            off_t offset = buffer_get_offset(in);
-            if (g_matchers[i](in, out_token)) {
-                return 0;
+    case 'x': {
+        if (p >= end || !lex_ishex(*p)) {
+            return NULL;
+        }
+
+        uint64_t value = 0;
+        while (p < end && lex_ishex(*p)) {
+            value = value * 16 + lex_hexval(*p++);
+            if (value > UINT32_MAX) {
+                return NULL;
+            }
+        }
+
+        *out_value = value;
+        return p;
+    }
+
+    case 'u':
+    case 'U':
+        p = lex_ucn(p, end, c, out_value);
+        *out_ucn = true;
+        return p;
+
+    default:
+        return NULL;
+    };
+}
+
+// Decode literal body between quotes. 'out' should have room for (end - p) bytes.
+static bool lex_decode_literal(const char* p, const char* end, literal_encoding_t encoding, char* out, size_t* out_len)
+{
+    bool narrow = (encoding == kEncodingDefault || encoding == kEncodingUtf8);
+    char* q = out;
+
+    while (p < end) {
+        if (*p != '\\') {
+            const char* run = charscan_find_char(p, end, '\\');
+            memcpy(q, p, run - p);
+            q += run - p;
+            p = run;
+            continue;
+        }
+
+        uint32_t value;
+        bool ucn;
+        p = lex_escape(p + 1, end, &value, &ucn);
+        if (!p) {
+            return false;
+        }
+
+        if (ucn || !narrow) {
+            if (!lex_valid_codepoint(value)) {
+                return false;
+            }
+
+            q += utf8_encode(value, q);
+        } else {
+            if (value > UINT8_MAX) {
+                return false;
             }
 
-            buffer_set_offset(in, offset);
+            *q++ = value;
         }
     }
 
-    return -1;
+    *out_len = q - out;
+    return true;
 }
 
+// Character constant value. Plain constants are int with chars packed like gcc does,
+// prefixed ones hold a single character of their type.
+static bool lex_char_value(const char* p, const char* end, literal_encoding_t encoding, uint64_t* out_value)
+{
+    if (encoding == kEncodingDefault) {
+        char buf[LEX_LITERAL_STACK];
+        size_t len = 0;
+        if ((size_t)(end - p) > sizeof(buf) || !lex_decode_literal(p, end, encoding, buf, &len)) {
+            return false;
+        }
+
+        if (len == 0 || len > sizeof(int)) {
+            return false;
+        }
+
+        // Single char is converted from (signed) char
+        int32_t value = (len == 1 ? (int32_t)(signed char)buf[0] : 0);
+        for (size_t i = 0; len > 1 && i < len; ++i) {
+            value = (int32_t)(((uint32_t)value << 8) | (uint8_t)buf[i]);
+        }
+
+        *out_value = (uint64_t)(int64_t)value;
+        return true;
+    }
+
+    if (p >= end) {
+        return false;
+    }
+
+    uint32_t value;
+    if (*p == '\\') {
+        bool ucn;
+        p = lex_escape(p + 1, end, &value, &ucn);
+    } else {
+        p = utf8_decode(p, end, &value);
+    }
+
+    if (!p || p != end) {
+        return false;
+    }
+
+    switch (encoding) {
+    case kEncodingChar16:
+        if (value > UINT16_MAX) {
+            return false;
+        }
+        *out_value = value;
+        return true;
+
+    case kEncodingChar32:
+        *out_value = value;
+        return true;
+
+    case kEncodingWide:
+        // wchar_t is a signed 32 bit int
+        *out_value = (uint64_t)(int64_t)(int32_t)value;
+        return true;
+
+    default:
+        // No u8 character constants in C11
+        return false;
+    };
+}
+
+// 'p' is at the opening quote, after the prefix if there is one.
+// Returns end of the token or NULL for unterminated or invalid literals.
+static const char* lex_literal(cc_context_t* ctx, const char* p, const char* end, literal_encoding_t encoding, token_t* token)
+{
+    char quote = *p++;
+    const char* body = p;
+    bool escapes = false;
+
+    for (;;) {
+        p = charscan_find_literal_end(p, end, quote);
+        if (p >= end || *p == '\n') {
+            return NULL;
+        }
+
+        if (*p == quote) {
+            break;
+        }
+
+        // Skip escaped character, it can't end the literal. Escaped newline is not allowed here.
+        if (p + 1 >= end || p[1] == '\n') {
+            return NULL;
+        }
+
+        escapes = true;
+        p += 2;
+    }
+
+    const char* body_end = p++;
+
+    if (quote == '\'') {
+        uint64_t value = 0;
+        if (!lex_char_value(body, body_end, encoding, &value)) {
+            return NULL;
+        }
+
+        token->type = kTokenCharConstant;
+        token->value = _MAKESTR(NULL);
+        token->encoding = encoding;
+        token->intval = value;
+        token->literal = NULL;
+        return p;
+    }
+
+    token->type = kTokenStrConstant;
+    token->encoding = encoding;
+
+    if (!escapes) {
+        token->value = _MAKESTR(NULL);
+        token->length = body_end - body;
+        token->literal = body;
+        return p;
+    }
+
+    char stackbuf[LEX_LITERAL_STACK];
+    size_t size = body_end - body;
+    char* buf = (size <= sizeof(stackbuf) ? stackbuf : malloc(size));
+    if (!buf) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    string_t str = _MAKESTR(NULL);
+    if (lex_decode_literal(body, body_end, encoding, buf, &len)) {
+        str = string_intern(ctx, buf, len, strings_hash(buf, len));
+    }
+
+    if (buf != stackbuf) {
+        free(buf);
+    }
+
+    if (!_S(str)) {
+        return NULL;
+    }
+
+    token->value = str;
+    token->length = len;
+    token->literal = _S(str);
+    return p;
+}
+
+// Literal prefixes look like identifiers: u8"", u"", U"", L"" and u'', U'', L''
+static inline const char* lex_literal_prefix(const char* p, const char* end, literal_encoding_t* out_encoding)
+{
+    const char* q = p + 1;
+
+    switch (*p) {
+    case 'u':
+        *out_encoding = kEncodingChar16;
+        if (q + 1 < end && q[0] == '8' && q[1] == '"') {
+            *out_encoding = kEncodingUtf8;
+            ++q;
+        }
+        break;
+
+    case 'U':
+        *out_encoding = kEncodingChar32;
+        break;
+
+    case 'L':
+        *out_encoding = kEncodingWide;
+        break;
+
+    default:
+        return NULL;
+    };
+
+    return (q < end && (*q == '"' || *q == '\'')) ? q : NULL;
+}
+
+/*
+ * Extended identifiers.
+ * Besides the basic set, C11 allows characters from Annex D ranges written either in UTF-8
+ * or as universal character names. Ranges are checked with the generated two-stage bitmap.
+ */
+
+// C11 D.1: character is allowed in an identifier
+static inline bool lex_xid(uint32_t cp)
+{
+    if (cp >= XID_CODEPOINTS) {
+        return false;
+    }
+
+    const uint32_t* block = g_xid_blocks[g_xid_index[cp >> XID_BLOCK_BITS]];
+    unsigned bit = cp & ((1u << XID_BLOCK_BITS) - 1);
+    return (block[bit / 32] >> (bit % 32)) & 1;
+}
+
+// C11 D.2: combining marks can't start an identifier
+static inline bool lex_xid_start(uint32_t cp)
+{
+    return !((cp >= 0x0300 && cp <= 0x036f) || (cp >= 0x1dc0 && cp <= 0x1dff) ||
+             (cp >= 0x20d0 && cp <= 0x20ff) || (cp >= 0xfe20 && cp <= 0xfe2f));
+}
+
+// Character at 'p' is a part of an identifier or a pp-number it follows
+static inline bool lex_ident_continues(const char* p, const char* end)
+{
+    return p < end && (g_lex_ident[(uint8_t)*p] || (uint8_t)*p >= 0x80 ||
+                       (*p == '\\' && p + 1 < end && (p[1] == 'u' || p[1] == 'U')));
+}
+
+// Decode UTF-8 sequence or universal character name, returns NULL if there is no valid one at 'p'
+static inline const char* lex_ident_char(const char* p, const char* end, uint32_t* out_cp)
+{
+    if (*p == '\\') {
+        return (p + 1 < end && (p[1] == 'u' || p[1] == 'U')) ? lex_ucn(p + 2, end, p[1], out_cp) : NULL;
+    }
+
+    return utf8_decode(p, end, out_cp);
+}
+
+// Rest of an identifier starting at 'p', 'q' is at its first character outside of the basic set
+// and 'hash' covers everything before it.
+// Name is interned in UTF-8 with universal character names decoded, so that both spellings
+// of a character give the same identifier. Extended identifiers are never keywords.
+static const char* lex_word_extended(cc_context_t* ctx, const char* p, const char* q, const char* end, uint32_t hash, token_t* token)
+{
+    size_t size = q - p;
+    bool ucn = false;
+
+    while (q < end) {
+        if (g_lex_ident[(uint8_t)*q]) {
+            hash = strings_hash_step(hash, *q++);
+            ++size;
+            continue;
+        }
+
+        if ((uint8_t)*q < 0x80 && *q != '\\') {
+            break;
+        }
+
+        uint32_t cp;
+        const char* next = lex_ident_char(q, end, &cp);
+        if (!next) {
+            if (*q == '\\') {
+                break;  // Stray backslash is a token of its own
+            }
+
+            return NULL;
+        }
+
+        if (!lex_xid(cp) || (q == p && !lex_xid_start(cp))) {
+            break;
+        }
+
+        char utf8[4];
+        size_t n = utf8_encode(cp, utf8);
+        for (size_t i = 0; i < n; ++i) {
+            hash = strings_hash_step(hash, utf8[i]);
+        }
+
+        size += n;
+        ucn |= (*q == '\\');
+        q = next;
+    }
+
+    if (q == p) {
+        return NULL;
+    }
+
+    string_t str;
+    if (!ucn) {
+        str = string_intern(ctx, p, q - p, hash);
+    } else {
+        char stackbuf[LEX_LITERAL_STACK];
+        char* buf = (size <= sizeof(stackbuf) ? stackbuf : malloc(size));
+        if (!buf) {
+            return NULL;
+        }
+
+        char* o = buf;
+        for (const char* s = p; s < q;) {
+            uint32_t cp;
+            if (*s != '\\') {
+                *o++ = *s++;
+            } else {
+                s = lex_ident_char(s, q, &cp);
+                o += utf8_encode(cp, o);
+            }
+        }
+
+        str = string_intern(ctx, buf, size, hash);
+        if (buf != stackbuf) {
+            free(buf);
+        }
+    }
+
+    if (!_S(str)) {
+        return NULL;
+    }
+
+    token->type = kTokenIdentifier;
+    token->value = str;
+    return q;
+}
+
+// Keywords and identifiers.
+// Word is scanned through the identifier table while computing string hash, so that neither keyword
+// classification nor interning needs to look at the word again.
+static const char* lex_word(cc_context_t* ctx, const char* p, const char* end, token_t* token)
+{
+    literal_encoding_t encoding;
+    const char* quote = lex_literal_prefix(p, end, &encoding);
+    if (quote) {
+        return lex_literal(ctx, quote, end, encoding, token);
+    }
+
+    const char* q = p;
+    uint32_t hash = 0;
+
+    while (q < end && g_lex_ident[(uint8_t)*q]) {
+        hash = strings_hash_step(hash, *q);
+        ++q;
+    }
+
+    // Table loop stops at the first byte outside of ASCII, so plain identifiers only pay for this check
+    if (q < end && ((uint8_t)*q >= 0x80 || *q == '\\')) {
+        return lex_word_extended(ctx, p, q, end, hash, token);
+    }
+
+    keyword_kind_t kind = lex_keyword_kind(p, q - p, hash);
+    if (kind != kKeywordTotal) {
+        token->type = kTokenKeyword;
+        token->value = ctx->keywords[kind];
+        token->keyword = kind;
+        return q;
+    }
+
+    string_t str = string_intern(ctx, p, q - p, hash);
+    if (!_S(str)) {
+        return NULL;
+    }
+
+    token->type = kTokenIdentifier;
+    token->value = str;
+    return q;
+}
+
+// Operators are matched by the generated DFA with maximal munch.
+// No punctuator is longer than DFA_MAX_LENGTH, so the DFA always takes exactly that many steps: dead state
+// loops on itself and the longest accept is tracked with conditional moves instead of exits.
+// Input shorter than that is padded with zeros, which lead to the dead state from everywhere.
+// Returns end of the token or NULL if nothing could be matched.
+static const char* lex_operator(cc_context_t* ctx, const char* p, const char* end, token_t* token)
+{
+    uint8_t pad[DFA_MAX_LENGTH] = {0};
+    const uint8_t* s = (const uint8_t*)p;
+    if (end - p < DFA_MAX_LENGTH) {
+        memcpy(pad, p, end - p);
+        s = pad;
+    }
+
+    unsigned state = DFA_STATE_START;
+    unsigned length = 0;
+    unsigned index = 0;
+
+    for (unsigned i = 0; i < DFA_MAX_LENGTH; ++i) {
+        state = g_dfa_transitions[state][g_dfa_classes[s[i]]];
+
+        bool accept = (g_dfa_accept[state] == DFA_ACCEPT_OPERATOR);
+        length = accept ? i + 1 : length;
+        index = accept ? g_dfa_accept_index[state] : index;
+    }
+
+    if (!length) {
+        return NULL;
+    }
+
+    token->type = kTokenOperator;
+    token->value = ctx->operators[index];
+    token->op = (operator_kind_t)index;
+    return p + length;
+}
+
+// Brackets, separators and other single byte punctuators need no DFA
+static inline const char* lex_punctuator(cc_context_t* ctx, const char* p, token_t* token)
+{
+    unsigned index = g_dfa_single[(uint8_t)*p] - 1;
+
+    token->type = kTokenOperator;
+    token->value = ctx->operators[index];
+    token->op = (operator_kind_t)index;
+    return p + 1;
+}
+
+/*
+ * Integer constants are converted 8 digits at a time (SWAR).
+ * Next 8 bytes are loaded into a word, digit lanes are validated and converted to digit values
+ * in parallel, then lanes are folded pairwise: 8 digits -> 4 two-digit values -> 2 four-digit values -> one.
+ * Lanes past the last digit are shifted out, so the same code handles shorter runs.
+ */
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#   error SWAR digit parsing expects a little-endian target
+#endif
+
+#define SWAR_BYTES(b)   (0x0101010101010101ull * (uint8_t)(b))
+
+// 0x80 in every lane that is in [lo, hi], lanes should be below 0x80
+#define SWAR_IN_RANGE(w, lo, hi) \
+    (((w) + SWAR_BYTES(0x80 - (lo))) & ~((w) + SWAR_BYTES(0x7f - (hi))) & SWAR_BYTES(0x80))
+
+// Up to 8 bytes, missing bytes are zeros which are never digits
+static inline uint64_t swar_load(const char* p, const char* end)
+{
+    uint64_t w = 0;
+    memcpy(&w, p, (end - p) < 8 ? (size_t)(end - p) : 8);
+    return w;
+}
+
+// Count leading digits in a word and convert all of them to values in their lanes
+static inline unsigned swar_digits(uint64_t w, unsigned radix, uint64_t* values)
+{
+    uint64_t valid;
+    uint64_t letters = 0;
+
+    if (radix == 16) {
+        letters = SWAR_IN_RANGE(w | SWAR_BYTES(0x20), 'a', 'f');
+        valid = SWAR_IN_RANGE(w, '0', '9') | letters;
+    } else {
+        valid = SWAR_IN_RANGE(w, '0', '0' + radix - 1);
+    }
+
+    // Lanes with high bit set could have passed range checks by overflowing
+    valid &= ~w;
+
+    // Digit value is the low nibble, letters need 9 more
+    *values = (w & SWAR_BYTES(0x0f)) + (letters >> 7) * 9;
+
+    uint64_t invalid = ~valid & SWAR_BYTES(0x80);
+    return invalid ? (unsigned)__builtin_ctzll(invalid) / 8 : 8;
+}
+
+// Fold 'count' leading digit lanes into a single value
+static inline uint64_t swar_fold(uint64_t values, unsigned count, unsigned radix)
+{
+    // First digit is in the lowest lane, shifting left puts the run in the top lanes after zero lanes
+    values <<= 8 * (8 - count);
+
+    values = (values * radix + (values >> 8)) & 0x00ff00ff00ff00ffull;
+    values = (values * radix * radix + (values >> 16)) & 0x0000ffff0000ffffull;
+    values = (values * radix * radix * radix * radix + (values >> 32)) & 0xffffffffull;
+    return values;
+}
+
+// Parse a run of digits, returns end of the run or NULL on overflow
+static const char* lex_digits(const char* p, const char* end, unsigned radix, uint64_t* out_value)
+{
+    uint64_t value = 0;
+
+    while (p < end) {
+        uint64_t digits;
+        unsigned count = swar_digits(swar_load(p, end), radix, &digits);
+        if (count == 0) {
+            break;
+        }
+
+        uint64_t scale = 1;
+        for (unsigned i = 0; i < count; ++i) {
+            scale *= radix;
+        }
+
+        if (__builtin_mul_overflow(value, scale, &value) ||
+            __builtin_add_overflow(value, swar_fold(digits, count, radix), &value)) {
+            return NULL;
+        }
+
+        p += count;
+        if (count < 8) {
+            break;
+        }
+    }
+
+    *out_value = value;
+    return p;
+}
+
+/*
+ * Floating constants.
+ * Decimal significand is collected into a 64-bit integer and converted with Eisel-Lemire: it is multiplied
+ * by a 128-bit approximation of the power of ten and the product gives a correctly rounded result unless
+ * it is too close to a rounding boundary to call. Small exact cases use plain floating point math,
+ * those few hard cases and values out of normal range are handed to the C library which does exact arithmetic.
+ */
+
+#define FLOAT_MAX_DIGITS 19 // Significant digits that always fit 64 bits
+
+typedef struct
+{
+    unsigned mantissa_bits;     // Explicit mantissa bits
+    unsigned bias;
+    unsigned infinite_power;
+    unsigned max_exact_mantissa_bits;
+    int max_exact_power;        // Largest power of ten that is exact in this format
+} float_format_t;
+
+static const float_format_t g_binary64 = { 52, 1023, 0x7ff, 53, 22 };
+static const float_format_t g_binary32 = { 23, 127, 0xff, 24, 10 };
+
+// Returns false when result can't be decided or is not a normal number
+static bool eisel_lemire(const float_format_t* fmt, uint64_t w, int64_t q, uint64_t* out_bits)
+{
+    if (w == 0) {
+        *out_bits = 0;
+        return true;
+    }
+
+    if (q < POW5_MIN_EXPONENT || q > POW5_MAX_EXPONENT) {
+        return false;
+    }
+
+    // Normalize significand and compute binary exponent estimate, 217706 / 2^16 ~ log2(10)
+    unsigned clz = __builtin_clzll(w);
+    w <<= clz;
+    uint64_t power2 = (uint64_t)(((217706 * q) >> 16) + 64 + fmt->bias) - clz;
+
+    const uint64_t* pow5 = g_pow5_128[q - POW5_MIN_EXPONENT];
+    unsigned shift = 64 - fmt->mantissa_bits - 3;
+    uint64_t mask = (1ull << shift) - 1;
+
+    unsigned __int128 x = (unsigned __int128)w * pow5[0];
+    uint64_t hi = (uint64_t)(x >> 64);
+    uint64_t lo = (uint64_t)x;
+
+    // Truncated bits are all ones, low half of the power might carry into them
+    if ((hi & mask) == mask && lo + w < w) {
+        unsigned __int128 y = (unsigned __int128)w * pow5[1];
+        uint64_t yhi = (uint64_t)(y >> 64);
+        uint64_t ylo = (uint64_t)y;
+
+        uint64_t merged_lo = lo + yhi;
+        uint64_t merged_hi = hi + (merged_lo < lo);
+        if ((merged_hi & mask) == mask && merged_lo + 1 == 0 && ylo + w < w) {
+            return false;
+        }
+
+        hi = merged_hi;
+        lo = merged_lo;
+    }
+
+    uint64_t msb = hi >> 63;
+    uint64_t mantissa = hi >> (msb + shift);
+    power2 -= 1 ^ msb;
+
+    // Exactly half way between two values, round to even needs exact answer
+    if (lo == 0 && (hi & mask) == 0 && (mantissa & 3) == 1) {
+        return false;
+    }
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >> (fmt->mantissa_bits + 1)) {
+        mantissa >>= 1;
+        power2 += 1;
+    }
+
+    // Subnormals and infinities are left to the slow path
+    if (power2 - 1 >= fmt->infinite_power - 1) {
+        return false;
+    }
+
+    *out_bits = (power2 << fmt->mantissa_bits) | (mantissa & ((1ull << fmt->mantissa_bits) - 1));
+    return true;
+}
+
+static inline double bits_to_double(uint64_t bits)
+{
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static inline float bits_to_float(uint32_t bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Exact conversion by the C library
+static bool lex_float_slow(const char* start, const char* end, bool single, double* out_value)
+{
+    char stackbuf[64];
+    size_t len = end - start;
+    char* buf = (len < sizeof(stackbuf) ? stackbuf : malloc(len + 1));
+    if (!buf) {
+        return false;
+    }
+
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+
+    *out_value = single ? strtof(buf, NULL) : strtod(buf, NULL);
+
+    if (buf != stackbuf) {
+        free(buf);
+    }
+
+    return true;
+}
+
+static bool lex_float_decimal(uint64_t w, int64_t q, bool truncated, bool single, double* out_value)
+{
+    static const double exact_pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    const float_format_t* fmt = (single ? &g_binary32 : &g_binary64);
+
+    // Both significand and power of ten are exact, one correctly rounded operation
+    if (!truncated && (w >> fmt->max_exact_mantissa_bits) == 0 && q >= -fmt->max_exact_power && q <= fmt->max_exact_power) {
+        if (single) {
+            float f = (float)w;
+            *out_value = (q < 0) ? f / (float)exact_pow10[-q] : f * (float)exact_pow10[q];
+        } else {
+            double d = (double)w;
+            *out_value = (q < 0) ? d / exact_pow10[-q] : d * exact_pow10[q];
+        }
+
+        return true;
+    }
+
+    uint64_t bits;
+    if (!eisel_lemire(fmt, w, q, &bits)) {
+        return false;
+    }
+
+    // Dropped digits are somewhere between w and w + 1
+    if (truncated) {
+        uint64_t upper;
+        if (w == UINT64_MAX || !eisel_lemire(fmt, w + 1, q, &upper) || upper != bits) {
+            return false;
+        }
+    }
+
+    *out_value = single ? (double)bits_to_float(bits) : bits_to_double(bits);
+    return true;
+}
+
+static bool lex_float_hex(uint64_t m, int64_t e, bool truncated, bool single, double* out_value)
+{
+    const float_format_t* fmt = (single ? &g_binary32 : &g_binary64);
+
+    if (m == 0) {
+        *out_value = 0;
+        return true;
+    }
+
+    if (truncated || (m >> fmt->max_exact_mantissa_bits) != 0) {
+        return false;
+    }
+
+    // Move top bit into the implicit bit position
+    int lz = __builtin_clzll(m) - (63 - fmt->mantissa_bits);
+    m <<= lz;
+    int64_t power2 = e - lz + fmt->mantissa_bits + fmt->bias;
+    if (power2 <= 0 || power2 >= fmt->infinite_power) {
+        return false;
+    }
+
+    uint64_t bits = ((uint64_t)power2 << fmt->mantissa_bits) | (m & ((1ull << fmt->mantissa_bits) - 1));
+    *out_value = single ? (double)bits_to_float(bits) : bits_to_double(bits);
+    return true;
+}
+
+// Returns end of the token or NULL if this is not a valid floating constant
+static const char* lex_float(cc_context_t* ctx, const char* p, const char* end, token_t* token)
+{
+    const char* start = p;
+    bool hex = (p + 1 < end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'));
+    unsigned radix = (hex ? 16 : 10);
+
+    if (hex) {
+        p += 2;
+    }
+
+    // Significand is kept as an integer with a power of radix, digits that don't fit are dropped
+    uint64_t w = 0;
+    int64_t exp = 0;
+    unsigned digits = 0;
+    bool truncated = false;
+    bool any = false;
+    bool point = false;
+    unsigned max_digits = (hex ? 16 : FLOAT_MAX_DIGITS);
+
+    for (; p < end; ++p) {
+        if (*p == '.' && !point) {
+            point = true;
+            continue;
+        }
+
+        if (hex ? !lex_ishex(*p) : !(*p >= '0' && *p <= '9')) {
+            break;
+        }
+
+        unsigned d = (hex ? lex_hexval(*p) : (unsigned)(*p - '0'));
+        any = true;
+
+        if (w == 0 && d == 0) {
+            exp -= point;   // Leading zeros only matter after the point
+        } else if (digits < max_digits) {
+            w = w * radix + d;
+            exp -= point;
+            ++digits;
+        } else {
+            truncated |= (d != 0);
+            exp += !point;
+        }
+    }
+
+    if (!any) {
+        return NULL;
+    }
+
+    // Exponent is required for hex constants and makes a decimal one a floating constant without a point
+    bool has_exponent = (p < end && (hex ? (*p == 'p' || *p == 'P') : (*p == 'e' || *p == 'E')));
+    if (hex && !has_exponent) {
+        return NULL;
+    } else if (!point && !has_exponent) {
+        return NULL;
+    }
+
+    int64_t e = 0;
+    if (has_exponent) {
+        ++p;
+        bool negative = false;
+        if (p < end && (*p == '+' || *p == '-')) {
+            negative = (*p++ == '-');
+        }
+
+        if (p >= end || !(*p >= '0' && *p <= '9')) {
+            return NULL;
+        }
+
+        for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+            // Anything this large is zero or infinity anyway
+            if (e < 100000000) {
+                e = e * 10 + (*p - '0');
+            }
+        }
+
+        e = negative ? -e : e;
+    }
+
+    const char* number_end = p;
+
+    floating_literal_type_t flttype = kFloatTypeDouble;
+    if (p < end && (*p == 'f' || *p == 'F')) {
+        flttype = kFloatTypeFloat;
+        ++p;
+    } else if (p < end && (*p == 'l' || *p == 'L')) {
+        flttype = kFloatTypeLongDouble;
+        ++p;
+    }
+
+    if (lex_ident_continues(p, end)) {
+        return NULL;
+    }
+
+    bool single = (flttype == kFloatTypeFloat);
+    double value = 0;
+    bool converted = hex ?
+        lex_float_hex(w, e + exp * 4, truncated, single, &value) :
+        lex_float_decimal(w, e + exp, truncated, single, &value);
+
+    if (!converted && !lex_float_slow(start, number_end, single, &value)) {
+        return NULL;
+    }
+
+    size_t len = number_end - start;
+    string_t str = string_intern(ctx, start, len, strings_hash(start, len));
+    if (!_S(str)) {
+        return NULL;
+    }
+
+    token->type = kTokenFloatConstant;
+    token->value = str;
+    token->flttype = flttype;
+    token->fltval = value;
+    return p;
+}
+
+// Returns end of the token or NULL if this is not a valid integer constant
+static const char* lex_integer(cc_context_t* ctx, const char* p, const char* end, token_t* token)
+{
+    const char* start = p;
+    const char* digits = p;
+    unsigned radix = 10;
+
+    if (*p == '0') {
+        if (p + 1 < end && (p[1] == 'x' || p[1] == 'X')) {
+            radix = 16;
+            digits = p + 2;
+        } else {
+            // Leading 0 is an octal digit too
+            radix = 8;
+        }
+    }
+
+    uint64_t value = 0;
+    p = lex_digits(digits, end, radix, &value);
+    if (!p) {
+        // Too large for an integer, could still be a floating constant
+        return lex_float(ctx, start, end, token);
+    }
+
+    // Digits followed by a point, an exponent or decimal digits that are not octal make a floating constant
+    if (p < end && (*p == '.' ||
+                    (radix == 16 && (*p == 'p' || *p == 'P')) ||
+                    (radix != 16 && (*p == 'e' || *p == 'E' || *p == '8' || *p == '9')))) {
+        return lex_float(ctx, start, end, token);
+    }
+
+    if (p == digits) {
+        return NULL;
+    }
+
+    size_t len = p - start;
+
+    // Suffixes: u, ul, ull, l, ll in any case combination
+    integer_literal_type_t inttype = kIntegerDefaultType;
+    if (p < end && (*p == 'u' || *p == 'U')) {
+        ++p;
+        inttype = kIntegerTypeUnsigned;
+        if (p < end && (*p == 'l' || *p == 'L')) {
+            ++p;
+            inttype = kIntegerTypeUnsignedLong;
+            if (p < end && (*p == 'l' || *p == 'L')) {
+                ++p;
+                inttype = kIntegerTypeUnsignedLongLong;
+            }
+        }
+    } else if (p < end && (*p == 'l' || *p == 'L')) {
+        ++p;
+        inttype = kIntegerTypeLong;
+        if (p < end && (*p == 'l' || *p == 'L')) {
+            ++p;
+            inttype = kIntegerTypeLongLong;
+        }
+    }
+
+    // Constant should not run into an identifier or another number (this also rejects 8 and 9 in octal)
+    if (lex_ident_continues(p, end)) {
+        return NULL;
+    }
+
+    string_t str = string_intern(ctx, start, len, strings_hash(start, len));
+    if (!_S(str)) {
+        return NULL;
+    }
+
+    token->type = kTokenIntConstant;
+    token->value = str;
+    token->inttype = integer_literal_type(value, inttype, radix == 10);
+    token->intval = value;
+    return p;
+}
+
+// End of the preprocessing number starting at 'p', which is a digit or a point followed by one (C11 6.4.8)
+static const char* lex_pp_number_end(const char* p, const char* end)
+{
+    for (++p; p < end; ++p) {
+        bool sign = ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E' || p[-1] == 'p' || p[-1] == 'P'));
+        if (!sign && *p != '.' && !lex_ident_continues(p, end)) {
+            break;
+        }
+    }
+
+    return p;
+}
+
+// Preprocessing number that is not a valid constant, it is only kept as it is spelled
+static const char* lex_pp_number(cc_context_t* ctx, const char* p, const char* end, token_t* token)
+{
+    string_t str = string_intern(ctx, p, end - p, strings_hash(p, end - p));
+    if (!_S(str)) {
+        return NULL;
+    }
+
+    token->type = kTokenNumber;
+    token->value = str;
+    token->intval = 0;
+    return end;
+}
+
+int init_scanner(cc_context_t* ctx)
+{
+    if (!ctx) {
+        return EINVAL;
+    }
+
+    charscan_init();
+
+    // Add all keywords and operators to string table for faster comparison
+    for (size_t i = 0; i < countof(g_keywords); ++i) {
+        ctx->keywords[i] = string(ctx, g_keywords[i]);
+        if (!_S(ctx->keywords[i])) {
+            return ENOMEM;
+        }
+
+        string_info(ctx->keywords[i])->keyword = i + 1;
+    }
+
+    for (size_t i = 0; i < countof(g_operators); ++i) {
+        ctx->operators[i] = string(ctx, g_operators[i]);
+        if (!_S(ctx->operators[i])) {
+            return ENOMEM;
+        }
+    }
+
+//    for (size_t i = 0; i < countof(g_all_regex); ++i)
+//    {
+//        regex_t* re = g_all_regex[i];
+//
+//        const char* error_str = NULL;
+//        int error_offset = 0;
+//        re->re = pcre_compile(re->spec, PCRE_CASELESS, &error_str, &error_offset, NULL);
+//        if (!re->re) {
+//            return -1;
+//        }
+//
+//        // It's ok if study turns out to be NULL
+//        re->study = pcre_study(re->re, 0, &error_str);
+//        if (error_str) {
+//            pcre_free(re->re);
+//            return -1;
+//        }
+//    }
+
+    return 0;
+}
+
+// Skip whitespace and comments, adding kTokenFlagLeadingSpace and kTokenFlagLineStart to '*flags'.
+// Returns start of the next token, 'end' or NULL if input ends inside a block comment.
+static const char* lex_skip(const char* p, const char* end, uint16_t* flags)
+{
+    for (;;) {
+        if (p < end && g_lex_dispatch[(uint8_t)*p] == kLexSpace) {
+            const char* q = charscan_skip_space(p + 1, end);
+            if (!(*flags & kTokenFlagLineStart) && (*p == '\n' || charscan_find_char(p + 1, q, '\n') < q)) {
+                *flags |= kTokenFlagLineStart;
+            }
+
+            *flags |= kTokenFlagLeadingSpace;
+            p = q;
+        }
+
+        if (end - p < 2 || p[0] != '/') {
+            return p;
+        }
+
+        if (p[1] == '/') {
+            *flags |= kTokenFlagLeadingSpace;
+            p = charscan_find_char(p + 2, end, '\n');
+        } else if (p[1] == '*') {
+            *flags |= kTokenFlagLeadingSpace;
+            // Look for '/' preceded by a '*' that is not the one opening the comment
+            const char* q = p + 2;
+            for (;;) {
+                q = charscan_find_char(q, end, '/');
+                if (q == end) {
+                    return NULL;
+                }
+
+                if (q - p >= 3 && q[-1] == '*') {
+                    break;
+                }
+
+                ++q;
+            }
+            p = q + 1;
+        } else {
+            return p;
+        }
+    }
+}
+
+// Flags of a token that is lexed starting at 'p' before anything is skipped
+static inline uint16_t lex_initial_flags(const char* begin, const char* p)
+{
+    return (p == begin || p[-1] == '\n') ? kTokenFlagLineStart : 0;
+}
+
+// Lex next token at *pp, 'flags' are the initial token flags.
+// On success *pp is moved past the token and *out_start points to the token start.
+// On failure *pp is left at the offending character, or at the end for unterminated comments.
+// With 'pp_numbers' numbers are lexed the way the preprocessor sees them, see @parse_next_pp_token.
+static inline int lex_next(cc_context_t* ctx, const char** pp, const char* end, uint16_t flags, token_t* token, const char** out_start,
+                           bool pp_numbers)
+{
+    const char* p = lex_skip(*pp, end, &flags);
+    if (!p) {
+        // Unterminated comment
+        *pp = end;
+        return EILSEQ;
+    }
+
+    *pp = p;
+    if (p >= end) {
+        return -1;
+    }
+
+    const char* next = NULL;
+    switch (g_lex_dispatch[(uint8_t)*p]) {
+    case kLexIdentifier:
+        next = lex_word(ctx, p, end, token);
+        break;
+
+    case kLexOperator:
+        next = lex_operator(ctx, p, end, token);
+        break;
+
+    case kLexNumber:
+        if (*p != '.') {
+            next = lex_integer(ctx, p, end, token);
+        } else if (p + 1 < end && p[1] >= '0' && p[1] <= '9') {
+            next = lex_float(ctx, p, end, token);
+        } else {
+            next = lex_operator(ctx, p, end, token);
+            break;
+        }
+
+        if (pp_numbers) {
+            const char* q = lex_pp_number_end(p, end);
+            if (next != q) {
+                next = lex_pp_number(ctx, p, q, token);
+            }
+        }
+        break;
+
+    case kLexPunctuator:
+        next = lex_punctuator(ctx, p, token);
+        break;
+
+    case kLexLiteral:
+        next = lex_literal(ctx, p, end, kEncodingDefault, token);
+        break;
+
+    default:
+        break;
+    };
+
+    if (!next) {
+        return EILSEQ;
+    }
+
+    token->flags = flags;
+    *out_start = p;
+    *pp = next;
+    return 0;
+}
+
+static int parse_token(cc_context_t* ctx, input_buffer_t* in, token_t* out_token, bool pp_numbers)
+{
+    if (!ctx || !in) {
+        return EINVAL;
+    }
+
+    if (!out_token) {
+        return EINVAL;
+    }
+
+    uint32_t base = 0;
+    int error = buffer_get_base(in, &base);
+    if (error) {
+        return error;
+    }
+
+    const char* begin = buffer_get_data(in);
+    const char* end = begin + buffer_get_size(in);
+    const char* p = begin + buffer_get_offset(in);
+    const char* start = NULL;
+
+    error = lex_next(ctx, &p, end, lex_initial_flags(begin, p), out_token, &start, pp_numbers);
+    if (!error) {
+        out_token->loc = base + (start - begin);
+        out_token->size = (uint32_t)(p - start);
+    }
+
+    buffer_set_offset(in, p - begin);
+    return error;
+}
+
+int parse_next_token(cc_context_t* ctx, input_buffer_t* in, token_t* out_token)
+{
+    return parse_token(ctx, in, out_token, false);
+}
+
+int parse_next_pp_token(cc_context_t* ctx, input_buffer_t* in, token_t* out_token)
+{
+    return parse_token(ctx, in, out_token, true);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+_Static_assert(sizeof(packed_token_t) == 16, "Packed token should stay 16 bytes");
+_Static_assert(sizeof(token_t) <= 40, "Unpacked token should not grow past 40 bytes");
+
+int token_stream_init(token_stream_t* ts)
+{
+    if (!ts) {
+        return EINVAL;
+    }
+
+    memset(ts, 0, sizeof(*ts));
+    return 0;
+}
+
+static int token_stream_reserve(token_stream_t* ts, size_t capacity)
+{
+    if (capacity <= ts->capacity) {
+        return 0;
+    }
+
+    if (capacity > SIZE_MAX / 2 / sizeof(*ts->tokens)) {
+        return ENOMEM;
+    }
+
+    size_t newcap = (ts->capacity ? ts->capacity * 2 : 256);
+    while (newcap < capacity) {
+        newcap *= 2;
+    }
+
+    packed_token_t* tokens = realloc(ts->tokens, newcap * sizeof(*ts->tokens));
+    if (!tokens) {
+        return ENOMEM;
+    }
+
+    ts->tokens = tokens;
+    ts->capacity = newcap;
+    return 0;
+}
+
+// Make room for 'count' more values, value indices have to fit into 32 bits
+static int token_stream_reserve_values(token_stream_t* ts, size_t count)
+{
+    // Index 0 means no value, entry is there but never used
+    bool empty = (ts->value_count == 0);
+    size_t capacity = (empty ? 1 : ts->value_count) + count;
+    if (capacity > UINT32_MAX) {
+        return EFBIG;
+    }
+
+    if (capacity > ts->value_capacity) {
+        size_t newcap = (ts->value_capacity ? ts->value_capacity * 2 : 256);
+        while (newcap < capacity) {
+            newcap *= 2;
+        }
+
+        token_value_t* values = realloc(ts->values, newcap * sizeof(*ts->values));
+        if (!values) {
+            return ENOMEM;
+        }
+
+        ts->values = values;
+        ts->value_capacity = newcap;
+    }
+
+    if (empty) {
+        ts->values[0].intval = 0;
+        ts->value_count = 1;
+    }
+
+    return 0;
+}
+
+static inline int token_stream_store(token_stream_t* ts, size_t i, const token_t* token, uint32_t loc, uint32_t length)
+{
+    packed_token_t* t = &ts->tokens[i];
+    t->type = token->type;
+    t->subkind = (token->type == kTokenKeyword ? token->keyword :
+                  token->type == kTokenOperator ? token->op :
+                  token->type == kTokenIntConstant ? token->inttype :
+                  token->type == kTokenFloatConstant ? token->flttype :
+                  token->type == kTokenStrConstant || token->type == kTokenCharConstant ? token->encoding : 0);
+    t->flags = token->flags;
+    t->loc = loc;
+    t->length = length;
+    t->value = 0;
+
+    // Literals without escapes are read straight from the source
+    size_t count = (token->type == kTokenKeyword || token->type == kTokenOperator ? 0 :
+                    token->type == kTokenStrConstant ? (_S(token->value) ? 2 : 0) : 1);
+    if (!count) {
+        return 0;
+    }
+
+    int error = token_stream_reserve_values(ts, count);
+    if (error) {
+        return error;
+    }
+
+    token_value_t* v = ts->values + ts->value_count;
+    if (token->type == kTokenIdentifier) {
+        v[0].str = token->value;
+    } else if (token->type == kTokenStrConstant) {
+        v[0].str = token->value;
+        v[1].intval = token->length;
+    } else {
+        // Floating constant value is kept as is, same bits as intval
+        v[0].intval = token->intval;
+    }
+
+    t->value = (uint32_t)ts->value_count;
+    ts->value_count += count;
+    return 0;
+}
+
+int token_stream_append(token_stream_t* ts, const token_stream_t* from, size_t first, size_t count)
+{
+    // Empty streams may have no arrays at all
+    if (count == 0) {
+        return 0;
+    }
+
+    int error = token_stream_reserve(ts, ts->count + count);
+    if (error) {
+        return error;
+    }
+
+    const packed_token_t* src = from->tokens + first;
+    size_t values = 0;
+    for (size_t i = 0; i < count; ++i) {
+        values += packed_token_values(&src[i]);
+    }
+
+    if (values) {
+        error = token_stream_reserve_values(ts, values);
+        if (error) {
+            return error;
+        }
+    }
+
+    packed_token_t* dst = ts->tokens + ts->count;
+    memcpy(dst, src, count * sizeof(*dst));
+
+    // Values are copied in token order, so they may end up closer together than in the source stream
+    if (values) {
+        for (size_t i = 0; i < count; ++i) {
+            size_t n = packed_token_values(&dst[i]);
+            if (n) {
+                memcpy(ts->values + ts->value_count, from->values + dst[i].value, n * sizeof(*ts->values));
+                dst[i].value = (uint32_t)ts->value_count;
+                ts->value_count += n;
+            }
+        }
+    }
+
+    ts->count += count;
+    return 0;
+}
+
+const char* token_stream_literal(const token_stream_t* ts, size_t i, size_t* len)
+{
+    const packed_token_t* t = &ts->tokens[i];
+    if (t->value) {
+        *len = ts->values[t->value + 1].intval;
+        return _S(ts->values[t->value].str);
+    }
+
+    // Span of the source, skip prefix and quotes
+    size_t prefix = (t->subkind == kEncodingDefault ? 0 : t->subkind == kEncodingUtf8 ? 2 : 1);
+    *len = t->length - prefix - 2;
+
+    uint32_t base = 0;
+    const char* data = srcmgr_source(t->loc, &base);
+    return data ? data + (t->loc - base) + prefix + 1 : NULL;
+}
+
+void token_stream_get(cc_context_t* ctx, const token_stream_t* ts, size_t i, token_t* out)
+{
+    const packed_token_t* t = &ts->tokens[i];
+    const token_value_t* v = (t->value ? &ts->values[t->value] : NULL);
+
+    memset(out, 0, sizeof(*out));
+    out->type = t->type;
+    out->flags = t->flags;
+    out->loc = t->loc;
+    out->size = t->length;
+
+    switch (t->type) {
+    case kTokenKeyword:
+        out->keyword = t->subkind;
+        out->value = ctx->keywords[t->subkind];
+        break;
+
+    case kTokenOperator:
+        out->op = t->subkind;
+        out->value = ctx->operators[t->subkind];
+        break;
+
+    case kTokenIdentifier:
+        out->value = v->str;
+        break;
+
+    case kTokenIntConstant:
+        out->inttype = t->subkind;
+        out->intval = v->intval;
+        break;
+
+    case kTokenFloatConstant:
+        out->flttype = t->subkind;
+        out->fltval = v->fltval;
+        break;
+
+    case kTokenCharConstant:
+        out->encoding = t->subkind;
+        out->intval = v->intval;
+        break;
+
+    case kTokenStrConstant: {
+        size_t len = 0;
+        out->encoding = t->subkind;
+        out->value = (v ? v->str : _MAKESTR(NULL));
+        out->literal = token_stream_literal(ts, i, &len);
+        out->length = len;
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+void token_stream_destroy(token_stream_t* ts)
+{
+    if (ts) {
+        free(ts->tokens);
+        free(ts->values);
+        memset(ts, 0, sizeof(*ts));
+    }
+}
+
+int lex_batch(cc_context_t* ctx, input_buffer_t* in, token_stream_t* out, size_t max)
+{
+    if (!ctx || !in || !out) {
+        return EINVAL;
+    }
+
+    const char* begin = buffer_get_data(in);
+    const char* end = begin + buffer_get_size(in);
+    const char* p = begin + buffer_get_offset(in);
+
+    if ((size_t)(end - begin) > UINT32_MAX) {
+        return EFBIG;
+    }
+
+    uint32_t base = 0;
+    int error = buffer_get_base(in, &base);
+    if (error) {
+        return error;
+    }
+
+    // Reserve for a typical token density only, 'max' is often just an upper bound and the stream grows as needed
+    size_t guess = (size_t)(end - p) / 4 + 1;
+    error = token_stream_reserve(out, out->count + (max < guess ? max : guess));
+    if (error) {
+        return error;
+    }
+
+    size_t count = out->count;
+    size_t last = (max > SIZE_MAX - count ? SIZE_MAX : count + max);
+    uint16_t flags = lex_initial_flags(begin, p);
+    while (count < last) {
+        if (count == out->capacity) {
+            error = token_stream_reserve(out, count + 1);
+            if (error) {
+                break;
+            }
+        }
+
+        token_t token;
+        const char* start = NULL;
+        const char* next = p;
+
+        error = lex_next(ctx, &next, end, flags, &token, &start, false);
+        if (error) {
+            p = next;
+            break;
+        }
+
+        // Out of memory leaves the position at the token that was not stored
+        error = token_stream_store(out, count, &token, base + (start - begin), next - start);
+        if (error) {
+            break;
+        }
+
+        ++count;
+        p = next;
+        flags = 0;
+    }
+
+    // Running out of input is fine as long as we've got something
+    if (error == -1 && count > out->count) {
+        error = 0;
+    }
+
+    out->count = count;
+    buffer_set_offset(in, p - begin);
+    return error;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Parallel lexing.
+ * Buffer is split into chunks at line starts and every chunk is lexed on its own thread, assuming
+ * that it does not start inside a comment or a token. Assumptions are then checked in order:
+ * lexer has no state between tokens, so a chunk is correct from the first token that starts exactly where
+ * the previous chunk left off. Chunks that have no such token are lexed again from that point.
+ */
+
+#define LEX_PARALLEL_MIN_CHUNK  (64 * 1024)
+#define LEX_PARALLEL_MAX_CHUNKS 64
+
+typedef struct
+{
+    cc_context_t* ctx;
+    const char* begin;      // Whole buffer
+    const char* end;
+    uint32_t base;          // Global offset of 'begin'
+    const char* from;       // Chunk
+    const char* until;
+    uint16_t flags;         // Initial flags of the first token
+    token_stream_t tokens;  // Tokens that start before 'until'
+    const char* stop;       // Where the token following the chunk starts, or where the error is
+    uint16_t stop_flags;    // Flags of the token at 'stop'
+    int error;
+} lex_chunk_t;
+
+static void lex_chunk(lex_chunk_t* c)
+{
+    const char* p = c->from;
+    uint16_t flags = c->flags;
+
+    c->tokens.count = 0;
+    c->stop_flags = 0;
+    c->error = 0;
+
+    for (;;) {
+        if (c->tokens.count == c->tokens.capacity) {
+            c->error = token_stream_reserve(&c->tokens, c->tokens.count + 1);
+            if (c->error) {
+                c->stop = p;
+                return;
+            }
+        }
+
+        token_t token;
+        const char* start = NULL;
+        const char* next = p;
+
+        int error = lex_next(c->ctx, &next, c->end, flags, &token, &start, false);
+        if (error == -1) {
+            c->stop = c->end;
+            return;
+        } else if (error) {
+            c->stop = next;
+            c->error = error;
+            return;
+        } else if (start >= c->until) {
+            c->stop = start;
+            c->stop_flags = token.flags;
+            return;
+        }
+
+        c->error = token_stream_store(&c->tokens, c->tokens.count, &token, c->base + (start - c->begin), next - start);
+        if (c->error) {
+            c->stop = p;
+            return;
+        }
+
+        ++c->tokens.count;
+        p = next;
+        flags = 0;
+    }
+}
+
+static void* lex_chunk_worker(void* arg)
+{
+    lex_chunk((lex_chunk_t*)arg);
+    return NULL;
+}
+
+// Index of the token starting at 'p' or -1
+static ssize_t lex_chunk_find(const lex_chunk_t* c, const char* p)
+{
+    uint32_t loc = c->base + (p - c->begin);
+    size_t lo = 0;
+    size_t hi = c->tokens.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->tokens.tokens[mid].loc < loc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (lo < c->tokens.count && c->tokens.tokens[lo].loc == loc) ? (ssize_t)lo : -1;
+}
+
+static int lex_parallel_chunks(cc_context_t* ctx, input_buffer_t* in, token_stream_t* out, size_t nchunks)
+{
+    const char* begin = buffer_get_data(in);
+    const char* end = begin + buffer_get_size(in);
+    const char* p = begin + buffer_get_offset(in);
+
+    if ((size_t)(end - begin) > UINT32_MAX) {
+        return EFBIG;
+    }
+
+    if (p >= end) {
+        return 0;
+    }
+
+    uint32_t base = 0;
+    int error = buffer_get_base(in, &base);
+    if (error) {
+        return error;
+    }
+
+    if (nchunks > LEX_PARALLEL_MAX_CHUNKS) {
+        nchunks = LEX_PARALLEL_MAX_CHUNKS;
+    }
+
+    lex_chunk_t chunks[LEX_PARALLEL_MAX_CHUNKS];
+    pthread_t threads[LEX_PARALLEL_MAX_CHUNKS];
+    bool started[LEX_PARALLEL_MAX_CHUNKS] = {false};
+
+    // Split points are line starts
+    size_t total = 0;
+    size_t step = (end - p) / (nchunks ? nchunks : 1);
+    const char* from = p;
+    while (from < end && total < nchunks) {
+        const char* until = end;
+        if (total + 1 < nchunks) {
+            until = charscan_find_char(from + (step ? step : 1), end, '\n');
+            until = (until < end ? until + 1 : end);
+        }
+
+        lex_chunk_t* c = &chunks[total++];
+        c->ctx = ctx;
+        c->begin = begin;
+        c->end = end;
+        c->base = base;
+        c->from = from;
+        c->until = until;
+        // Split points follow a newline, which counts as leading space unless the guess is wrong
+        c->flags = lex_initial_flags(begin, from) | (total > 1 ? kTokenFlagLeadingSpace : 0);
+        token_stream_init(&c->tokens);
+
+        from = until;
+    }
+
+    // First chunk is ours
+    for (size_t i = 1; i < total; ++i) {
+        started[i] = (0 == pthread_create(&threads[i], NULL, lex_chunk_worker, &chunks[i]));
+        if (!started[i]) {
+            lex_chunk(&chunks[i]);
+        }
+    }
+
+    lex_chunk(&chunks[0]);
+
+    for (size_t i = 1; i < total; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    // Validate and stitch. Placement flags of the token at the sync point were found by the chunk
+    // that lexed the text preceding it. First chunk starts where a sequential lexer would, its flags are right.
+    const char* sync = p;
+    uint16_t sync_flags = 0;
+    for (size_t i = 0; i < total; ++i) {
+        lex_chunk_t* c = &chunks[i];
+
+        ssize_t first = 0;
+        if (sync != c->from) {
+            first = lex_chunk_find(c, sync);
+            if (first < 0) {
+                // Bad guess, chunk starts inside a comment or another token crosses into it
+                c->from = sync;
+                c->flags = sync_flags;
+                lex_chunk(c);
+                first = 0;
+            }
+        }
+
+        if (i > 0 && first < (ssize_t)c->tokens.count) {
+            c->tokens.tokens[first].flags = sync_flags;
+        }
+
+        error = token_stream_append(out, &c->tokens, first, c->tokens.count - first);
+        if (error) {
+            sync = begin + (c->tokens.count ? c->tokens.tokens[first].loc - base : 0);
+            break;
+        }
+
+        sync = c->stop;
+        sync_flags = c->stop_flags;
+        error = c->error;
+        if (error) {
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < total; ++i) {
+        token_stream_destroy(&chunks[i].tokens);
+    }
+
+    buffer_set_offset(in, sync - begin);
+    return error;
+}
+
+int lex_parallel(cc_context_t* ctx, input_buffer_t* in, token_stream_t* out, unsigned threads)
+{
+    if (!ctx || !in || !out) {
+        return EINVAL;
+    }
+
+    size_t size = buffer_get_size(in) - buffer_get_offset(in);
+    size_t nchunks = size / LEX_PARALLEL_MIN_CHUNK;
+    if (nchunks > threads) {
+        nchunks = threads;
+    }
+
+    return lex_parallel_chunks(ctx, in, out, nchunks ? nchunks : 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Incremental lexing.
+ * Tokens that end before the edit are kept and tokens after it are shifted. Lexing restarts one token
+ * before the edit, since that token may grow into the edited text, and goes on until it produces a token
+ * starting where some old token started in the unchanged text after the edit. Lexer has no state between
+ * tokens, so everything from that token on would come out the same.
+ */
+
+// Index of the first token that ends at or after 'loc'
+static size_t token_stream_lower_end(const token_stream_t* ts, uint32_t loc)
+{
+    size_t lo = 0;
+    size_t hi = ts->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((size_t)ts->tokens[mid].loc + ts->tokens[mid].length < loc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Drop values no token refers to any more, once there are more of them than live ones.
+// Values keep the order of their tokens. Stream is left as it is if there is no memory for a smaller table.
+static void token_stream_compact_values(token_stream_t* ts)
+{
+    size_t live = 0;
+    for (size_t i = 0; i < ts->count; ++i) {
+        live += packed_token_values(&ts->tokens[i]);
+    }
+
+    if (ts->value_count <= 1 || ts->value_count - 1 - live <= live) {
+        return;
+    }
+
+    size_t newcap = 256;
+    while (newcap < live + 1) {
+        newcap *= 2;
+    }
+
+    token_value_t* values = malloc(newcap * sizeof(*values));
+    if (!values) {
+        return;
+    }
+
+    size_t next = 1;
+    values[0] = ts->values[0];
+    for (size_t i = 0; i < ts->count; ++i) {
+        packed_token_t* t = &ts->tokens[i];
+        size_t count = packed_token_values(t);
+        if (count) {
+            memcpy(values + next, ts->values + t->value, count * sizeof(*values));
+            t->value = (uint32_t)next;
+            next += count;
+        }
+    }
+
+    free(ts->values);
+    ts->values = values;
+    ts->value_count = next;
+    ts->value_capacity = newcap;
+}
+
+int lex_edit(cc_context_t* ctx, token_stream_t* ts, input_buffer_t* in, size_t offset, size_t removed, size_t inserted)
+{
+    if (!ctx || !ts || !in) {
+        return EINVAL;
+    }
+
+    const char* begin = buffer_get_data(in);
+    const char* end = begin + buffer_get_size(in);
+
+    if ((size_t)(end - begin) > UINT32_MAX) {
+        return EFBIG;
+    }
+
+    uint32_t base = 0;
+    int error = buffer_get_base(in, &base);
+    if (error) {
+        return error;
+    }
+
+    // Old tokens are matched against the old source
+    uint32_t old_base = base;
+    if (ts->count && !srcmgr_source(ts->tokens[0].loc, &old_base)) {
+        return EINVAL;
+    }
+
+    // Edit is described in original text, so spliced text is simply lexed again from the start
+    bool spliced = srcmgr_is_spliced(base) || (ts->count && srcmgr_is_spliced(old_base));
+    if (!spliced && offset + inserted > (size_t)(end - begin)) {
+        return EINVAL;
+    }
+
+    size_t first = (spliced ? 0 : token_stream_lower_end(ts, old_base + offset));
+    if (first > 0) {
+        --first;
+    }
+
+    const char* p = (first > 0 ? begin + (ts->tokens[first].loc - old_base) : begin);
+    uint16_t flags = (first > 0 ? ts->tokens[first].flags : lex_initial_flags(begin, p));
+
+    size_t edit_end = offset + inserted;
+    size_t sync = first;
+
+    token_stream_t relexed;
+    token_stream_init(&relexed);
+
+    for (;;) {
+        token_t token;
+        const char* start = NULL;
+        const char* next = p;
+
+        error = lex_next(ctx, &next, end, flags, &token, &start, false);
+        if (error == -1) {
+            error = 0;
+            sync = ts->count;
+            p = next;
+            break;
+        } else if (error) {
+            sync = ts->count;
+            p = next;
+            break;
+        }
+
+        size_t pos = start - begin;
+        if (!spliced && pos >= edit_end) {
+            // Old tokens are matched in old coordinates
+            uint32_t old_loc = old_base + (pos - inserted + removed);
+            while (sync < ts->count && ts->tokens[sync].loc < old_loc) {
+                ++sync;
+            }
+
+            if (sync < ts->count && ts->tokens[sync].loc == old_loc) {
+                // Whitespace in front of it could have changed
+                ts->tokens[sync].flags = token.flags;
+                p = end;
+                break;
+            }
+        }
+
+        int store_error = token_stream_reserve(&relexed, relexed.count + 1);
+        if (!store_error) {
+            store_error = token_stream_store(&relexed, relexed.count, &token, base + pos, next - start);
+        }
+
+        if (store_error) {
+            token_stream_destroy(&relexed);
+            return store_error;
+        }
+
+        ++relexed.count;
+        p = next;
+        flags = 0;
+    }
+
+    // Splice: [0, first) + relexed + shifted [sync, count)
+    size_t tail = ts->count - sync;
+    size_t count = first + relexed.count + tail;
+
+    int reserve_error = token_stream_reserve(ts, count);
+    if (!reserve_error) {
+        reserve_error = token_stream_reserve_values(ts, relexed.value_count);
+    }
+
+    if (reserve_error) {
+        token_stream_destroy(&relexed);
+        return reserve_error;
+    }
+
+    size_t dst = first + relexed.count;
+    memmove(ts->tokens + dst, ts->tokens + sync, tail * sizeof(*ts->tokens));
+
+    if (base != old_base) {
+        for (size_t i = 0; i < first; ++i) {
+            ts->tokens[i].loc = ts->tokens[i].loc - old_base + base;
+        }
+    }
+
+    for (size_t i = dst; i < count; ++i) {
+        ts->tokens[i].loc = ts->tokens[i].loc - old_base + base - removed + inserted;
+    }
+
+    // Can't fail, capacity is already there
+    ts->count = first;
+    (void) token_stream_append(ts, &relexed, 0, relexed.count);
+    ts->count = count;
+
+    // Values of the replaced tokens are left behind in the table, an editor relexes on every keystroke
+    token_stream_compact_values(ts);
+
+    token_stream_destroy(&relexed);
+    buffer_set_offset(in, p - begin);
+    return error;
+}
+
+#if defined(TEST)
+
+// Same tokens with the same values, locations are compared relative to the buffers streams were lexed from
+static bool token_streams_match(cc_context_t* ctx, const token_stream_t* a, input_buffer_t* ib_a, const token_stream_t* b, input_buffer_t* ib_b)
+{
+    uint32_t base_a = 0;
+    uint32_t base_b = 0;
+    if (a->count != b->count || buffer_get_base(ib_a, &base_a) || buffer_get_base(ib_b, &base_b)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < a->count; ++i) {
+        const packed_token_t* ta = &a->tokens[i];
+        const packed_token_t* tb = &b->tokens[i];
+        if (ta->type != tb->type || ta->subkind != tb->subkind || ta->flags != tb->flags ||
+            ta->length != tb->length || ta->loc - base_a != tb->loc - base_b)
+        {
+            return false;
+        }
+
+        token_t x;
+        token_t y;
+        token_stream_get(ctx, a, i, &x);
+        token_stream_get(ctx, b, i, &y);
+        if (_S(x.value) != _S(y.value) || x.intval != y.intval || x.literal != y.literal) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Lex the same input with the lexer and reference matchers and compare the results
+static bool lexer_matches_reference(cc_context_t* ctx, const char* str)
+{
+    input_buffer_t* ib1 = buffer_mem((void*)str, strlen(str));
+    input_buffer_t* ib2 = buffer_mem((void*)str, strlen(str));
+    bool match = true;
+
+    for (;;) {
+        token_t t1 = {0};
+        token_t t2 = {0};
+        int e1 = parse_next_token(ctx, ib1, &t1);
+        int e2 = reference_next_token(ctx, ib2, &t2);
+
+        if (e1 != e2) {
+            match = false;
+            break;
+        }
+
+        if (e1 != 0) {
+            break;
+        }
+
+        if (t1.type != t2.type || _S(t1.value) != _S(t2.value)) {
+            match = false;
+            break;
+        }
+
+        if ((t1.type == kTokenKeyword && t1.keyword != t2.keyword) ||
+            (t1.type == kTokenOperator && t1.op != t2.op) ||
+            (t1.type == kTokenIntConstant && (t1.inttype != t2.inttype || t1.intval != t2.intval))) {
+            match = false;
+            break;
+        }
+    }
+
+    if (!match) {
+        printf("\n  lexer differs from reference on '%s'\n", str);
+    }
+
+    buffer_close(ib1);
+    buffer_close(ib2);
+    return match;
+}
+
+static void test_lexer_differential(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    const char* words[countof(g_keywords) + countof(g_operators) + 16] = {
+        "integer", "_good", "good", "_123good", "_", "doubles", "x",
+        "0", "12", "0xdeadf00d", "0Xbaba17ba", "01234567", "10ul", "0ULL", "7l", "42LL",
+    };
+
+    size_t total = 16;
+    for (size_t i = 0; i < countof(g_keywords); ++i) {
+        words[total++] = g_keywords[i];
+    }
+
+    for (size_t i = 0; i < countof(g_operators); ++i) {
+        words[total++] = g_operators[i];
+    }
+
+    // Reference matchers only consume a single whitespace after a token
+    const char* separators[] = { " ", "\n", "\t", "\r" };
+
+    for (size_t i = 0; i < total; ++i) {
+        CU_ASSERT_TRUE(lexer_matches_reference(ctx, words[i]));
+    }
+
+    // Random streams of whitespace separated tokens
+    srand(42);
+    for (int n = 0; n < 100; ++n) {
+        char buf[4096] = {0};
+        size_t len = 0;
+        for (int i = 0; i < 64; ++i) {
+            const char* w = words[rand() % total];
+            const char* sep = separators[rand() % countof(separators)];
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%s", w, sep);
+        }
+
+        CU_ASSERT_TRUE(lexer_matches_reference(ctx, buf));
+    }
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lexer_differential);
+
+static void test_lexer(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    // Tokens do not need whitespace between them
+    const char* str = "  x+=0x1fu;@";
+    input_buffer_t* ib = buffer_mem((void*)str, strlen(str));
+    token_t token;
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIdentifier);
+    CU_ASSERT_EQUAL(_S(token.value), _S(string(ctx, "x")));
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenOperator);
+    CU_ASSERT_EQUAL(_S(token.value), _S(string(ctx, "+=")));
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIntConstant);
+    CU_ASSERT_EQUAL(token.inttype, kIntegerTypeUnsigned);
+    CU_ASSERT_EQUAL(_S(token.value), _S(string(ctx, "0x1f")));
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.op, kOperatorSemicolon);
+
+    CU_ASSERT_EQUAL(EILSEQ, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(buffer_get_offset(ib), strlen(str) - 1);
+
+    buffer_close(ib);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lexer);
+
+static void test_lexer_comments(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    const char* str =
+        "/*\n"
+        " * License header\n"
+        " */\n"
+        "a /**/ b/*/ c */ / // line comment\n"
+        "  \t\v\f\r\n  /***/c//\n"
+        "/*/ tail";
+
+    input_buffer_t* ib = buffer_mem((void*)str, strlen(str));
+    token_t token;
+
+    const char* expected[] = { "a", "b", "/", "c" };
+    uint16_t flags[] = {
+        kTokenFlagLineStart | kTokenFlagLeadingSpace, kTokenFlagLeadingSpace,
+        kTokenFlagLeadingSpace, kTokenFlagLineStart | kTokenFlagLeadingSpace,
+    };
+
+    for (size_t i = 0; i < countof(expected); ++i) {
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(_S(token.value), _S(string(ctx, expected[i])));
+        CU_ASSERT_EQUAL(token.flags, flags[i]);
+    }
+
+    CU_ASSERT_EQUAL(EILSEQ, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_TRUE(buffer_iseof(ib));
+
+    buffer_close(ib);
+
+    // Newlines in block comments do not start a line, start of input does
+    str = "a/*\n*/b\nc d/**/e";
+    ib = buffer_mem((void*)str, strlen(str));
+
+    uint16_t placement[] = {
+        kTokenFlagLineStart, kTokenFlagLeadingSpace, kTokenFlagLineStart | kTokenFlagLeadingSpace,
+        kTokenFlagLeadingSpace, kTokenFlagLeadingSpace,
+    };
+
+    for (size_t i = 0; i < countof(placement); ++i) {
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.flags, placement[i]);
+        CU_ASSERT_EQUAL(token.size, 1);
+        CU_ASSERT_EQUAL(srcmgr_source(token.loc, NULL), buffer_get_data(ib));
+    }
+
+    buffer_close(ib);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lexer_comments);
+
+static void test_lexer_kinds(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    for (size_t i = 0; i < countof(g_keywords); ++i) {
+        const char* str = g_keywords[i];
+        CU_ASSERT_EQUAL(lex_keyword_kind(str, strlen(str), strings_hash(str, strlen(str))), (keyword_kind_t)i);
+
+        // Prefixes and extensions of keywords are identifiers
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%s_", str);
+        CU_ASSERT_EQUAL(lex_keyword_kind(buf, strlen(buf), strings_hash(buf, strlen(buf))), kKeywordTotal);
+        CU_ASSERT_EQUAL(lex_keyword_kind(str, strlen(str) - 1, strings_hash(str, strlen(str) - 1)), kKeywordTotal);
+
+        // Keyword kind is also kept with the stored string
+        CU_ASSERT_EQUAL(string_keyword(string(ctx, str)), (keyword_kind_t)i);
+        CU_ASSERT_EQUAL(string_keyword(string(ctx, buf)), kKeywordTotal);
+    }
+
+    const char* str = "while(x) x >>= 1";
+    input_buffer_t* ib = buffer_mem((void*)str, strlen(str));
+    token_t token;
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenKeyword);
+    CU_ASSERT_EQUAL(token.keyword, kKeywordWhile);
+    CU_ASSERT_EQUAL(string_keyword(token.value), kKeywordWhile);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenOperator);
+    CU_ASSERT_EQUAL(token.op, kOperatorLParen);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIdentifier);
+    CU_ASSERT_EQUAL(string_keyword(token.value), kKeywordTotal);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.op, kOperatorRParen);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIdentifier);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenOperator);
+    CU_ASSERT_EQUAL(token.op, kOperatorShiftRightAssign);
+
+    buffer_close(ib);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lexer_kinds);
+
+static void test_lex_punctuators(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    // Maximal munch, digraphs and points that are not floating constants
+    const char* str = "a...b..c->d%:%:e<::>x---y<<=z>>=.5.f(){}[];,?~:#<%%>%:-";
+    operator_kind_t expected[] = {
+        kOperatorEllipsis, kOperatorDot, kOperatorDot, kOperatorArrow, kOperatorHashHash, kOperatorLBracket,
+        kOperatorRBracket, kOperatorDecrement, kOperatorMinus, kOperatorShiftLeftAssign, kOperatorShiftRightAssign,
+        kOperatorDot, kOperatorLParen, kOperatorRParen, kOperatorLBrace, kOperatorRBrace, kOperatorLBracket,
+        kOperatorRBracket, kOperatorSemicolon, kOperatorComma, kOperatorQuestion, kOperatorTilde, kOperatorColon,
+        kOperatorHash, kOperatorLBrace, kOperatorRBrace, kOperatorHash, kOperatorMinus,
+    };
+
+    input_buffer_t* ib = buffer_mem((void*)str, strlen(str));
+    token_t token;
+    size_t total = 0;
+
+    int error;
+    while (0 == (error = parse_next_token(ctx, ib, &token))) {
+        if (token.type != kTokenOperator) {
+            continue;
+        }
+
+        CU_ASSERT(total < countof(expected));
+        if (total < countof(expected)) {
+            CU_ASSERT_EQUAL(token.op, expected[total]);
+            CU_ASSERT_EQUAL(_S(token.value), _S(ctx->operators[expected[total]]));
+        }
+        ++total;
+    }
+
+    CU_ASSERT_EQUAL(error, -1);
+    CU_ASSERT_EQUAL(total, countof(expected));
+    buffer_close(ib);
+
+    // Every punctuator on its own and at the very end of input
+    for (size_t i = 0; i < countof(g_operators); ++i) {
+        ib = buffer_mem((void*)g_operators[i], strlen(g_operators[i]));
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.type, kTokenOperator);
+        CU_ASSERT_EQUAL(token.op, (operator_kind_t)i);
+        CU_ASSERT(buffer_iseof(ib));
+        buffer_close(ib);
+    }
+
+    // Single byte table agrees with the DFA
+    for (unsigned c = 0; c < 256; ++c) {
+        if (g_lex_dispatch[c] == kLexPunctuator) {
+            CU_ASSERT(g_dfa_single[c] != 0);
+        }
+    }
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_punctuators);
+
+static void test_lex_batch(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    const char* str = "unsigned long x /* y */ = 0x10ul @ ";
+    char buf[4096] = {0};
+    size_t len = 0;
+    for (int i = 0; i < 100; ++i) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s\n", (i % 2) ? "x += 12" : "int y <<= y");
+    }
+
+    input_buffer_t* ib1 = buffer_mem(buf, len);
+    input_buffer_t* ib2 = buffer_mem(buf, len);
+
+    token_stream_t ts;
+    CU_ASSERT_EQUAL(0, token_stream_init(&ts));
+
+    // Odd batch size so that batches do not line up with lines
+    int error;
+    while (0 == (error = lex_batch(ctx, ib1, &ts, 7))) {
+    }
+    CU_ASSERT_EQUAL(error, -1);
+    CU_ASSERT_EQUAL(ts.count, 50 * 3 + 50 * 4);
+
+    uint32_t base = 0;
+    CU_ASSERT_EQUAL(0, buffer_get_base(ib1, &base));
+
+    for (size_t i = 0; i < ts.count; ++i) {
+        token_t token;
+        token_t stored;
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib2, &token));
+        token_stream_get(ctx, &ts, i, &stored);
+        CU_ASSERT_EQUAL(stored.type, token.type);
+        CU_ASSERT_EQUAL(ts.tokens[i].loc - base + ts.tokens[i].length, buffer_get_offset(ib2));
+        if (token.type == kTokenKeyword) {
+            CU_ASSERT_EQUAL(stored.keyword, token.keyword);
+            CU_ASSERT_EQUAL(_S(stored.value), _S(token.value));
+        } else if (token.type == kTokenOperator) {
+            CU_ASSERT_EQUAL(stored.op, token.op);
+            CU_ASSERT_EQUAL(_S(stored.value), _S(token.value));
+        } else if (token.type == kTokenIdentifier) {
+            CU_ASSERT_EQUAL(_S(stored.value), _S(token.value));
+        } else {
+            CU_ASSERT_EQUAL(stored.inttype, token.inttype);
+            CU_ASSERT_EQUAL(stored.intval, token.intval);
+        }
+    }
+
+    buffer_close(ib1);
+    buffer_close(ib2);
+    token_stream_destroy(&ts);
+
+    // Errors keep tokens lexed before them
+    ib1 = buffer_mem((void*)str, strlen(str));
+    CU_ASSERT_EQUAL(0, token_stream_init(&ts));
+    CU_ASSERT_EQUAL(EILSEQ, lex_batch(ctx, ib1, &ts, 100));
+    CU_ASSERT_EQUAL(ts.count, 5);
+    CU_ASSERT_EQUAL(0, buffer_get_base(ib1, &base));
+    CU_ASSERT_EQUAL(ts.tokens[4].type, kTokenIntConstant);
+    CU_ASSERT_EQUAL(ts.tokens[4].subkind, kIntegerTypeUnsignedLong);
+    CU_ASSERT_EQUAL(ts.tokens[4].loc, base + 26);
+    CU_ASSERT_EQUAL(ts.tokens[4].length, 6);
+    CU_ASSERT_EQUAL(ts.values[ts.tokens[4].value].intval, 0x10);
+    CU_ASSERT_EQUAL(buffer_get_offset(ib1), 33);
+
+    // Stream locations resolve to lines and columns
+    source_location_t sl;
+    CU_ASSERT_EQUAL(0, srcmgr_locate(ts.tokens[2].loc, &sl));
+    CU_ASSERT_STRING_EQUAL(sl.name, "<memory>");
+    CU_ASSERT_EQUAL(sl.line, 1);
+    CU_ASSERT_EQUAL(sl.column, 15);
+
+    buffer_close(ib1);
+    token_stream_destroy(&ts);
+
+    // Batch size is only an upper bound, memory is taken for the tokens there are
+    ib1 = buffer_mem((void*)str, 10);
+    CU_ASSERT_EQUAL(0, token_stream_init(&ts));
+    CU_ASSERT_EQUAL(0, lex_batch(ctx, ib1, &ts, SIZE_MAX));
+    CU_ASSERT_EQUAL(ts.count, 2);
+    CU_ASSERT(ts.capacity <= 256);
+    buffer_close(ib1);
+    token_stream_destroy(&ts);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_batch);
+
+static void test_lex_integers(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    struct {
+        const char* str;
+        uint64_t value;
+        integer_literal_type_t type;
+    } valid[] = {
+        { "0", 0, kIntegerTypeInt },
+        { "0u", 0, kIntegerTypeUnsigned },
+        { "007", 7, kIntegerTypeInt },
+        { "0777777777777", 0777777777777ull, kIntegerTypeLong },
+        { "1234567890123456789", 1234567890123456789ull, kIntegerTypeLong },
+        { "2147483647", 2147483647, kIntegerTypeInt },
+        { "2147483648", 2147483648ull, kIntegerTypeLong },
+        { "0x7fffffff", 0x7fffffff, kIntegerTypeInt },
+        { "0x80000000", 0x80000000ull, kIntegerTypeUnsigned },
+        { "0x80000000l", 0x80000000ull, kIntegerTypeLong },
+        { "4294967296u", 4294967296ull, kIntegerTypeUnsignedLong },
+        { "0xFfFfFfFfFfFfFfFf", UINT64_MAX, kIntegerTypeUnsignedLong },
+        { "0x8000000000000000LL", 0x8000000000000000ull, kIntegerTypeUnsignedLongLong },
+        { "18446744073709551615", UINT64_MAX, kIntegerTypeUnsignedLongLong },
+        { "18446744073709551615u", UINT64_MAX, kIntegerTypeUnsignedLong },
+        { "0x0000000000000000000000000abcDEF", 0xabcdef, kIntegerTypeInt },
+        { "01777777777777777777777", UINT64_MAX, kIntegerTypeUnsignedLong },
+    };
+
+    for (size_t i = 0; i < countof(valid); ++i) {
+        input_buffer_t* ib = buffer_mem((void*)valid[i].str, strlen(valid[i].str));
+        token_t token;
+
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.type, kTokenIntConstant);
+        CU_ASSERT_EQUAL(token.intval, valid[i].value);
+        CU_ASSERT_EQUAL(token.inttype, valid[i].type);
+        CU_ASSERT(buffer_iseof(ib));
+        buffer_close(ib);
+    }
+
+    const char* invalid[] = {
+        "08", "0129", "0x", "0xg", "18446744073709551616", "0x10000000000000000", "02000000000000000000000", "12ulL1",
+    };
+
+    for (size_t i = 0; i < countof(invalid); ++i) {
+        input_buffer_t* ib = buffer_mem((void*)invalid[i], strlen(invalid[i]));
+        token_t token;
+
+        CU_ASSERT_EQUAL(EILSEQ, parse_next_token(ctx, ib, &token));
+
+        // Preprocessor keeps them as they are spelled
+        buffer_set_offset(ib, 0);
+        CU_ASSERT_EQUAL(0, parse_next_pp_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.type, kTokenNumber);
+        CU_ASSERT_STRING_EQUAL(_S(token.value), invalid[i]);
+        CU_ASSERT(buffer_iseof(ib));
+        buffer_close(ib);
+    }
+
+    // Preprocessing numbers take points, letters and exponent signs, valid constants among them are still constants
+    struct {
+        const char* str;
+        token_type_t type;
+        uint32_t size;
+    } pp[] = {
+        { "0x1e+1", kTokenNumber, 6 }, { "1.2.3", kTokenNumber, 5 }, { ".5e+e-", kTokenNumber, 6 },
+        { "0x1p-1+", kTokenFloatConstant, 6 }, { "12u+1", kTokenIntConstant, 3 }, { "1..", kTokenNumber, 3 },
+    };
+
+    for (size_t i = 0; i < countof(pp); ++i) {
+        input_buffer_t* ib = buffer_mem((void*)pp[i].str, strlen(pp[i].str));
+        token_t token;
+
+        CU_ASSERT_EQUAL(0, parse_next_pp_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.type, pp[i].type);
+        CU_ASSERT_EQUAL(token.size, pp[i].size);
+        buffer_close(ib);
+    }
+
+    // Random values of every length against strtoull
+    srand(3);
+    for (int n = 0; n < 3000; ++n) {
+        uint64_t value = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ rand();
+        value >>= rand() % 64;
+
+        char str[32];
+        const char* formats[] = { "%llu", "0%llo", "0x%llx", "0X%llX" };
+        snprintf(str, sizeof(str), formats[n % countof(formats)], (unsigned long long)value);
+
+        input_buffer_t* ib = buffer_mem(str, strlen(str));
+        token_t token;
+
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.intval, value);
+        CU_ASSERT_EQUAL(token.intval, strtoull(str, NULL, 0));
+        buffer_close(ib);
+    }
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_integers);
+
+static void test_lex_floats(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    // Hard cases: halfway points, subnormals, range limits, long significands
+    const char* decimal[] = {
+        "0.", ".0", "1.5", "1e23", "9007199254740993.0", "9007199254740992.9999999999999999999999",
+        "2.2250738585072011e-308", "2.2250738585072014e-308", "4.9406564584124654e-324",
+        "2.4703282292062327e-324", "2.4703282292062328e-324", "1.7976931348623157e308", "1.7976931348623158e308",
+        "1.8e308", "1e-400", "1e400", "0.000000000000000000000000000000000000000000001e45",
+        "8.988465674311580536566680e307", "123456789012345678901234567890.5", "7.0385307e-26",
+        "3.4028235e38", "1.17549435e-38", "1.4e-45", "0e999999999999", "1E+2", "1.e-2",
+        "179769313486231580793728971405301e276", "2.5e-324", "5e-324",
+    };
+
+    for (size_t i = 0; i < countof(decimal); ++i) {
+        for (int single = 0; single < 2; ++single) {
+            char str[128];
+            snprintf(str, sizeof(str), "%s%s", decimal[i], single ? "f" : "");
+
+            input_buffer_t* ib = buffer_mem(str, strlen(str));
+            token_t token;
+
+            CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+            CU_ASSERT_EQUAL(token.type, kTokenFloatConstant);
+            CU_ASSERT_EQUAL(token.flttype, single ? kFloatTypeFloat : kFloatTypeDouble);
+            CU_ASSERT(single ? (float)token.fltval == strtof(str, NULL) : token.fltval == strtod(str, NULL));
+            CU_ASSERT(buffer_iseof(ib));
+            buffer_close(ib);
+        }
+    }
+
+    const char* hex[] = {
+        "0x1p0", "0x1.8p1", "0x.8p1", "0X1P-1074", "0x1p-1075", "0x1.fffffffffffffp1023", "0x1p1024",
+        "0x1.fffffffffffff8p0", "0xffffffffffffffffffffp-4", "0x123456789abcdef.123p-3", "0x0p0", "0x1p-126",
+        "0x1.fffffep127", "0x1.ffffffp127",
+    };
+
+    for (size_t i = 0; i < countof(hex); ++i) {
+        for (int single = 0; single < 2; ++single) {
+            char str[128];
+            snprintf(str, sizeof(str), "%s%s", hex[i], single ? "F" : "L");
+
+            input_buffer_t* ib = buffer_mem(str, strlen(str));
+            token_t token;
+
+            CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+            CU_ASSERT_EQUAL(token.type, kTokenFloatConstant);
+            CU_ASSERT_EQUAL(token.flttype, single ? kFloatTypeFloat : kFloatTypeLongDouble);
+            CU_ASSERT(single ? (float)token.fltval == strtof(str, NULL) : token.fltval == strtod(str, NULL));
+            buffer_close(ib);
+        }
+    }
+
+    const char* invalid[] = {
+        "1e", "1e+", "0x1.8", "0x.p1", "0xp1", "1.5x", "1.5ff", "1.5fl", "09", "1.0e5u",
+    };
+
+    for (size_t i = 0; i < countof(invalid); ++i) {
+        input_buffer_t* ib = buffer_mem((void*)invalid[i], strlen(invalid[i]));
+        token_t token;
+
+        CU_ASSERT_EQUAL(EILSEQ, parse_next_token(ctx, ib, &token));
+        buffer_close(ib);
+    }
+
+    // Random decimal constants of every shape against the C library
+    srand(5);
+    for (int n = 0; n < 20000; ++n) {
+        char str[128];
+        size_t len = 0;
+
+        int digits = 1 + rand() % 24;
+        int point = rand() % (digits + 1);
+        for (int i = 0; i < digits; ++i) {
+            if (i == point) {
+                str[len++] = '.';
+            }
+            str[len++] = '0' + rand() % 10;
+        }
+
+        if (point == digits) {
+            str[len++] = '.';
+        }
+
+        if (rand() % 4) {
+            len += sprintf(str + len, "e%d", rand() % 700 - 350);
+        }
+
+        bool single = (n % 3 == 0);
+        if (single) {
+            str[len++] = 'f';
+        }
+        str[len] = '\0';
+
+        input_buffer_t* ib = buffer_mem(str, len);
+        token_t token;
+
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.type, kTokenFloatConstant);
+        bool match = single ? (float)token.fltval == strtof(str, NULL) : token.fltval == strtod(str, NULL);
+        CU_ASSERT_TRUE(match);
+        if (!match) {
+            printf("\n  floating constant differs from C library on '%s'\n", str);
+        }
+        buffer_close(ib);
+    }
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_floats);
+
+static void test_lex_literals(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    // Plain strings point into the buffer
+    const char* str = "\"hello\" x\"\" u8\"utf8\" L\"wide\" u8 'a'";
+    input_buffer_t* ib = buffer_mem((void*)str, strlen(str));
+    token_t token;
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenStrConstant);
+    CU_ASSERT_EQUAL(token.encoding, kEncodingDefault);
+    CU_ASSERT_EQUAL(token.literal, str + 1);
+    CU_ASSERT_EQUAL(token.length, 5);
+    CU_ASSERT_EQUAL(_S(token.value), NULL);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIdentifier);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenStrConstant);
+    CU_ASSERT_EQUAL(token.length, 0);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenStrConstant);
+    CU_ASSERT_EQUAL(token.encoding, kEncodingUtf8);
+    CU_ASSERT_EQUAL(token.literal, strstr(str, "utf8\""));
+    CU_ASSERT_EQUAL(token.length, 4);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenStrConstant);
+    CU_ASSERT_EQUAL(token.encoding, kEncodingWide);
+
+    // u8 is not a character constant prefix
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIdentifier);
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenCharConstant);
+    CU_ASSERT_EQUAL(token.intval, 'a');
+
+    buffer_close(ib);
+
+    // Escapes are decoded
+    struct {
+        const char* src;
+        const char* decoded;
+        size_t length;
+    } strings[] = {
+        { "\"a\\tb\\n\"", "a\tb\n", 4 },
+        { "\"\\\"\\'\\?\\\\\"", "\"'?\\", 4 },
+        { "\"\\0x\\101\\x41\"", "\0x" "AA", 4 },
+        { "\"\\u00e9\\U0001F600\"", "\xc3\xa9\xf0\x9f\x98\x80", 6 },
+        { "L\"\\x263a\"", "\xe2\x98\xba", 3 },
+        { "u\"\\x263a\\u263a\"", "\xe2\x98\xba\xe2\x98\xba", 6 },
+        { "\"\\377\\xff\"", "\xff\xff", 2 },
+    };
+
+    for (size_t i = 0; i < countof(strings); ++i) {
+        ib = buffer_mem((void*)strings[i].src, strlen(strings[i].src));
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.type, kTokenStrConstant);
+        CU_ASSERT_EQUAL(token.length, strings[i].length);
+        CU_ASSERT(0 == memcmp(token.literal, strings[i].decoded, strings[i].length));
+        CU_ASSERT_EQUAL(token.literal, _S(token.value));
+        CU_ASSERT(buffer_iseof(ib));
+        buffer_close(ib);
+    }
+
+    struct {
+        const char* src;
+        uint64_t value;
+    } chars[] = {
+        { "'a'", 'a' },
+        { "'\\n'", '\n' },
+        { "'\\xff'", (uint64_t)-1 },
+        { "'\\377'", (uint64_t)-1 },
+        { "'ab'", ('a' << 8) | 'b' },
+        { "'\\0'", 0 },
+        { "u'\\xffff'", 0xffff },
+        { "U'\\U0001F600'", 0x1f600 },
+        { "U'\xf0\x9f\x98\x80'", 0x1f600 },
+        { "L'\\xffffffff'", (uint64_t)-1 },
+        { "L'\xc3\xa9'", 0xe9 },
+    };
+
+    for (size_t i = 0; i < countof(chars); ++i) {
+        ib = buffer_mem((void*)chars[i].src, strlen(chars[i].src));
+        CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+        CU_ASSERT_EQUAL(token.type, kTokenCharConstant);
+        CU_ASSERT_EQUAL(token.intval, chars[i].value);
+        CU_ASSERT(buffer_iseof(ib));
+        buffer_close(ib);
+    }
+
+    const char* invalid[] = {
+        "\"unterminated", "\"new\nline\"", "\"\\", "\"\\q\"", "\"\\x\"", "\"\\x100\"", "\"\\x123456789\"",
+        "\"\\u12\"", "\"\\ud800\"", "\"\\u0041\"", "\"\\U00110000\"", "''", "'abcde'", "u'\\x10000'",
+        "u'ab'", "U'\xff'", "'\\",
+    };
+
+    for (size_t i = 0; i < countof(invalid); ++i) {
+        ib = buffer_mem((void*)invalid[i], strlen(invalid[i]));
+        CU_ASSERT_EQUAL(EILSEQ, parse_next_token(ctx, ib, &token));
+        buffer_close(ib);
+    }
+
+    // Long literals go through vector search and heap decoding
+    size_t size = 4096;
+    char* buf = malloc(size + 1);
+    buf[0] = '"';
+    for (size_t i = 1; i < size - 1; ++i) {
+        buf[i] = 'a' + i % 26;
+    }
+    buf[size - 1] = '"';
+
+    ib = buffer_mem(buf, size);
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.literal, buf + 1);
+    CU_ASSERT_EQUAL(token.length, size - 2);
+    buffer_close(ib);
+
+    memcpy(buf + size - 3, "\\n", 2);
+    ib = buffer_mem(buf, size);
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.length, size - 3);
+    CU_ASSERT_EQUAL(token.literal[size - 4], '\n');
+    CU_ASSERT(0 == memcmp(token.literal, buf + 1, size - 4));
+    buffer_close(ib);
+
+    // Streams give out the same contents
+    str = "\"plain\" \"esc\\x41ped\" u8\"span\"";
+    ib = buffer_mem((void*)str, strlen(str));
+    token_stream_t ts;
+    token_stream_init(&ts);
+    CU_ASSERT_EQUAL(0, lex_batch(ctx, ib, &ts, 16));
+    CU_ASSERT_EQUAL(ts.count, 3);
+
+    size_t len = 0;
+    CU_ASSERT_EQUAL(token_stream_literal(&ts, 0, &len), str + 1);
+    CU_ASSERT_EQUAL(len, 5);
+    CU_ASSERT(0 == memcmp(token_stream_literal(&ts, 1, &len), "escAped", 7));
+    CU_ASSERT_EQUAL(len, 7);
+    CU_ASSERT_EQUAL(token_stream_literal(&ts, 2, &len), strstr(str, "span"));
+    CU_ASSERT_EQUAL(len, 4);
+
+    token_stream_get(ctx, &ts, 1, &token);
+    CU_ASSERT_EQUAL(token.type, kTokenStrConstant);
+    CU_ASSERT_EQUAL(token.length, 7);
+    CU_ASSERT(0 == memcmp(token.literal, "escAped", 7));
+    token_stream_get(ctx, &ts, 2, &token);
+    CU_ASSERT_EQUAL(token.encoding, kEncodingUtf8);
+    CU_ASSERT_EQUAL(token.literal, strstr(str, "span"));
+
+    token_stream_destroy(&ts);
+    buffer_close(ib);
+    free(buf);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_literals);
+
+static void test_lex_identifiers(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    // UTF-8 and UCN spellings of the same character name the same identifier
+    const char* str = "caf\xc3\xa9 caf\\u00e9 \\U000000e9t\xc3\xa9 x\xcc\x81 \xf0\x9d\x91\xa5 int\xc3\xa9 "
+                      "/* \xe2\x82\xac \xff */ \"\xe2\x82\xac\" _\\u00c0_";
+    input_buffer_t* ib = buffer_mem((void*)str, strlen(str));
+    token_t token;
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIdentifier);
+    CU_ASSERT_STRING_EQUAL(_S(token.value), "caf\xc3\xa9");
+    const char* cafe = _S(token.value);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIdentifier);
+    CU_ASSERT_EQUAL(_S(token.value), cafe);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_STRING_EQUAL(_S(token.value), "\xc3\xa9t\xc3\xa9");
+
+    // Combining mark can continue an identifier
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_STRING_EQUAL(_S(token.value), "x\xcc\x81");
+
+    // Supplementary planes
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_STRING_EQUAL(_S(token.value), "\xf0\x9d\x91\xa5");
+
+    // Extended identifiers are never keywords
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenIdentifier);
+
+    // Comments and strings are not checked
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(token.type, kTokenStrConstant);
+    CU_ASSERT_EQUAL(token.length, 3);
+
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_STRING_EQUAL(_S(token.value), "_\xc3\x80_");
+
+    CU_ASSERT_EQUAL(-1, parse_next_token(ctx, ib, &token));
+    buffer_close(ib);
+
+    // Malformed UTF-8, characters outside of Annex D, UCNs of basic characters
+    // and combining marks at the start are all rejected
+    const char* invalid[] = {
+        "\xff", "a\xc3", "a\xc0\x80", "\xed\xa0\x80", "\xcc\x81x", "\\u0301x", "\xc2\xa0",
+        "\\u0024", "\\u0041", "\\u00e", "\\", "\\x", "1\xc3\xa9", "1.0\\u00e9", "0x1\xc3\xa9",
+    };
+
+    for (size_t i = 0; i < countof(invalid); ++i) {
+        ib = buffer_mem((void*)invalid[i], strlen(invalid[i]));
+        bool match = (EILSEQ == parse_next_token(ctx, ib, &token));
+        if (!match) {
+            printf("\n  '%s' was accepted\n", invalid[i]);
+        }
+
+        CU_ASSERT_TRUE(match);
+        buffer_close(ib);
+    }
+
+    // Identifier ends before a character that can't continue it
+    str = "a\xc2\xa0";
+    ib = buffer_mem((void*)str, strlen(str));
+    CU_ASSERT_EQUAL(0, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_STRING_EQUAL(_S(token.value), "a");
+    CU_ASSERT_EQUAL(EILSEQ, parse_next_token(ctx, ib, &token));
+    CU_ASSERT_EQUAL(buffer_get_offset(ib), 1);
+    buffer_close(ib);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_identifiers);
+
+// Lex the same text sequentially and in chunks, returns the error of both or EINVAL if results differ
+static int parallel_matches_batch(cc_context_t* ctx, const char* text, size_t len, size_t nchunks)
+{
+    input_buffer_t* ib1 = buffer_mem((void*)text, len);
+    input_buffer_t* ib2 = buffer_mem((void*)text, len);
+
+    token_stream_t ts1;
+    token_stream_t ts2;
+    token_stream_init(&ts1);
+    token_stream_init(&ts2);
+
+    int e1 = lex_batch(ctx, ib1, &ts1, len);
+    int e2 = lex_parallel_chunks(ctx, ib2, &ts2, nchunks);
+    e1 = (e1 == -1 ? 0 : e1);
+
+    bool match = (e1 == e2) && buffer_get_offset(ib1) == buffer_get_offset(ib2) &&
+                 token_streams_match(ctx, &ts1, ib1, &ts2, ib2);
+
+    token_stream_destroy(&ts1);
+    token_stream_destroy(&ts2);
+    buffer_close(ib1);
+    buffer_close(ib2);
+    return match ? e2 : EINVAL;
+}
+
+static void test_lex_parallel(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    // Multiline comments with junk in them make bad split points
+    const char* lines[] = {
+        "int x = 0x10\n",
+        "/*\n @@ not \"code\"\n int x = 1 ;;\n */ x += 1\n",
+        "// $$ line comment\n",
+        "unsigned long long y <<= 7ull /* ## */\n",
+        "\n\n  \t\n",
+        "x /*\n*/ y\n",
+    };
+
+    size_t size = 64 * 1024;
+    char* buf = malloc(size);
+    size_t len = 0;
+
+    srand(7);
+    for (;;) {
+        const char* line = lines[rand() % countof(lines)];
+        if (len + strlen(line) >= size) {
+            break;
+        }
+
+        memcpy(buf + len, line, strlen(line));
+        len += strlen(line);
+    }
+
+    // Clean input, then unterminated comment at the end, then a bad character in the middle
+    for (int pass = 0; pass < 3; ++pass) {
+        if (pass == 1) {
+            memcpy(buf + len - 3, "\n/*", 3);
+        } else if (pass == 2) {
+            buf[len / 2] = '\n';
+            buf[len / 2 + 1] = '@';
+        }
+
+        for (size_t nchunks = 1; nchunks <= 33; nchunks += 4) {
+            CU_ASSERT_EQUAL(parallel_matches_batch(ctx, buf, len, nchunks), pass ? EILSEQ : 0);
+        }
+    }
+
+    // Leading whitespace before the first token, and split points with a token right after the newline
+    // or after more whitespace. Every line is a split candidate.
+    const char* repeated[] = { " a\n", "\t\na b\n", "a\n", "a\n  b\n" };
+    for (size_t i = 0; i < countof(repeated); ++i) {
+        size_t n = strlen(repeated[i]);
+        for (len = 0; len + n < size; len += n) {
+            memcpy(buf + len, repeated[i], n);
+        }
+
+        for (size_t nchunks = 1; nchunks <= 33; nchunks += 4) {
+            CU_ASSERT_EQUAL(parallel_matches_batch(ctx, buf, len, nchunks), 0);
+        }
+    }
+
+    // Short input, chunk 0 keeps the flags it found itself
+    CU_ASSERT_EQUAL(parallel_matches_batch(ctx, " a", 2, 1), 0);
+    CU_ASSERT_EQUAL(parallel_matches_batch(ctx, " a\nb", 4, 2), 0);
+
+    free(buf);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_parallel);
+
+static void test_lex_splices(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    // Splices can split any token, trigraphs are replaced before splicing but are not formed by it
+    const char* str = "in\\\nt x = 0x\\\r\n1f;\n\"a\\\nb\" ?\?=?\?( y ?\\\n?=";
+
+    struct {
+        token_type_t type;
+        int subkind;
+        uint32_t line;
+        uint32_t column;
+    } expected[] = {
+        { kTokenKeyword, kKeywordInt, 1, 1 },
+        { kTokenIdentifier, 0, 2, 3 },
+        { kTokenOperator, kOperatorAssign, 2, 5 },
+        { kTokenIntConstant, kIntegerTypeInt, 2, 7 },
+        { kTokenOperator, kOperatorSemicolon, 3, 3 },
+        { kTokenStrConstant, kEncodingDefault, 4, 1 },
+        { kTokenOperator, kOperatorHash, 5, 4 },
+        { kTokenOperator, kOperatorLBracket, 5, 7 },
+        { kTokenIdentifier, 0, 5, 11 },
+        { kTokenOperator, kOperatorQuestion, 5, 13 },
+        { kTokenOperator, kOperatorQuestion, 6, 1 },
+        { kTokenOperator, kOperatorAssign, 6, 2 },
+    };
+
+    input_buffer_t* ib = buffer_mem_flags((void*)str, strlen(str), kBufferTrigraphs);
+    token_stream_t ts;
+    token_stream_init(&ts);
+    CU_ASSERT_EQUAL(lex_batch(ctx, ib, &ts, 100), 0);
+    CU_ASSERT_EQUAL(ts.count, countof(expected));
+
+    for (size_t i = 0; i < ts.count && i < countof(expected); ++i) {
+        source_location_t sl;
+        CU_ASSERT_EQUAL(ts.tokens[i].type, expected[i].type);
+        CU_ASSERT_EQUAL(ts.tokens[i].subkind, expected[i].subkind);
+        CU_ASSERT_EQUAL(srcmgr_locate(ts.tokens[i].loc, &sl), 0);
+        CU_ASSERT_EQUAL(sl.line, expected[i].line);
+        CU_ASSERT_EQUAL(sl.column, expected[i].column);
+    }
+
+    token_t token;
+    token_stream_get(ctx, &ts, 3, &token);
+    CU_ASSERT_EQUAL(token.intval, 0x1f);
+
+    size_t len = 0;
+    const char* literal = token_stream_literal(&ts, 5, &len);
+    CU_ASSERT_EQUAL(len, 2);
+    CU_ASSERT(0 == memcmp(literal, "ab", 2));
+
+    token_stream_destroy(&ts);
+    buffer_close(ib);
+
+    // Trigraphs in string literals are kept as written unless they are enabled
+    const char* what = "\"what?\?!\" \"a?\?/nb\"";
+    const char* contents[][2] = { { "what?\?!", "a?\?/nb" }, { "what|", "a\nb" } };
+    for (int trigraphs = 0; trigraphs < 2; ++trigraphs) {
+        ib = buffer_mem_flags((void*)what, strlen(what), trigraphs ? kBufferTrigraphs : 0);
+        token_stream_init(&ts);
+        CU_ASSERT_EQUAL(lex_batch(ctx, ib, &ts, 100), 0);
+        CU_ASSERT_FATAL(ts.count == 2);
+
+        for (size_t i = 0; i < 2; ++i) {
+            literal = token_stream_literal(&ts, i, &len);
+            CU_ASSERT_EQUAL(len, strlen(contents[trigraphs][i]));
+            CU_ASSERT(0 == memcmp(literal, contents[trigraphs][i], len));
+        }
+
+        token_stream_destroy(&ts);
+        buffer_close(ib);
+    }
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_splices);
+
+static void test_lex_edit(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    const char* fragments[] = {
+        "", " ", "\n", "x", "if", "12", "0x", "+", "=", "<<", "/*", "*/", "//", "int y /* c */ + 1\n", "\\\n", "?\?/",
+    };
+
+    size_t size = 4096;
+    char* text = malloc(size);
+    char* edited = malloc(size);
+    size_t len = 0;
+
+    for (int i = 0; i < 40; ++i) {
+        len += sprintf(text + len, "int x%d = %d + x /* %d */\n", i, i, i);
+    }
+
+    token_stream_t ts;
+    token_stream_init(&ts);
+
+    // Stream locations belong to the buffer it was lexed from, so that one stays open until the edit is done
+    input_buffer_t* ib = buffer_mem(text, len);
+    CU_ASSERT_EQUAL(lex_batch(ctx, ib, &ts, len), 0);
+
+    srand(11);
+    for (int iter = 0; iter < 2000; ++iter) {
+        const char* ins = fragments[rand() % countof(fragments)];
+        size_t inserted = strlen(ins);
+        size_t offset = rand() % (len + 1);
+        size_t removed = rand() % 6;
+        if (removed > len - offset) {
+            removed = len - offset;
+        }
+
+        size_t new_len = len - removed + inserted;
+        if (new_len >= size) {
+            continue;
+        }
+
+        memcpy(edited, text, offset);
+        memcpy(edited + offset, ins, inserted);
+        memcpy(edited + offset + inserted, text + offset + removed, len - offset - removed);
+
+        token_stream_t expected;
+        token_stream_init(&expected);
+
+        input_buffer_t* ib1 = buffer_mem(edited, new_len);
+        input_buffer_t* ib2 = buffer_mem(edited, new_len);
+
+        int e1 = lex_batch(ctx, ib1, &expected, new_len + 1);
+        int e2 = lex_edit(ctx, &ts, ib2, offset, removed, inserted);
+
+        CU_ASSERT_EQUAL(e1 == -1 ? 0 : e1, e2);
+        CU_ASSERT_EQUAL(buffer_get_offset(ib1), buffer_get_offset(ib2));
+        CU_ASSERT_EQUAL(expected.count, ts.count);
+        CU_ASSERT(token_streams_match(ctx, &expected, ib1, &ts, ib2));
+
+        buffer_close(ib1);
+        token_stream_destroy(&expected);
+
+        if (e2 == 0) {
+            // Keep the edit
+            buffer_close(ib);
+            ib = ib2;
+            char* t = text;
+            text = edited;
+            edited = t;
+            len = new_len;
+        } else {
+            // Stream is incomplete after an error, start over from the old text
+            buffer_close(ib2);
+            buffer_close(ib);
+            ts.count = 0;
+            ts.value_count = 0;
+            ib = buffer_mem(text, len);
+            CU_ASSERT_EQUAL(lex_batch(ctx, ib, &ts, len + 1), len ? 0 : -1);
+        }
+    }
+
+    buffer_close(ib);
+    token_stream_destroy(&ts);
+
+    // Every edit takes a new range of locations, retired buffers give theirs back.
+    // A large buffer edited over and over would run out of location space otherwise.
+    size = 4 << 20;
+    char* big[2] = { malloc(size), malloc(size) };
+    CU_ASSERT_FATAL(big[0] && big[1]);
+    memset(big[0], ' ', size);
+    memcpy(big[0] + size - 16, "int x = 1;\n", 11);
+    memcpy(big[1], big[0], size);
+    big[1][size - 12] = 'y';
+
+    token_stream_init(&ts);
+    ib = buffer_mem(big[0], size);
+    CU_ASSERT_EQUAL(lex_batch(ctx, ib, &ts, size), 0);
+
+    bool ok = true;
+    for (int iter = 1; iter <= 1200 && ok; ++iter) {
+        // Keystrokes alternate between 'x' and 'y', so each text is always one of the two arrays
+        const char* now = big[iter % 2];
+        input_buffer_t* next = buffer_mem((void*)now, size);
+        ok = (0 == lex_edit(ctx, &ts, next, size - 12, 1, 1));
+        buffer_close(ib);
+        ib = next;
+
+        token_t token;
+        token_stream_get(ctx, &ts, 1, &token);
+        ok = ok && ts.count == 5 && token.type == kTokenIdentifier && _S(token.value)[0] == now[size - 12];
+
+        // Dead values are dropped, the table does not grow with the number of edits
+        token_stream_get(ctx, &ts, 3, &token);
+        ok = ok && token.type == kTokenIntConstant && token.intval == 1 && ts.value_count <= 8;
+    }
+
+    CU_ASSERT_TRUE(ok);
+    buffer_close(ib);
+    free(big[0]);
+    free(big[1]);
+
+    token_stream_destroy(&ts);
+    free(text);
+    free(edited);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(test_lex_edit);
+
+#endif // TEST
+
 static void keyword_matcher_test(void)
 {
 }
@@ -0,0 +1,410 @@
+/*
+ * Source manager.
+ * Every registered source gets a range of global offsets. Ranges are handed out in increasing order
+ * until the location space runs out, after that gaps left by removed sources are reused.
+ * Source table is kept sorted either way, so a location is resolved with a binary search.
+ * Line start tables are only built for sources someone actually asks about.
+ */
+
+#include "srcmgr.h"
+#include "charscan.h"
+#include "support.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct
+{
+    uint32_t base;
+    uint32_t size;
+    const char* data;
+    const char* raw;        // Original text, same as data unless it was spliced
+    uint32_t raw_size;
+    const source_splice_t* splices;
+    size_t splice_count;
+    uint32_t* lines;        // Line start offsets in original text, NULL until first lookup
+    uint32_t line_count;
+    char name[0];
+} source_entry_t;
+
+static source_entry_t** g_sources = NULL;
+static size_t g_source_count = 0;
+static size_t g_source_capacity = 0;
+static uint32_t g_next_base = 1;   // Past the range of the last source
+static pthread_mutex_t g_srcmgr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int srcmgr_add(const char* name, const char* data, size_t size, uint32_t* base)
+{
+    return srcmgr_add_spliced(name, data, size, data, size, NULL, 0, base);
+}
+
+int srcmgr_add_spliced(const char* name, const char* data, size_t size, const char* raw, size_t raw_size,
+                       const source_splice_t* splices, size_t splice_count, uint32_t* base)
+{
+    if (!name || (!data && size) || (!raw && raw_size) || (!splices && splice_count) || !base) {
+        return EINVAL;
+    }
+
+    if (raw_size > UINT32_MAX) {
+        return EOVERFLOW;
+    }
+
+    size_t namelen = strlen(name);
+    source_entry_t* entry = malloc(sizeof(*entry) + namelen + 1);
+    if (!entry) {
+        return ENOMEM;
+    }
+
+    entry->size = (uint32_t)size;
+    entry->data = data;
+    entry->raw = raw;
+    entry->raw_size = (uint32_t)raw_size;
+    entry->splices = splices;
+    entry->splice_count = splice_count;
+    entry->lines = NULL;
+    entry->line_count = 0;
+    memcpy(entry->name, name, namelen + 1);
+
+    int error = 0;
+    pthread_mutex_lock(&g_srcmgr_lock);
+
+    // First gap that fits, the space past the last source is only used up when it runs out
+    size_t at = g_source_count;
+    uint32_t start = g_next_base;
+    if (size >= (size_t)UINT32_MAX - g_next_base) {
+        start = 0;
+        uint32_t prev_end = 1;
+        for (size_t i = 0; i < g_source_count; ++i) {
+            if (g_sources[i]->base - prev_end > size) {
+                start = prev_end;
+                at = i;
+                break;
+            }
+
+            prev_end = g_sources[i]->base + g_sources[i]->size + 1;
+        }
+
+        if (!start) {
+            error = EOVERFLOW;
+            goto done;
+        }
+    }
+
+    if (g_source_count == g_source_capacity) {
+        size_t newcap = (g_source_capacity ? g_source_capacity * 2 : 64);
+        source_entry_t** sources = realloc(g_sources, newcap * sizeof(*sources));
+        if (!sources) {
+            error = ENOMEM;
+            goto done;
+        }
+
+        g_sources = sources;
+        g_source_capacity = newcap;
+    }
+
+    memmove(g_sources + at + 1, g_sources + at, (g_source_count - at) * sizeof(*g_sources));
+    g_sources[at] = entry;
+    ++g_source_count;
+
+    entry->base = start;
+    if (at + 1 == g_source_count) {
+        g_next_base = start + (uint32_t)size + 1;
+    }
+
+    *base = entry->base;
+
+done:
+    pthread_mutex_unlock(&g_srcmgr_lock);
+    if (error) {
+        free(entry);
+    }
+
+    return error;
+}
+
+// Source containing 'loc' or NULL, lock must be held
+static source_entry_t* srcmgr_find(uint32_t loc)
+{
+    size_t lo = 0;
+    size_t hi = g_source_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (g_sources[mid]->base <= loc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        return NULL;
+    }
+
+    source_entry_t* entry = g_sources[lo - 1];
+    return (loc - entry->base <= entry->size) ? entry : NULL;
+}
+
+const char* srcmgr_source(uint32_t loc, uint32_t* base)
+{
+    pthread_mutex_lock(&g_srcmgr_lock);
+    source_entry_t* entry = srcmgr_find(loc);
+    const char* data = NULL;
+    if (entry) {
+        data = entry->data;
+        if (base) {
+            *base = entry->base;
+        }
+    }
+    pthread_mutex_unlock(&g_srcmgr_lock);
+    return data;
+}
+
+bool srcmgr_is_spliced(uint32_t loc)
+{
+    pthread_mutex_lock(&g_srcmgr_lock);
+    source_entry_t* entry = srcmgr_find(loc);
+    bool spliced = (entry && entry->splice_count);
+    pthread_mutex_unlock(&g_srcmgr_lock);
+    return spliced;
+}
+
+// Offset in original text of a byte of lexed text
+static uint32_t srcmgr_unsplice(const source_entry_t* entry, uint32_t offset)
+{
+    size_t lo = 0;
+    size_t hi = entry->splice_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entry->splices[mid].offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return offset + (lo ? entry->splices[lo - 1].delta : 0);
+}
+
+static int srcmgr_build_lines(source_entry_t* entry)
+{
+    const char* begin = entry->raw;
+    const char* end = begin + entry->raw_size;
+
+    size_t count = 1;
+    for (const char* p = charscan_find_char(begin, end, '\n'); p < end; p = charscan_find_char(p + 1, end, '\n')) {
+        ++count;
+    }
+
+    uint32_t* lines = malloc(count * sizeof(*lines));
+    if (!lines) {
+        return ENOMEM;
+    }
+
+    size_t i = 0;
+    lines[i++] = 0;
+    for (const char* p = charscan_find_char(begin, end, '\n'); p < end; p = charscan_find_char(p + 1, end, '\n')) {
+        lines[i++] = (uint32_t)(p + 1 - begin);
+    }
+
+    entry->lines = lines;
+    entry->line_count = (uint32_t)count;
+    return 0;
+}
+
+int srcmgr_locate(uint32_t loc, source_location_t* out)
+{
+    if (!out) {
+        return EINVAL;
+    }
+
+    int error = 0;
+    pthread_mutex_lock(&g_srcmgr_lock);
+
+    source_entry_t* entry = srcmgr_find(loc);
+    if (!entry) {
+        error = ENOENT;
+        goto done;
+    }
+
+    if (!entry->lines) {
+        error = srcmgr_build_lines(entry);
+        if (error) {
+            goto done;
+        }
+    }
+
+    // Last line that starts at or before the offset
+    uint32_t offset = srcmgr_unsplice(entry, loc - entry->base);
+    size_t lo = 0;
+    size_t hi = entry->line_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entry->lines[mid] <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    out->name = entry->name;
+    out->line = (uint32_t)lo;
+    out->column = offset - entry->lines[lo - 1] + 1;
+
+done:
+    pthread_mutex_unlock(&g_srcmgr_lock);
+    return error;
+}
+
+void srcmgr_remove(uint32_t base)
+{
+    pthread_mutex_lock(&g_srcmgr_lock);
+
+    source_entry_t* entry = srcmgr_find(base);
+    if (entry && entry->base == base) {
+        size_t at = 0;
+        while (g_sources[at] != entry) {
+            ++at;
+        }
+
+        --g_source_count;
+        memmove(g_sources + at, g_sources + at + 1, (g_source_count - at) * sizeof(*g_sources));
+
+        // Space past the new last source is free again
+        if (at == g_source_count) {
+            const source_entry_t* last = (g_source_count ? g_sources[g_source_count - 1] : NULL);
+            g_next_base = (last ? last->base + last->size + 1 : 1);
+        }
+
+        free(entry->lines);
+        free(entry);
+    }
+
+    pthread_mutex_unlock(&g_srcmgr_lock);
+}
+
+void srcmgr_reset(void)
+{
+    pthread_mutex_lock(&g_srcmgr_lock);
+    for (size_t i = 0; i < g_source_count; ++i) {
+        free(g_sources[i]->lines);
+        free(g_sources[i]);
+    }
+
+    free(g_sources);
+    g_sources = NULL;
+    g_source_count = 0;
+    g_source_capacity = 0;
+    g_next_base = 1;
+    pthread_mutex_unlock(&g_srcmgr_lock);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(TEST)
+
+static void srcmgr_test(void)
+{
+    const char* a = "int x;\nint y;\n\nz";
+    const char* b = "";
+    const char* c = "\n\nabc";
+
+    uint32_t base_a, base_b, base_c;
+    CU_ASSERT_FALSE(srcmgr_add("a.c", a, strlen(a), &base_a));
+    CU_ASSERT_FALSE(srcmgr_add("b.h", b, strlen(b), &base_b));
+    CU_ASSERT_FALSE(srcmgr_add("c.h", c, strlen(c), &base_c));
+
+    CU_ASSERT(base_a != 0);
+    CU_ASSERT(base_b > base_a + strlen(a));
+    CU_ASSERT(base_c > base_b);
+
+    struct {
+        uint32_t loc;
+        const char* name;
+        uint32_t line;
+        uint32_t column;
+    } cases[] = {
+        { base_a, "a.c", 1, 1 },
+        { base_a + 4, "a.c", 1, 5 },
+        { base_a + 6, "a.c", 1, 7 },    // Newline belongs to the line it ends
+        { base_a + 7, "a.c", 2, 1 },
+        { base_a + 14, "a.c", 3, 1 },
+        { base_a + 15, "a.c", 4, 1 },
+        { base_a + 16, "a.c", 4, 2 },   // End of source
+        { base_b, "b.h", 1, 1 },
+        { base_c + 2, "c.h", 3, 1 },
+        { base_c + 4, "c.h", 3, 3 },
+        { base_c + 5, "c.h", 3, 4 },
+    };
+
+    for (size_t i = 0; i < countof(cases); ++i) {
+        source_location_t sl;
+        CU_ASSERT_FALSE(srcmgr_locate(cases[i].loc, &sl));
+        CU_ASSERT_STRING_EQUAL(sl.name, cases[i].name);
+        CU_ASSERT_EQUAL(sl.line, cases[i].line);
+        CU_ASSERT_EQUAL(sl.column, cases[i].column);
+    }
+
+    uint32_t base = 0;
+    CU_ASSERT_EQUAL(srcmgr_source(base_a + 3, &base), a);
+    CU_ASSERT_EQUAL(base, base_a);
+    CU_ASSERT_EQUAL(srcmgr_source(base_c + 4, &base), c);
+    CU_ASSERT_EQUAL(base, base_c);
+
+    source_location_t sl;
+    CU_ASSERT_EQUAL(srcmgr_locate(0, &sl), ENOENT);
+    CU_ASSERT_EQUAL(srcmgr_locate(base_c + 6, &sl), ENOENT);
+    CU_ASSERT_EQUAL(srcmgr_source(base_c + 6, &base), NULL);
+
+    // Spliced text reports original lines and columns
+    const char* raw = "a\\\nb ?\?= c";
+    const char* spliced = "ab # c";
+    source_splice_t splices[] = { { 1, 2 }, { 4, 4 } };
+    CU_ASSERT_FALSE(srcmgr_add_spliced("d.c", spliced, strlen(spliced), raw, strlen(raw), splices, countof(splices), &base));
+    CU_ASSERT(srcmgr_is_spliced(base + 2));
+    CU_ASSERT_FALSE(srcmgr_is_spliced(base_a));
+
+    uint32_t columns[][2] = { { 1, 1 }, { 2, 1 }, { 2, 2 }, { 2, 3 }, { 2, 6 }, { 2, 7 } };
+    for (size_t i = 0; i < countof(columns); ++i) {
+        CU_ASSERT_FALSE(srcmgr_locate(base + i, &sl));
+        CU_ASSERT_EQUAL(sl.line, columns[i][0]);
+        CU_ASSERT_EQUAL(sl.column, columns[i][1]);
+    }
+
+    // Location space is limited to 32 bits
+    CU_ASSERT_EQUAL(srcmgr_add("big", a, UINT32_MAX, &base), EOVERFLOW);
+
+    // Removed sources give their ranges back
+    srcmgr_remove(base_b);
+    CU_ASSERT_EQUAL(srcmgr_locate(base_b, &sl), ENOENT);
+    CU_ASSERT_FALSE(srcmgr_locate(base_c, &sl));
+    CU_ASSERT_STRING_EQUAL(sl.name, "c.h");
+
+    // Space past the last source runs out, then gaps are reused
+    uint32_t big_size = UINT32_MAX / 3;
+    uint32_t bigs[3] = { 0 };
+    CU_ASSERT_FALSE(srcmgr_add("big1", a, big_size, &bigs[0]));
+    CU_ASSERT_FALSE(srcmgr_add("big2", a, big_size, &bigs[1]));
+    CU_ASSERT_EQUAL(srcmgr_add("big3", a, big_size, &bigs[2]), EOVERFLOW);
+
+    srcmgr_remove(bigs[0]);
+    CU_ASSERT_FALSE(srcmgr_add("big3", a, big_size, &bigs[2]));
+    CU_ASSERT_EQUAL(bigs[2], bigs[0]);
+    CU_ASSERT_EQUAL(srcmgr_source(bigs[2] + big_size, &base), a);
+    CU_ASSERT_EQUAL(base, bigs[2]);
+    CU_ASSERT_FALSE(srcmgr_locate(base_c, &sl));
+    CU_ASSERT_STRING_EQUAL(sl.name, "c.h");
+
+    // Removing the last source frees the space past it
+    srcmgr_remove(bigs[1]);
+    CU_ASSERT_FALSE(srcmgr_add("big2", a, big_size, &bigs[1]));
+    srcmgr_remove(bigs[1]);
+    srcmgr_remove(bigs[2]);
+    srcmgr_remove(bigs[2]);
+}
+TEST_ADD(srcmgr_test);
+
+#endif
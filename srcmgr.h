@@ -0,0 +1,94 @@
+/*
+ * srcmgr.h
+ * Source manager: maps global source offsets back to files, lines and columns
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief   Resolved source location
+ */
+typedef struct source_location
+{
+    const char* name;   /* Source name as it was registered */
+    uint32_t line;      /* 1-based */
+    uint32_t column;    /* 1-based, in bytes */
+} source_location_t;
+
+/**
+ * \brief   Point where lexed text differs from the original source because of line splicing or trigraphs
+ *
+ * From 'offset' on, byte at offset X of the lexed text was at X + 'delta' in the original text
+ */
+typedef struct source_splice
+{
+    uint32_t offset;
+    uint32_t delta;
+} source_splice_t;
+
+/**
+ * \brief   Register source text and reserve a range of global offsets for it
+ *
+ * Sources are laid out one after another in a single 32-bit location space, so a token only needs
+ * to remember one offset. Location 0 is never handed out.
+ * The space is shared by all contexts and threads, sources registered at the same time can not take
+ * more than 4GB in total. Ranges of removed sources are reused.
+ * Source data is not copied and must stay valid while locations inside of it are resolved.
+ *
+ * \param   base    Receives global offset of the first byte, range covers 'size' + 1 offsets
+ *                  so that the end of the source has a location too
+ * \return  0 on success, EOVERFLOW if location space is exhausted, system error code on failure
+ */
+int srcmgr_add(const char* name, const char* data, size_t size, uint32_t* base);
+
+/**
+ * \brief   Register lexed text that went through line splicing or trigraph replacement
+ *
+ * Locations are offsets into 'data', lines and columns are reported for the original text in 'raw'.
+ * Splice table is sorted by offset and is not copied either.
+ *
+ * \return  0 on success, EOVERFLOW if location space is exhausted, system error code on failure
+ */
+int srcmgr_add_spliced(const char* name, const char* data, size_t size, const char* raw, size_t raw_size,
+                       const source_splice_t* splices, size_t splice_count, uint32_t* base);
+
+/**
+ * \brief   Find source text containing a location
+ *
+ * \param   base    Receives global offset of the source start
+ * \return  Source data, NULL if location does not belong to any source
+ */
+const char* srcmgr_source(uint32_t loc, uint32_t* base);
+
+/**
+ * \brief   Check if text at a location went through line splicing or trigraph replacement
+ */
+bool srcmgr_is_spliced(uint32_t loc);
+
+/**
+ * \brief   Resolve a location to source name, line and column
+ *
+ * Line table of a source is built on the first lookup into it.
+ *
+ * \return  0 on success, ENOENT if location does not belong to any source, system error code on failure
+ */
+int srcmgr_locate(uint32_t loc, source_location_t* out);
+
+/**
+ * \brief   Forget a source and give its range of locations back
+ *
+ * Locations inside the source are no longer valid, the range may be handed out to another source.
+ * Unknown bases are ignored.
+ */
+void srcmgr_remove(uint32_t base);
+
+/**
+ * \brief   Forget all registered sources
+ *
+ * Previously returned locations and names are no longer valid
+ */
+void srcmgr_reset(void);
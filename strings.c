@@ -1,4 +1,5 @@
 #include "strings.h"
+#include "context.h"
 #include "arena.h"
 #include "list.h"
 #include "test.h"
@@ -8,114 +9,186 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 //////////////////////////////////////////////////////////////////////////////
 
-#define HASH_KEY_TYPE const char*
+// Keys carry their length and hash, so lookups never need a null-terminated string or rehashing
+typedef struct
+{
+    const char* ptr;
+    size_t len;
+    uint32_t hash;
+} string_key_t;
+
+#define HASH_KEY_TYPE string_key_t
 #define HASH_VALUE_TYPE const char*
 #define HASH_FUNC strhash
 #define HASH_KEY_CMP_FUNC strcomp
 #define HASH_PREFIX string_table
 
-// http://www.cse.yorku.ca/~oz/hash.html
-static unsigned int sdbm(const char* str)
+uint32_t strings_hash(const char* str, size_t len)
 {
-    unsigned int hash = 0;
-    int c;
-
-    while ((c = *str++)) {
-        hash = c + (hash << 6) + (hash << 16) - hash;
+    uint32_t hash = 0;
+    for (size_t i = 0; i < len; ++i) {
+        hash = strings_hash_step(hash, str[i]);
     }
 
     return hash;
 }
 
-static uint32_t strhash(const char* key) {
-    return (uint32_t)sdbm(key);
+static uint32_t strhash(string_key_t key) {
+    // sdbm is weak in its lower bits which we use to pick a bucket
+    return key.hash ^ (key.hash >> 16);
 }
 
-static bool strcomp(const char* lhv, const char* rhv) {
-    return 0 == strcmp(lhv, rhv);
+static bool strcomp(string_key_t lhv, string_key_t rhv) {
+    return (lhv.hash == rhv.hash) && (lhv.len == rhv.len) && (0 == memcmp(lhv.ptr, rhv.ptr, lhv.len));
 }
 
 #include "small_object_set.inl"
 
-static arena_t* g_string_arena = NULL;
-static string_table_t* g_string_table = NULL;
-
-int strings_init(void)
+int strings_init(cc_context_t* ctx)
 {
-    if (g_string_table == NULL) {
-        assert(g_string_arena == NULL);
-        
-        g_string_arena = arena_create();
-        if (!g_string_arena) {
+    if (!ctx) {
+        return EINVAL;
+    }
+
+    if (ctx->string_table == NULL) {
+        assert(ctx->string_arena == NULL);
+
+        ctx->string_arena = arena_create();
+        if (!ctx->string_arena) {
             return ENOMEM;
         }
 
-        g_string_table = string_table_create();
-        if (!g_string_table) {
-            arena_destroy(g_string_arena);
+        ctx->string_table = string_table_create();
+        if (!ctx->string_table) {
+            arena_destroy(ctx->string_arena);
+            ctx->string_arena = NULL;
             return ENOMEM;
         }
+
+        pthread_mutex_init(&ctx->string_lock, NULL);
     }
 
     return 0;
 }
 
-string_t string(const char* str)
+string_t string_intern(cc_context_t* ctx, const char* str, size_t len, uint32_t hash)
 {
     if (!str) {
         return _MAKESTR(NULL);
     }
 
-    const char* res = string_table_search(g_string_table, str);
-    if (!res) {
-        res = arena_alloc(g_string_arena, strlen(str) + 1);
-        if (!res) {
-            return _MAKESTR(NULL);
-        }
+    string_key_t key = { str, len, hash };
 
-        strcpy((char*)res, str);
-        if (0 != string_table_insert(g_string_table, res, res)) {
-            arena_free(g_string_arena, (void*)res);
-            return _MAKESTR(NULL);
+    pthread_mutex_lock(&ctx->string_lock);
+    const char* res = string_table_search(ctx->string_table, key);
+    if (!res) {
+        // Info record goes right before string data, arena alignment is enough for it
+        string_info_t* info = (len < UINT32_MAX ? arena_alloc(ctx->string_arena, sizeof(*info) + len + 1) : NULL);
+        if (info) {
+            memset(info, 0, sizeof(*info));
+            info->length = (uint32_t)len;
+
+            char* copy = (char*)(info + 1);
+            memcpy(copy, str, len);
+            copy[len] = '\0';
+
+            key.ptr = copy;
+            if (0 == string_table_insert(ctx->string_table, key, copy)) {
+                res = copy;
+            } else {
+                arena_free(ctx->string_arena, info);
+            }
         }
     }
+    pthread_mutex_unlock(&ctx->string_lock);
 
     return _MAKESTR(res);
 }
 
-static void strings_destroy(void)
+string_t string(cc_context_t* ctx, const char* str)
 {
-    if (g_string_table) {
-        assert(g_string_arena);
-        arena_destroy(g_string_arena);
-        string_table_destroy(g_string_table);
+    if (!str) {
+        return _MAKESTR(NULL);
     }
 
-    g_string_table = NULL;
-    g_string_arena = NULL;
+    size_t len = strlen(str);
+    return string_intern(ctx, str, len, strings_hash(str, len));
+}
+
+void strings_destroy(cc_context_t* ctx)
+{
+    if (!ctx || !ctx->string_table) {
+        return;
+    }
+
+    assert(ctx->string_arena);
+    arena_destroy(ctx->string_arena);
+    string_table_destroy(ctx->string_table);
+    pthread_mutex_destroy(&ctx->string_lock);
+
+    ctx->string_table = NULL;
+    ctx->string_arena = NULL;
 }
 
 #if defined(TEST)
 static void strings_test(void)
 {
-    int error = strings_init();
+    cc_context_t ctx = { 0 };
+    int error = strings_init(&ctx);
     CU_ASSERT_FALSE(error);
 
-    string_t s1 = string("lol");
+    string_t s1 = string(&ctx, "lol");
     CU_ASSERT(_S(s1) != NULL);
 
-    string_t s2 = string("wtf");
+    string_t s2 = string(&ctx, "wtf");
     CU_ASSERT(_S(s2) != NULL);    
     CU_ASSERT(_S(s1) != _S(s2));
 
-    string_t s3 = string("lol");
+    string_t s3 = string(&ctx, "lol");
     CU_ASSERT(_S(s3) != NULL);
     CU_ASSERT(_S(s3) == _S(s1));
 
-    strings_destroy();
+    // Not null-terminated input
+    const char* buf = "lolwtf";
+    string_t s4 = string_intern(&ctx, buf, 3, strings_hash(buf, 3));
+    CU_ASSERT(_S(s4) == _S(s1));
+
+    string_t s5 = string_intern(&ctx, buf + 3, 3, strings_hash(buf + 3, 3));
+    CU_ASSERT(_S(s5) == _S(s2));
+
+    string_t s6 = string_intern(&ctx, buf, 2, strings_hash(buf, 2));
+    CU_ASSERT(_S(s6) != NULL);
+    CU_ASSERT(_S(s6) != _S(s1));
+    CU_ASSERT(0 == strcmp(_S(s6), "lo"));
+
+    // Info records start empty and stay with the string
+    string_info_t* info = string_info(s1);
+    CU_ASSERT_EQUAL(info->macro, NULL);
+    CU_ASSERT_EQUAL(info->length, 3);
+    CU_ASSERT_EQUAL(info->keyword, 0);
+    CU_ASSERT_EQUAL(info->flags, 0);
+    CU_ASSERT_EQUAL(string_info(s6)->length, 2);
+
+    info->macro = &s1;
+    info->flags |= kStringInfoTypedef;
+    CU_ASSERT_EQUAL(string_info(string(&ctx, "lol"))->macro, &s1);
+    CU_ASSERT_EQUAL(string_info(s3)->flags, kStringInfoTypedef);
+    CU_ASSERT_EQUAL(string_info(s2)->macro, NULL);
+
+    // Another context has strings and records of its own
+    cc_context_t other = { 0 };
+    CU_ASSERT_FALSE(strings_init(&other));
+    string_t s7 = string(&other, "lol");
+    CU_ASSERT(_S(s7) != NULL);
+    CU_ASSERT(_S(s7) != _S(s1));
+    CU_ASSERT_EQUAL(string_info(s7)->macro, NULL);
+    strings_destroy(&other);
+
+    strings_destroy(&ctx);
 }
 TEST_ADD(strings_test);
 #endif // TEST
@@ -176,7 +249,8 @@ static inline bool string_cmp(string_t lhv, string_t rhv) {
 
 static void dict_test(void)
 {
-    int error = strings_init();
+    cc_context_t ctx = { 0 };
+    int error = strings_init(&ctx);
     CU_ASSERT_FALSE(error);
 
     dict_t* dict = dict_create();
@@ -185,11 +259,11 @@ static void dict_test(void)
     void* val = dict_search(dict, _MAKESTR("lol"));
     CU_ASSERT_EQUAL(val, NULL);
 
-    string_t key1 = string("lol");
+    string_t key1 = string(&ctx, "lol");
     error = dict_insert(dict, key1, &key1);
     CU_ASSERT_FALSE(error);
 
-    string_t key2 = string("wtf");
+    string_t key2 = string(&ctx, "wtf");
     error = dict_insert(dict, key2, &key2);
     CU_ASSERT_FALSE(error); 
 
@@ -206,13 +280,14 @@ static void dict_test(void)
     CU_ASSERT_EQUAL(dict_search(dict, key2), &key2);
 
     dict_destroy(dict);
-    strings_destroy();
+    strings_destroy(&ctx);
 }
 TEST_ADD(dict_test);
 
 static void dict_stress_test(void)
 {
-    int error = strings_init();
+    cc_context_t ctx = { 0 };
+    int error = strings_init(&ctx);
     CU_ASSERT_FALSE(error);
 
     dict_t* dict = dict_create();
@@ -221,7 +296,7 @@ static void dict_stress_test(void)
     for (unsigned i = 0; i < HASH_BUCKETS * 16; ++i) {
         char buf[32] = {0};
         snprintf(buf, sizeof(buf), "%u", i);
-        string_t str = string(buf);
+        string_t str = string(&ctx, buf);
         error = dict_insert(dict, str, &str);
         CU_ASSERT_FALSE(error);
     }
@@ -249,7 +324,7 @@ static void dict_stress_test(void)
     printf(" Dict stress stats: min = %zu, max = %zu, mid = %zu ", min, max, min + ((max - min) / 2));
 
     dict_destroy(dict);
-    strings_destroy();
+    strings_destroy(&ctx);
 }
 TEST_ADD(dict_stress_test);
 
@@ -5,11 +5,19 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief   Compiler context owning stored strings, see context.h
+ */
+typedef struct cc_context cc_context_t;
+
 /**
  * \brief   Stored string.
  * 
- * Implementation stores a single unique value per known string.
- * Instances can be tested for equality by comparing two pointers directly.
+ * Implementation stores a single unique value per known string in each context.
+ * Instances of the same context can be tested for equality by comparing two pointers directly.
  */
 typedef struct string
 {
@@ -29,20 +37,80 @@ typedef struct string
 #define _MAKESTR(str) (string_t){(str)}
 
 /**
- * \brief   Initialize string storage
+ * \brief   Mutable record kept in front of every stored string.
+ *
+ * Lets the scanner, preprocessor and parser answer "is this a keyword / macro / typedef name" for an identifier
+ * with a single dereference instead of dictionary lookups. Record starts zeroed, fields are owned by whoever
+ * sets them and are not protected by the string table lock. Every context has records of its own.
+ */
+typedef struct string_info
+{
+    void* macro;        /* Current macro definition, NULL if string does not name a macro */
+    uint32_t length;    /* String length without the terminating null */
+    uint16_t keyword;   /* keyword_kind_t + 1, 0 if string is not a keyword */
+    uint16_t flags;     /* string_info_flags_t */
+} string_info_t;
+
+typedef enum
+{
+    kStringInfoTypedef = 1 << 0,    /* Names a typedef in current scope */
+} string_info_flags_t;
+
+/**
+ * \brief   Info record of a stored string. 'str' must not be NULL.
+ */
+static inline string_info_t* string_info(string_t str)
+{
+    return (string_info_t*)_S(str) - 1;
+}
+
+/**
+ * \brief   Initialize string storage of a context, done by @cc_context_create
+ *
+ * \return  0 on success, system error code on failure
  */
-int strings_init(void);
+int strings_init(cc_context_t* ctx);
+
+/**
+ * \brief   Free all strings stored in a context, done by @cc_context_destroy
+ */
+void strings_destroy(cc_context_t* ctx);
 
 /**
  * \brief   Store a new string.
  *
- * \return  If any stored string compares equal to 'str', function will return already stored copy.
+ * \return  If any string stored in 'ctx' compares equal to 'str', function will return already stored copy.
  *          Otherwise a new string is created and returned.
  */
-string_t string(const char* str);
+string_t string(cc_context_t* ctx, const char* str);
+
+/**
+ * \brief   Store a new string given its length and hash.
+ *
+ * Allows callers that already walked over the string (e.g. scanner) to intern it without touching it again.
+ * 'str' does not have to be null-terminated, 'hash' must be computed with @strings_hash_step.
+ */
+string_t string_intern(cc_context_t* ctx, const char* str, size_t len, uint32_t hash);
+
+/**
+ * \brief   Feed next character into string hash value. Initial hash value is 0.
+ */
+static inline uint32_t strings_hash_step(uint32_t hash, char c)
+{
+    // http://www.cse.yorku.ca/~oz/hash.html (sdbm)
+    return (uint8_t)c + (hash << 6) + (hash << 16) - hash;
+}
+
+/**
+ * \brief   Hash a string of known length
+ */
+uint32_t strings_hash(const char* str, size_t len);
 
 /**
  * \brief   A dictionary maps string_t values to opaque data values
+ *
+ * Keys are compared by pointer, so a dictionary should only hold strings of one context.
+ * Dictionaries have no shared state and need no context of their own.
  */
 typedef struct dict dict_t;
 
@@ -0,0 +1,715 @@
+/*
+ * Cache files hold a token stream exactly as the scanner produced it, with locations made relative to the
+ * start of the source and string values replaced by indices into a table of unique strings stored at the
+ * end of the file. Loading a stream means mapping the file, copying token and value arrays and interning
+ * every unique string once.
+ *
+ * File layout, all integers are native endian:
+ *
+ *   tokcache_header_t
+ *   packed_token_t tokens[tokens]        // Locations are offsets into the source
+ *   token_value_t  values[values]        // Entry 0 is unused, string values hold an index into string table
+ *   uint32_t string_offsets[strings + 1] // Into string data
+ *   char     string_data[string_bytes]
+ */
+
+#include "tokcache.h"
+#include "strings.h"
+#include "support.h"
+#include "test.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+#define TOKCACHE_MAGIC      0x544c4853 // "SHLT"
+#define TOKCACHE_VERSION    8
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t keywords;      // Token kinds are only valid for the same token lists
+    uint32_t operators;
+    tokcache_hash_t content_hash;
+    uint64_t source_size;
+    uint32_t token_count;
+    uint32_t value_count;
+    uint32_t string_count;
+    uint32_t string_bytes;
+} tokcache_header_t;
+
+static char g_tokcache_dir[PATH_MAX];
+
+int tokcache_init(const char* dir)
+{
+    if (!dir) {
+        g_tokcache_dir[0] = '\0';
+        return 0;
+    }
+
+    if (strlen(dir) + 1 > sizeof(g_tokcache_dir)) {
+        return ENAMETOOLONG;
+    }
+
+    if (0 != mkdir(dir, 0777) && errno != EEXIST) {
+        return errno;
+    }
+
+    strcpy(g_tokcache_dir, dir);
+    return 0;
+}
+
+static const uint32_t g_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t sha256_rotr(uint32_t x, unsigned n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(uint32_t state[8], const uint8_t* block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t v[8];
+    memcpy(v, state, sizeof(v));
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = sha256_rotr(v[4], 6) ^ sha256_rotr(v[4], 11) ^ sha256_rotr(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + g_sha256_k[i] + w[i];
+        uint32_t s0 = sha256_rotr(v[0], 2) ^ sha256_rotr(v[0], 13) ^ sha256_rotr(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(*v));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        state[i] += v[i];
+    }
+}
+
+tokcache_hash_t tokcache_hash(const char* data, size_t size)
+{
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    const uint8_t* p = (const uint8_t*)data;
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        sha256_block(state, p + i);
+    }
+
+    // Padding is a one bit, zeros and the length in bits, it spills into a second block if the tail is long
+    uint8_t tail[128] = { 0 };
+    size_t rest = size - i;
+    if (rest) {
+        memcpy(tail, p + i, rest);
+    }
+
+    tail[rest] = 0x80;
+    size_t blocks = (rest + 9 <= 64 ? 1 : 2);
+    uint64_t bits = (uint64_t)size * 8;
+    for (int j = 0; j < 8; ++j) {
+        tail[blocks * 64 - 1 - j] = (uint8_t)(bits >> (j * 8));
+    }
+
+    for (size_t b = 0; b < blocks; ++b) {
+        sha256_block(state, tail + b * 64);
+    }
+
+    tokcache_hash_t hash;
+    for (int j = 0; j < 8; ++j) {
+        hash.bytes[j * 4] = (uint8_t)(state[j] >> 24);
+        hash.bytes[j * 4 + 1] = (uint8_t)(state[j] >> 16);
+        hash.bytes[j * 4 + 2] = (uint8_t)(state[j] >> 8);
+        hash.bytes[j * 4 + 3] = (uint8_t)state[j];
+    }
+
+    return hash;
+}
+
+static int tokcache_path(const tokcache_hash_t* hash, char* path, size_t size)
+{
+    char hex[TOKCACHE_HASH_SIZE * 2 + 1];
+    for (size_t i = 0; i < TOKCACHE_HASH_SIZE; ++i) {
+        snprintf(hex + i * 2, 3, "%02x", hash->bytes[i]);
+    }
+
+    int len = snprintf(path, size, "%s/%s.tok", g_tokcache_dir, hex);
+    return (len < 0 || (size_t)len >= size) ? ENAMETOOLONG : 0;
+}
+
+static size_t tokcache_file_size(const tokcache_header_t* hdr)
+{
+    return sizeof(*hdr)
+        + (size_t)hdr->token_count * sizeof(packed_token_t)
+        + (size_t)hdr->value_count * sizeof(token_value_t)
+        + ((size_t)hdr->string_count + 1) * sizeof(uint32_t)
+        + hdr->string_bytes;
+}
+
+// Value table entry of a token that holds a string
+static inline bool tokcache_string_value(const packed_token_t* t)
+{
+    return t->value && (t->type == kTokenIdentifier || t->type == kTokenStrConstant);
+}
+
+// Kinds, subkinds and flags come from the file, a corrupt one must not put enums out of range into the stream
+static bool tokcache_token_valid(const packed_token_t* t)
+{
+    static const unsigned subkinds[kTokenTotal] = {
+        [kTokenKeyword] = kKeywordTotal,
+        [kTokenOperator] = kOperatorTotal,
+        [kTokenIdentifier] = 1,
+        [kTokenIntConstant] = kIntegerTypeUnsignedLongLong + 1,
+        [kTokenFloatConstant] = kFloatTypeLongDouble + 1,
+        [kTokenStrConstant] = kEncodingWide + 1,
+        [kTokenCharConstant] = kEncodingWide + 1,
+    };
+
+    if (t->type >= kTokenTotal || t->subkind >= subkinds[t->type] ||
+        (t->flags & ~(kTokenFlagLineStart | kTokenFlagLeadingSpace)))
+    {
+        return false;
+    }
+
+    // Literal contents are found in the source past the prefix and the opening quote
+    bool literal = (t->type == kTokenStrConstant || t->type == kTokenCharConstant);
+    size_t prefix = (t->subkind == kEncodingDefault ? 0 : t->subkind == kEncodingUtf8 ? 2 : 1);
+    if (literal && t->length < prefix + 2) {
+        return false;
+    }
+
+    // Keywords and operators never have values, string literals only when they have escapes, everything else always
+    bool has_value = (t->value != 0);
+    return (t->type == kTokenKeyword || t->type == kTokenOperator) ? !has_value :
+           (t->type == kTokenStrConstant) ? true : has_value;
+}
+
+// Load cached stream for 'hash' and 'size' at source location 'base', returns ENOENT on cache miss and EINVAL on a bad cache file
+static int tokcache_load(cc_context_t* ctx, const char* path, const tokcache_hash_t* hash, size_t size, uint32_t base,
+                         token_stream_t* out)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return ENOENT;
+    }
+
+    struct stat st;
+    if (0 != fstat(fd, &st) || (size_t)st.st_size < sizeof(tokcache_header_t)) {
+        close(fd);
+        return EINVAL;
+    }
+
+    const uint8_t* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return errno;
+    }
+
+    tokcache_header_t hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+
+    int error = 0;
+    if (hdr.magic != TOKCACHE_MAGIC || hdr.version != TOKCACHE_VERSION ||
+        hdr.keywords != kKeywordTotal || hdr.operators != kOperatorTotal ||
+        0 != memcmp(&hdr.content_hash, hash, sizeof(*hash)) || hdr.source_size != size || hdr.value_count == 0 ||
+        tokcache_file_size(&hdr) != (size_t)st.st_size)
+    {
+        error = EINVAL;
+        goto done;
+    }
+
+    size_t n = hdr.token_count;
+    const packed_token_t* tokens = (const packed_token_t*)(data + sizeof(hdr));
+    const token_value_t* values = (const token_value_t*)(tokens + n);
+    const uint32_t* string_offsets = (const uint32_t*)(values + hdr.value_count);
+    const char* string_data = (const char*)(string_offsets + hdr.string_count + 1);
+
+    string_t* strings = malloc(hdr.string_count * sizeof(*strings) + 1);
+    if (!strings) {
+        error = ENOMEM;
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < hdr.string_count; ++i) {
+        uint32_t from = string_offsets[i];
+        uint32_t to = string_offsets[i + 1];
+        if (from > to || to > hdr.string_bytes) {
+            error = EINVAL;
+            goto free_strings;
+        }
+
+        strings[i] = string_intern(ctx, string_data + from, to - from, strings_hash(string_data + from, to - from));
+        if (!_S(strings[i])) {
+            error = ENOMEM;
+            goto free_strings;
+        }
+    }
+
+    // Tokens are copied as is, string values are the only ones that need fixing up
+    token_stream_t loaded = {
+        .count = n,
+        .capacity = n,
+        .tokens = (packed_token_t*)tokens,
+        .value_count = hdr.value_count,
+        .value_capacity = hdr.value_count,
+    };
+
+    loaded.values = malloc(hdr.value_count * sizeof(*loaded.values));
+    if (!loaded.values) {
+        error = ENOMEM;
+        goto free_strings;
+    }
+
+    memcpy(loaded.values, values, hdr.value_count * sizeof(*loaded.values));
+
+    for (size_t i = 0; i < n; ++i) {
+        const packed_token_t* t = &tokens[i];
+        if (!tokcache_token_valid(t) || (uint64_t)t->loc + t->length > size ||
+            t->value + packed_token_values(t) > hdr.value_count)
+        {
+            error = EINVAL;
+            break;
+        }
+
+        if (tokcache_string_value(t)) {
+            uint64_t index = values[t->value].intval;
+            // Decoded length of a string literal is what readers trust, it has to be the length of its string
+            if (index >= hdr.string_count || (t->type == kTokenStrConstant &&
+                values[t->value + 1].intval != string_offsets[index + 1] - string_offsets[index]))
+            {
+                error = EINVAL;
+                break;
+            }
+
+            loaded.values[t->value].str = strings[index];
+        }
+    }
+
+    if (!error) {
+        size_t at = out->count;
+        error = token_stream_append(out, &loaded, 0, n);
+        for (size_t i = at; !error && i < out->count; ++i) {
+            out->tokens[i].loc += base;
+        }
+    }
+
+    free(loaded.values);
+
+free_strings:
+    free(strings);
+
+done:
+    munmap((void*)data, st.st_size);
+    return error;
+}
+
+// Store tokens [first, count) of a stream lexed at source location 'base',
+// written to a temporary file first so readers never see partial files
+static int tokcache_store(const char* path, const tokcache_hash_t* hash, size_t size, uint32_t base,
+                          const token_stream_t* ts, size_t first)
+{
+    tokcache_header_t hdr = {
+        .magic = TOKCACHE_MAGIC,
+        .version = TOKCACHE_VERSION,
+        .keywords = kKeywordTotal,
+        .operators = kOperatorTotal,
+        .content_hash = *hash,
+        .source_size = size,
+        .token_count = ts->count - first,
+        .value_count = 1,
+    };
+
+    size_t n = hdr.token_count;
+    for (size_t i = 0; i < n; ++i) {
+        hdr.value_count += packed_token_values(&ts->tokens[first + i]);
+    }
+
+    packed_token_t* tokens = malloc(n * sizeof(*tokens) + 1);
+    token_value_t* values = malloc(hdr.value_count * sizeof(*values));
+    uint32_t* string_offsets = malloc((n + 1) * sizeof(*string_offsets));
+    const char** strings = malloc(n * sizeof(*strings) + 1);
+    dict_t* indices = dict_create();
+
+    int error = 0;
+    if (!tokens || !values || !string_offsets || !strings || !indices) {
+        error = ENOMEM;
+        goto done;
+    }
+
+    // Values are packed in token order, unique strings in order of first use, dictionary maps them to index + 1
+    size_t next = 1;
+    values[0].intval = 0;
+    string_offsets[0] = 0;
+    for (size_t i = 0; i < n; ++i) {
+        packed_token_t* t = &tokens[i];
+        *t = ts->tokens[first + i];
+        t->loc -= base;
+
+        size_t count = packed_token_values(t);
+        if (!count) {
+            continue;
+        }
+
+        memcpy(values + next, ts->values + t->value, count * sizeof(*values));
+        t->value = next;
+        next += count;
+
+        if (!tokcache_string_value(t)) {
+            continue;
+        }
+
+        string_t str = values[t->value].str;
+        uintptr_t index = (uintptr_t)dict_search(indices, str);
+        if (index == 0) {
+            index = ++hdr.string_count;
+            error = dict_insert(indices, str, (void*)index);
+            if (error) {
+                goto done;
+            }
+
+            // Decoded string literals may have zeros in them
+            strings[index - 1] = _S(str);
+            hdr.string_bytes += (t->type == kTokenStrConstant ? values[t->value + 1].intval : strlen(_S(str)));
+            string_offsets[index] = hdr.string_bytes;
+        }
+
+        values[t->value].intval = index - 1;
+    }
+
+    // Unique name, other threads and processes may be storing the same stream right now
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+        error = ENAMETOOLONG;
+        goto done;
+    }
+
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        error = errno;
+        goto done;
+    }
+
+    // Cache is shared, temporary files are created private
+    FILE* f = (0 == fchmod(fd, 0644) ? fdopen(fd, "wb") : NULL);
+    if (!f) {
+        error = errno;
+        close(fd);
+        unlink(tmp);
+        goto done;
+    }
+
+    bool ok = (1 == fwrite(&hdr, sizeof(hdr), 1, f))
+        && (n == fwrite(tokens, sizeof(*tokens), n, f))
+        && (hdr.value_count == fwrite(values, sizeof(*values), hdr.value_count, f))
+        && (hdr.string_count + 1 == fwrite(string_offsets, sizeof(uint32_t), hdr.string_count + 1, f));
+
+    for (uint32_t i = 0; ok && i < hdr.string_count; ++i) {
+        size_t len = string_offsets[i + 1] - string_offsets[i];
+        ok = (len == fwrite(strings[i], 1, len, f));
+    }
+
+    ok = (0 == fclose(f)) && ok;
+    if (!ok || 0 != rename(tmp, path)) {
+        error = EIO;
+        unlink(tmp);
+    }
+
+done:
+    if (indices) {
+        dict_destroy(indices);
+    }
+
+    free(strings);
+    free(string_offsets);
+    free(values);
+    free(tokens);
+    return error;
+}
+
+int tokcache_lex(cc_context_t* ctx, input_buffer_t* in, token_stream_t* out)
+{
+    if (!ctx || !in || !out) {
+        return EINVAL;
+    }
+
+    const char* data = buffer_get_data(in);
+    size_t size = buffer_get_size(in);
+
+    // Cached streams cover whole buffers
+    if (!g_tokcache_dir[0] || buffer_get_offset(in) != 0) {
+        int error = lex_batch(ctx, in, out, size - buffer_get_offset(in) + 1);
+        return error == -1 ? 0 : error;
+    }
+
+    uint32_t base = 0;
+    int error = buffer_get_base(in, &base);
+    if (error) {
+        return error;
+    }
+
+    tokcache_hash_t hash = tokcache_hash(data, size);
+
+    char path[PATH_MAX];
+    error = tokcache_path(&hash, path, sizeof(path));
+    if (!error) {
+        error = tokcache_load(ctx, path, &hash, size, base, out);
+        if (!error) {
+            buffer_set_offset(in, size);
+            return 0;
+        }
+    }
+
+    size_t first = out->count;
+    error = lex_batch(ctx, in, out, size + 1);
+    if (error == -1) {
+        error = 0;
+    }
+
+    // Cache is an optimization, failing to store is not an error
+    if (!error) {
+        (void) tokcache_store(path, &hash, size, base, out, first);
+    }
+
+    return error;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(TEST)
+
+#include "context.h"
+
+// Streams lexed from different buffers of the same contents, values are compared as stored
+static bool token_stream_equal(const token_stream_t* a, uint32_t base_a, const token_stream_t* b, uint32_t base_b)
+{
+    if (a->count != b->count || a->value_count != b->value_count ||
+        0 != memcmp(a->values, b->values, a->value_count * sizeof(*a->values)))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < a->count; ++i) {
+        packed_token_t t = b->tokens[i];
+        t.loc = t.loc - base_b + base_a;
+        if (0 != memcmp(&a->tokens[i], &t, sizeof(t))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void tokcache_test(void)
+{
+    cc_context_t* ctx = cc_context_create();
+    CU_ASSERT_FATAL(ctx != NULL);
+
+    char dir[] = "/tmp/shlang-tokcache-XXXXXX";
+    CU_ASSERT(NULL != mkdtemp(dir));
+    CU_ASSERT_FALSE(tokcache_init(dir));
+
+    char src[] = "unsigned long x = 0x10 /* comment */ + x_y\nreturn x_y << 2 \"a\\0b\" \"a\" 'c' 1.5f\n";
+    size_t size = sizeof(src) - 1;
+
+    token_stream_t expected;
+    token_stream_t cached;
+    token_stream_init(&expected);
+    token_stream_init(&cached);
+
+    uint32_t base = 0;
+    uint32_t cached_base = 0;
+    input_buffer_t* ib = buffer_mem(src, size);
+    CU_ASSERT_EQUAL(lex_batch(ctx, ib, &expected, size), 0);
+    CU_ASSERT_FALSE(buffer_get_base(ib, &base));
+    buffer_close(ib);
+
+    tokcache_hash_t hash = tokcache_hash(src, size);
+    char path[PATH_MAX];
+    CU_ASSERT_FALSE(tokcache_path(&hash, path, sizeof(path)));
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size, base, &cached), ENOENT);
+
+    // Miss stores the stream, then it is loaded from the cache
+    for (int i = 0; i < 2; ++i) {
+        cached.count = 0;
+        cached.value_count = 0;
+        ib = buffer_mem(src, size);
+        CU_ASSERT_EQUAL(tokcache_lex(ctx, ib, &cached), 0);
+        CU_ASSERT_EQUAL(buffer_get_offset(ib), size);
+        CU_ASSERT_FALSE(buffer_get_base(ib, &cached_base));
+        CU_ASSERT(token_stream_equal(&expected, base, &cached, cached_base));
+        buffer_close(ib);
+    }
+
+    cached.count = 0;
+    cached.value_count = 0;
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size, base, &cached), 0);
+    CU_ASSERT(token_stream_equal(&expected, base, &cached, base));
+
+    // Appending keeps tokens already in the stream
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size, base, &cached), 0);
+    CU_ASSERT_EQUAL(cached.count, expected.count * 2);
+
+    // Truncated files and files for other contents are rejected
+    tokcache_hash_t other = hash;
+    other.bytes[TOKCACHE_HASH_SIZE - 1] ^= 1;
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &other, size, base, &cached), EINVAL);
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size - 1, base, &cached), EINVAL);
+
+    CU_ASSERT_FALSE(truncate(path, sizeof(tokcache_header_t) + 4));
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size, base, &cached), EINVAL);
+
+    // Bad cache file is replaced
+    cached.count = 0;
+    cached.value_count = 0;
+    ib = buffer_mem(src, size);
+    CU_ASSERT_EQUAL(tokcache_lex(ctx, ib, &cached), 0);
+    CU_ASSERT_FALSE(buffer_get_base(ib, &cached_base));
+    CU_ASSERT(token_stream_equal(&expected, base, &cached, cached_base));
+    buffer_close(ib);
+
+    cached.count = 0;
+    cached.value_count = 0;
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size, base, &cached), 0);
+    CU_ASSERT(token_stream_equal(&expected, base, &cached, base));
+
+    // Token kinds out of range are rejected, even when the file is otherwise well formed
+    FILE* f = fopen(path, "r+b");
+    CU_ASSERT_FATAL(f != NULL);
+    packed_token_t bad;
+    CU_ASSERT_EQUAL(0, fseek(f, sizeof(tokcache_header_t), SEEK_SET));
+    CU_ASSERT_EQUAL(1, fread(&bad, sizeof(bad), 1, f));
+    bad.subkind = kKeywordTotal;
+    CU_ASSERT_EQUAL(0, fseek(f, sizeof(tokcache_header_t), SEEK_SET));
+    CU_ASSERT_EQUAL(1, fwrite(&bad, sizeof(bad), 1, f));
+    CU_ASSERT_EQUAL(0, fclose(f));
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size, base, &cached), EINVAL);
+
+    // So are string literals with lengths that do not match their contents
+    CU_ASSERT_FALSE(tokcache_store(path, &hash, size, base, &expected, 0));
+    for (int pass = 0; pass < 2; ++pass) {
+        uint8_t file[4096];
+        f = fopen(path, "rb");
+        CU_ASSERT_FATAL(f != NULL);
+        size_t file_size = fread(file, 1, sizeof(file), f);
+        CU_ASSERT_EQUAL(0, fclose(f));
+        CU_ASSERT_FATAL(file_size > sizeof(tokcache_header_t) && file_size < sizeof(file));
+
+        tokcache_header_t hdr;
+        memcpy(&hdr, file, sizeof(hdr));
+        packed_token_t* tokens = (packed_token_t*)(file + sizeof(hdr));
+        token_value_t* values = (token_value_t*)(tokens + hdr.token_count);
+
+        // "a\0b" has its decoded contents in a value, "a" is read from the source
+        size_t patched = 0;
+        for (size_t i = 0; i < hdr.token_count; ++i) {
+            packed_token_t* t = &tokens[i];
+            bool decoded = (pass == 0);
+            if (t->type != kTokenStrConstant || (t->value != 0) != decoded) {
+                continue;
+            }
+
+            if (t->value) {
+                values[t->value + 1].intval = 1u << 30;
+            } else {
+                t->length = 1;
+            }
+
+            ++patched;
+        }
+
+        CU_ASSERT_EQUAL(patched, 1);
+        f = fopen(path, "wb");
+        CU_ASSERT_FATAL(f != NULL);
+        CU_ASSERT_EQUAL(file_size, fwrite(file, 1, file_size, f));
+        CU_ASSERT_EQUAL(0, fclose(f));
+        CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size, base, &cached), EINVAL);
+
+        cached.count = 0;
+        cached.value_count = 0;
+        ib = buffer_mem(src, size);
+        CU_ASSERT_EQUAL(tokcache_lex(ctx, ib, &cached), 0);
+        CU_ASSERT_FALSE(buffer_get_base(ib, &cached_base));
+        CU_ASSERT(token_stream_equal(&expected, base, &cached, cached_base));
+        buffer_close(ib);
+    }
+
+    // Temporary files get unique names, concurrent stores of one stream do not step on each other
+    CU_ASSERT_FALSE(unlink(path));
+    CU_ASSERT_FALSE(tokcache_store(path, &hash, size, base, &expected, 0));
+    CU_ASSERT_FALSE(tokcache_store(path, &hash, size, base, &expected, 0));
+    cached.count = 0;
+    cached.value_count = 0;
+    CU_ASSERT_EQUAL(tokcache_load(ctx, path, &hash, size, base, &cached), 0);
+    CU_ASSERT(token_stream_equal(&expected, base, &cached, base));
+
+    // Hash is SHA-256, checked against known digests
+    struct {
+        const char* text;
+        const char* digest;
+    } vectors[] = {
+        { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+        { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    };
+
+    for (size_t i = 0; i < countof(vectors); ++i) {
+        tokcache_hash_t h = tokcache_hash(vectors[i].text, strlen(vectors[i].text));
+        char hex[TOKCACHE_HASH_SIZE * 2 + 1];
+        for (size_t j = 0; j < TOKCACHE_HASH_SIZE; ++j) {
+            snprintf(hex + j * 2, 3, "%02x", h.bytes[j]);
+        }
+
+        CU_ASSERT_STRING_EQUAL(hex, vectors[i].digest);
+    }
+
+    // Different contents hash differently
+    src[0] = 'U';
+    other = tokcache_hash(src, size);
+    CU_ASSERT(0 != memcmp(&other, &hash, sizeof(hash)));
+    hash = tokcache_hash(src, size - 1);
+    CU_ASSERT(0 != memcmp(&other, &hash, sizeof(hash)));
+
+    CU_ASSERT_FALSE(unlink(path));
+    CU_ASSERT_FALSE(rmdir(dir));
+    CU_ASSERT_FALSE(tokcache_init(NULL));
+
+    token_stream_destroy(&expected);
+    token_stream_destroy(&cached);
+
+    cc_context_destroy(ctx);
+}
+TEST_ADD(tokcache_test);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * tokcache.h
+ * Persistent token cache
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include "scanner.h"
+
+#include <stdint.h>
+
+/**
+ * \brief   Set token cache directory
+ *
+ * Directory is created if it does not exist. NULL disables the cache.
+ *
+ * \return  0 on success, system error code on failure
+ */
+int tokcache_init(const char* dir);
+
+#define TOKCACHE_HASH_SIZE 32
+
+/**
+ * \brief   Content hash used as a cache key, SHA-256 of the contents
+ */
+typedef struct tokcache_hash
+{
+    uint8_t bytes[TOKCACHE_HASH_SIZE];
+} tokcache_hash_t;
+
+/**
+ * \brief   Hash buffer contents
+ *
+ * Cache files are found by hash alone, so it has to be collision resistant
+ */
+tokcache_hash_t tokcache_hash(const char* data, size_t size);
+
+/**
+ * \brief   Lex the whole input buffer through the token cache and append tokens to a stream
+ *
+ * Cached token streams are stored in the cache directory under the hash of the buffer contents.
+ * If there is one for this buffer it is mapped and loaded instead of scanning the buffer,
+ * otherwise buffer is lexed with @lex_batch and the result is stored for the next time.
+ * Input that does not lex cleanly is never cached. Strings of the tokens are stored in 'ctx' either way.
+ *
+ * \return  0 on success,
+ *          system error code if input could not be parsed. Tokens preceding the error are still appended.
+ */
+int tokcache_lex(cc_context_t* ctx, input_buffer_t* in, token_stream_t* out);
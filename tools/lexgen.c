@@ -0,0 +1,625 @@
+/*
+ * Lexer table generator.
+ *
+ * Reads keyword and operator lists from tokens.def and prints C tables to be included by the scanner:
+ *
+ * - Operator DFA. Operators and digraphs are inserted into a trie, then bytes that behave identically in every state
+ *   are merged into byte classes to keep the transition table dense. Bytes that can only be a punctuator
+ *   on their own get a direct lookup table.
+ *
+ * - Keyword minimal perfect hash. Scanner hashes every identifier while reading it, so keywords are classified
+ *   by that hash alone: keys are split into buckets and every bucket gets a displacement value that maps
+ *   all of its keys into free slots of a table exactly as large as the keyword list.
+ *
+ * - 128-bit approximations of powers of five for floating constant conversion (Eisel-Lemire).
+ *
+ * - Characters allowed in extended identifiers (C11 Annex D) as a two-stage bitmap: every block of 256 code points
+ *   maps to one of a few distinct 256-bit blocks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "support.h"
+#include "strings.h"
+
+static const char* g_keywords[] = {
+#define SHL_KEYWORD(name, str) str,
+#include "tokens.def"
+#undef SHL_KEYWORD
+};
+
+static const char* g_operators[] = {
+#define SHL_OPERATOR(name, str) str,
+#include "tokens.def"
+#undef SHL_OPERATOR
+};
+
+enum {
+#define SHL_OPERATOR(name, str) kOperator##name,
+#include "tokens.def"
+#undef SHL_OPERATOR
+};
+
+static const struct {
+    const char* str;
+    unsigned index;
+} g_digraphs[] = {
+#define SHL_DIGRAPH(name, str) { str, kOperator##name },
+#include "tokens.def"
+#undef SHL_DIGRAPH
+};
+
+#define MAX_STATES      1024
+
+// Keep in sync with what we print in the table header
+enum {
+    kAcceptNone = 0,
+    kAcceptOperator,
+};
+
+enum {
+    kStateDead = 0,
+    kStateStart,
+};
+
+typedef struct
+{
+    unsigned next[256];
+    unsigned accept;
+    unsigned index;
+} state_t;
+
+static state_t g_states[MAX_STATES];
+static unsigned g_total_states = 0;
+
+static unsigned g_max_length = 0;
+static unsigned g_single[256];      // Operator index + 1 for complete single byte punctuators
+
+static unsigned g_classes[256];
+static unsigned g_class_repr[256];  // Representative byte for each class
+static unsigned g_total_classes = 0;
+
+static unsigned new_state(void)
+{
+    if (g_total_states == MAX_STATES) {
+        fprintf(stderr, "lexgen: too many states\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return g_total_states++;
+}
+
+static void insert(const char* str, unsigned accept, unsigned index)
+{
+    unsigned s = kStateStart;
+    for (const unsigned char* p = (const unsigned char*)str; *p; ++p) {
+        if (g_states[s].next[*p] == kStateDead) {
+            g_states[s].next[*p] = new_state();
+        }
+        s = g_states[s].next[*p];
+    }
+
+    if (g_states[s].accept != kAcceptNone) {
+        fprintf(stderr, "lexgen: duplicate token '%s'\n", str);
+        exit(EXIT_FAILURE);
+    }
+
+    if (strlen(str) > g_max_length) {
+        g_max_length = strlen(str);
+    }
+
+    g_states[s].accept = accept;
+    g_states[s].index = index;
+}
+
+static void build_dfa(void)
+{
+    (void) new_state(); // kStateDead
+    (void) new_state(); // kStateStart
+
+    for (size_t i = 0; i < countof(g_operators); ++i) {
+        insert(g_operators[i], kAcceptOperator, i);
+    }
+
+    for (size_t i = 0; i < countof(g_digraphs); ++i) {
+        insert(g_digraphs[i].str, kAcceptOperator, g_digraphs[i].index);
+    }
+
+    // Punctuators that no longer token starts with
+    for (unsigned c = 0; c < 256; ++c) {
+        unsigned s = g_states[kStateStart].next[c];
+        if (s == kStateDead || g_states[s].accept != kAcceptOperator) {
+            continue;
+        }
+
+        unsigned k;
+        for (k = 0; k < 256 && g_states[s].next[k] == kStateDead; ++k) {
+        }
+
+        if (k == 256) {
+            g_single[c] = g_states[s].index + 1;
+        }
+    }
+
+    if (g_total_states > UINT16_MAX) {
+        fprintf(stderr, "lexgen: too many states\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Bytes are equivalent if they lead to the same state from every state
+static void build_classes(void)
+{
+    for (unsigned c = 0; c < 256; ++c) {
+        unsigned k;
+        for (k = 0; k < g_total_classes; ++k) {
+            unsigned r = g_class_repr[k];
+
+            unsigned s;
+            for (s = 0; s < g_total_states; ++s) {
+                if (g_states[s].next[c] != g_states[s].next[r]) {
+                    break;
+                }
+            }
+
+            if (s == g_total_states) {
+                break;
+            }
+        }
+
+        if (k == g_total_classes) {
+            g_class_repr[g_total_classes++] = c;
+        }
+
+        g_classes[c] = k;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+#define KEYWORD_TOTAL       countof(g_keywords)
+#define KEYWORD_BUCKETS     ((KEYWORD_TOTAL + 1) / 2)
+#define MAX_DISPLACEMENT    (1u << 24)
+
+// Printed verbatim into the generated file, scanner has to use exactly the same mixing
+#define KEYWORD_MIX_FUNC \
+    "static inline uint32_t keyword_hash_mix(uint32_t x)\n"    \
+    "{\n"                                                       \
+    "    x = ((x >> 16) ^ x) * 0x45d9f3b;\n"                    \
+    "    x = ((x >> 16) ^ x) * 0x45d9f3b;\n"                    \
+    "    return (x >> 16) ^ x;\n"                               \
+    "}\n"
+
+static inline uint32_t keyword_hash_mix(uint32_t x)
+{
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    return (x >> 16) ^ x;
+}
+
+static uint32_t g_keyword_hashes[KEYWORD_TOTAL];
+static uint32_t g_displacements[KEYWORD_BUCKETS];
+static int g_slots[KEYWORD_TOTAL];
+
+// Same hash the scanner computes with strings_hash_step while reading an identifier
+static uint32_t keyword_hash(const char* str)
+{
+    uint32_t hash = 0;
+    while (*str) {
+        hash = strings_hash_step(hash, *str++);
+    }
+
+    return hash;
+}
+
+static void build_keyword_hash(void)
+{
+    unsigned sizes[KEYWORD_BUCKETS] = {0};
+    unsigned order[KEYWORD_BUCKETS];
+
+    for (size_t i = 0; i < KEYWORD_TOTAL; ++i) {
+        g_keyword_hashes[i] = keyword_hash(g_keywords[i]);
+        for (size_t j = 0; j < i; ++j) {
+            if (g_keyword_hashes[i] == g_keyword_hashes[j]) {
+                fprintf(stderr, "lexgen: keywords '%s' and '%s' have the same hash\n", g_keywords[i], g_keywords[j]);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        ++sizes[keyword_hash_mix(g_keyword_hashes[i]) % KEYWORD_BUCKETS];
+    }
+
+    // Place largest buckets first while the table is still empty
+    for (unsigned b = 0; b < KEYWORD_BUCKETS; ++b) {
+        order[b] = b;
+    }
+
+    for (unsigned i = 1; i < KEYWORD_BUCKETS; ++i) {
+        for (unsigned j = i; j > 0 && sizes[order[j - 1]] < sizes[order[j]]; --j) {
+            unsigned t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+
+    for (size_t i = 0; i < KEYWORD_TOTAL; ++i) {
+        g_slots[i] = -1;
+    }
+
+    for (unsigned n = 0; n < KEYWORD_BUCKETS; ++n) {
+        unsigned b = order[n];
+        if (sizes[b] == 0) {
+            break;
+        }
+
+        uint32_t d;
+        for (d = 0; d < MAX_DISPLACEMENT; ++d) {
+            unsigned taken[KEYWORD_TOTAL];
+            unsigned total = 0;
+            bool ok = true;
+
+            for (size_t i = 0; i < KEYWORD_TOTAL && ok; ++i) {
+                uint32_t h = g_keyword_hashes[i];
+                if (keyword_hash_mix(h) % KEYWORD_BUCKETS != b) {
+                    continue;
+                }
+
+                unsigned slot = keyword_hash_mix(h ^ d) % KEYWORD_TOTAL;
+                if (g_slots[slot] >= 0) {
+                    ok = false;
+                }
+
+                for (unsigned j = 0; j < total && ok; ++j) {
+                    ok = (taken[j] != slot);
+                }
+
+                taken[total++] = slot;
+            }
+
+            if (!ok) {
+                continue;
+            }
+
+            total = 0;
+            for (size_t i = 0; i < KEYWORD_TOTAL; ++i) {
+                if (keyword_hash_mix(g_keyword_hashes[i]) % KEYWORD_BUCKETS == b) {
+                    g_slots[taken[total++]] = i;
+                }
+            }
+
+            g_displacements[b] = d;
+            break;
+        }
+
+        if (d == MAX_DISPLACEMENT) {
+            fprintf(stderr, "lexgen: could not build keyword hash\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Powers of five, normalized so that the top bit of a 128-bit value is set.
+ * Positive powers are truncated, negative powers are reciprocals rounded up,
+ * which is what the conversion algorithm expects.
+ */
+
+#define POW5_MIN_EXPONENT   (-342)
+#define POW5_MAX_EXPONENT   308
+#define POW5_TOTAL          (POW5_MAX_EXPONENT - POW5_MIN_EXPONENT + 1)
+#define BIG_LIMBS           64
+
+// Little-endian 32-bit limbs, large enough for 2^1800
+typedef struct
+{
+    uint32_t limbs[BIG_LIMBS];
+} big_t;
+
+static void big_set(big_t* x, uint32_t v)
+{
+    memset(x, 0, sizeof(*x));
+    x->limbs[0] = v;
+}
+
+static unsigned big_bits(const big_t* x)
+{
+    for (int i = BIG_LIMBS - 1; i >= 0; --i) {
+        if (x->limbs[i]) {
+            return i * 32 + (32 - __builtin_clz(x->limbs[i]));
+        }
+    }
+
+    return 0;
+}
+
+static void big_mul_small(big_t* x, uint32_t m)
+{
+    uint64_t carry = 0;
+    for (int i = 0; i < BIG_LIMBS; ++i) {
+        uint64_t v = (uint64_t)x->limbs[i] * m + carry;
+        x->limbs[i] = (uint32_t)v;
+        carry = v >> 32;
+    }
+
+    if (carry) {
+        fprintf(stderr, "lexgen: big integer overflow\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void big_div_small(big_t* x, uint32_t d)
+{
+    uint64_t rem = 0;
+    for (int i = BIG_LIMBS - 1; i >= 0; --i) {
+        uint64_t v = (rem << 32) | x->limbs[i];
+        x->limbs[i] = (uint32_t)(v / d);
+        rem = v % d;
+    }
+}
+
+static void big_add_small(big_t* x, uint32_t a)
+{
+    for (int i = 0; i < BIG_LIMBS && a; ++i) {
+        uint64_t v = (uint64_t)x->limbs[i] + a;
+        x->limbs[i] = (uint32_t)v;
+        a = (uint32_t)(v >> 32);
+    }
+}
+
+static void big_shift_left(big_t* x, unsigned n)
+{
+    big_t r;
+    big_set(&r, 0);
+    for (int i = BIG_LIMBS - 1; i >= 0; --i) {
+        for (int b = 31; b >= 0; --b) {
+            unsigned src = i * 32 + b;
+            if (src + n < BIG_LIMBS * 32 && (x->limbs[i] >> b) & 1) {
+                r.limbs[(src + n) / 32] |= 1u << ((src + n) % 32);
+            }
+        }
+    }
+
+    *x = r;
+}
+
+static void big_shift_right(big_t* x, unsigned n)
+{
+    big_t r;
+    big_set(&r, 0);
+    for (unsigned src = n; src < BIG_LIMBS * 32; ++src) {
+        if ((x->limbs[src / 32] >> (src % 32)) & 1) {
+            r.limbs[(src - n) / 32] |= 1u << ((src - n) % 32);
+        }
+    }
+
+    *x = r;
+}
+
+static uint64_t g_pow5[POW5_TOTAL][2];
+
+static void build_pow5(void)
+{
+    for (int q = POW5_MIN_EXPONENT; q <= POW5_MAX_EXPONENT; ++q) {
+        big_t power5;
+        big_set(&power5, 1);
+        for (int i = 0; i < abs(q); ++i) {
+            big_mul_small(&power5, 5);
+        }
+
+        big_t c;
+        if (q < 0) {
+            // 2^b / 5^-q + 1, with 2^(z-1) < 5^-q < 2^z
+            unsigned z = big_bits(&power5);
+            unsigned b = (q >= -27) ? z + 127 : 2 * z + 128;
+
+            big_set(&c, 1);
+            big_shift_left(&c, b);
+            for (int i = 0; i < -q; ++i) {
+                big_div_small(&c, 5);
+            }
+
+            big_add_small(&c, 1);
+        } else {
+            c = power5;
+        }
+
+        unsigned bits = big_bits(&c);
+        if (bits < 128) {
+            big_shift_left(&c, 128 - bits);
+        } else {
+            big_shift_right(&c, bits - 128);
+        }
+
+        g_pow5[q - POW5_MIN_EXPONENT][0] = ((uint64_t)c.limbs[3] << 32) | c.limbs[2];
+        g_pow5[q - POW5_MIN_EXPONENT][1] = ((uint64_t)c.limbs[1] << 32) | c.limbs[0];
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * C11 D.1, ranges of characters allowed in identifiers.
+ * Supplementary planes are added by build_xid, D.2 (not allowed initially) is checked by the scanner.
+ */
+
+#define XID_CODEPOINTS      0x110000
+#define XID_BLOCK_BITS      8
+#define XID_BLOCKS          (XID_CODEPOINTS >> XID_BLOCK_BITS)
+#define XID_BLOCK_WORDS     ((1u << XID_BLOCK_BITS) / 32)
+
+static const uint32_t g_xid_ranges[][2] = {
+    {0x00a8, 0x00a8}, {0x00aa, 0x00aa}, {0x00ad, 0x00ad}, {0x00af, 0x00af}, {0x00b2, 0x00b5},
+    {0x00b7, 0x00ba}, {0x00bc, 0x00be}, {0x00c0, 0x00d6}, {0x00d8, 0x00f6}, {0x00f8, 0x00ff},
+    {0x0100, 0x167f}, {0x1681, 0x180d}, {0x180f, 0x1fff},
+    {0x200b, 0x200d}, {0x202a, 0x202e}, {0x203f, 0x2040}, {0x2054, 0x2054}, {0x2060, 0x206f},
+    {0x2070, 0x218f}, {0x2460, 0x24ff}, {0x2776, 0x2793}, {0x2c00, 0x2dff}, {0x2e80, 0x2fff},
+    {0x3004, 0x3007}, {0x3021, 0x302f}, {0x3031, 0x303f}, {0x3040, 0xd7ff},
+    {0xf900, 0xfd3d}, {0xfd40, 0xfdcf}, {0xfdf0, 0xfe44}, {0xfe47, 0xfffd},
+};
+
+static uint32_t g_xid_bits[XID_CODEPOINTS / 32];
+static uint32_t g_xid_blocks[256][XID_BLOCK_WORDS];
+static unsigned g_xid_index[XID_BLOCKS];
+static unsigned g_xid_total_blocks = 0;
+
+static void xid_set(uint32_t first, uint32_t last)
+{
+    for (uint32_t cp = first; cp <= last; ++cp) {
+        g_xid_bits[cp / 32] |= 1u << (cp % 32);
+    }
+}
+
+static void build_xid(void)
+{
+    for (size_t i = 0; i < countof(g_xid_ranges); ++i) {
+        xid_set(g_xid_ranges[i][0], g_xid_ranges[i][1]);
+    }
+
+    // 10000-1FFFD, 20000-2FFFD, ... E0000-EFFFD
+    for (uint32_t plane = 1; plane <= 0xe; ++plane) {
+        xid_set(plane << 16, (plane << 16) | 0xfffd);
+    }
+
+    // Merge identical blocks
+    for (unsigned b = 0; b < XID_BLOCKS; ++b) {
+        const uint32_t* bits = &g_xid_bits[b * XID_BLOCK_WORDS];
+        unsigned k = 0;
+        while (k < g_xid_total_blocks && memcmp(g_xid_blocks[k], bits, sizeof(g_xid_blocks[k]))) {
+            ++k;
+        }
+
+        if (k == g_xid_total_blocks) {
+            if (k == countof(g_xid_blocks)) {
+                fprintf(stderr, "lexgen: too many identifier blocks\n");
+                exit(EXIT_FAILURE);
+            }
+
+            memcpy(g_xid_blocks[k], bits, sizeof(g_xid_blocks[k]));
+            ++g_xid_total_blocks;
+        }
+
+        g_xid_index[b] = k;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+static void print(void)
+{
+    printf("/* Generated by tools/lexgen from tokens.def, do not edit */\n\n");
+
+    printf("#define DFA_STATE_DEAD          %u\n", kStateDead);
+    printf("#define DFA_STATE_START         %u\n", kStateStart);
+    printf("#define DFA_TOTAL_STATES        %u\n", g_total_states);
+    printf("#define DFA_TOTAL_CLASSES       %u\n", g_total_classes);
+    printf("#define DFA_MAX_LENGTH          %u\n\n", g_max_length);
+
+    printf("#define DFA_ACCEPT_NONE         %u\n", kAcceptNone);
+    printf("#define DFA_ACCEPT_OPERATOR     %u\n\n", kAcceptOperator);
+
+    printf("static const uint8_t g_dfa_classes[256] = {");
+    for (unsigned c = 0; c < 256; ++c) {
+        printf("%s%u,", (c % 16) ? " " : "\n    ", g_classes[c]);
+    }
+    printf("\n};\n\n");
+
+    printf("static const uint16_t g_dfa_transitions[DFA_TOTAL_STATES][DFA_TOTAL_CLASSES] = {\n");
+    for (unsigned s = 0; s < g_total_states; ++s) {
+        printf("    {");
+        for (unsigned k = 0; k < g_total_classes; ++k) {
+            printf("%s%u", k ? ", " : "", g_states[s].next[g_class_repr[k]]);
+        }
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    printf("static const uint8_t g_dfa_accept[DFA_TOTAL_STATES] = {");
+    for (unsigned s = 0; s < g_total_states; ++s) {
+        printf("%s%u,", (s % 16) ? " " : "\n    ", g_states[s].accept);
+    }
+    printf("\n};\n\n");
+
+    printf("static const uint8_t g_dfa_accept_index[DFA_TOTAL_STATES] = {");
+    for (unsigned s = 0; s < g_total_states; ++s) {
+        printf("%s%u,", (s % 16) ? " " : "\n    ", g_states[s].index);
+    }
+    printf("\n};\n\n");
+
+    // Operator index + 1 for bytes that are complete punctuators on their own, 0 for others
+    printf("static const uint8_t g_dfa_single[256] = {");
+    for (unsigned c = 0; c < 256; ++c) {
+        printf("%s%u,", (c % 16) ? " " : "\n    ", g_single[c]);
+    }
+    printf("\n};\n\n");
+
+    printf("#define KEYWORD_HASH_BUCKETS    %zu\n", KEYWORD_BUCKETS);
+    printf("#define KEYWORD_HASH_SLOTS      %zu\n\n", KEYWORD_TOTAL);
+
+    printf(KEYWORD_MIX_FUNC "\n");
+
+    printf("static const uint32_t g_keyword_displacements[KEYWORD_HASH_BUCKETS] = {");
+    for (unsigned b = 0; b < KEYWORD_BUCKETS; ++b) {
+        printf("%s%u,", (b % 8) ? " " : "\n    ", g_displacements[b]);
+    }
+    printf("\n};\n\n");
+
+    // Slot to keyword_kind_t
+    printf("static const uint8_t g_keyword_slots[KEYWORD_HASH_SLOTS] = {");
+    for (unsigned s = 0; s < KEYWORD_TOTAL; ++s) {
+        printf("%s%d,", (s % 16) ? " " : "\n    ", g_slots[s]);
+    }
+    printf("\n};\n\n");
+
+    printf("#define POW5_MIN_EXPONENT       (%d)\n", POW5_MIN_EXPONENT);
+    printf("#define POW5_MAX_EXPONENT       %d\n\n", POW5_MAX_EXPONENT);
+
+    // High and low halves of 5^q approximation for q in [POW5_MIN_EXPONENT, POW5_MAX_EXPONENT]
+    printf("static const uint64_t g_pow5_128[%d][2] = {\n", POW5_TOTAL);
+    for (int i = 0; i < POW5_TOTAL; ++i) {
+        printf("    {0x%016llx, 0x%016llx},\n", (unsigned long long)g_pow5[i][0], (unsigned long long)g_pow5[i][1]);
+    }
+    printf("};\n\n");
+
+    printf("#define XID_CODEPOINTS          0x%x\n", XID_CODEPOINTS);
+    printf("#define XID_BLOCK_BITS          %u\n\n", XID_BLOCK_BITS);
+
+    // Block of 256 code points to its bitmap in g_xid_blocks
+    printf("static const uint8_t g_xid_index[%u] = {", XID_BLOCKS);
+    for (unsigned b = 0; b < XID_BLOCKS; ++b) {
+        printf("%s%u,", (b % 16) ? " " : "\n    ", g_xid_index[b]);
+    }
+    printf("\n};\n\n");
+
+    printf("static const uint32_t g_xid_blocks[%u][%u] = {\n", g_xid_total_blocks, XID_BLOCK_WORDS);
+    for (unsigned k = 0; k < g_xid_total_blocks; ++k) {
+        printf("    {");
+        for (unsigned w = 0; w < XID_BLOCK_WORDS; ++w) {
+            printf("%s0x%08x", w ? ", " : "", g_xid_blocks[k][w]);
+        }
+        printf("},\n");
+    }
+    printf("};\n");
+}
+
+int main(void)
+{
+    if (countof(g_keywords) > UINT8_MAX || countof(g_operators) > UINT8_MAX) {
+        fprintf(stderr, "lexgen: too many tokens\n");
+        return EXIT_FAILURE;
+    }
+
+    build_dfa();
+    build_classes();
+    build_keyword_hash();
+    build_pow5();
+    build_xid();
+    print();
+
+    return 0;
+}